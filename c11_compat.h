@@ -63,12 +63,12 @@ DEALINGS IN THE SOFTWARE.
 #include <atomic>
 #endif
 // Evilly patch in the C++11 atomics as if they were C11
-#define memory_order_relaxed std::memory_order::memory_order_relaxed
-#define memory_order_consume std::memory_order::memory_order_consume
-#define memory_order_acquire std::memory_order::memory_order_acquire
-#define memory_order_release std::memory_order::memory_order_release
-#define memory_order_acq_rel std::memory_order::memory_order_acq_rel
-#define memory_order_seq_cst std::memory_order::memory_order_seq_cst
+#define memory_order_relaxed std::memory_order_relaxed
+#define memory_order_consume std::memory_order_consume
+#define memory_order_acquire std::memory_order_acquire
+#define memory_order_release std::memory_order_release
+#define memory_order_acq_rel std::memory_order_acq_rel
+#define memory_order_seq_cst std::memory_order_seq_cst
 
 #define atomic_uint std::atomic<unsigned int>
 #define atomic_init std::atomic_init
@@ -96,6 +96,15 @@ DEALINGS IN THE SOFTWARE.
 #define RESTRICT
 #endif
 
+/* We need thread_local */
+#if !defined(thread_local) && (!defined(__cplusplus) || (defined(_MSC_VER) && _MSC_VER<1900))
+#ifdef _MSC_VER
+#define thread_local __declspec(thread)
+#else
+#define thread_local __thread
+#endif
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -284,6 +293,13 @@ typedef pthread_cond_t cnd_t;
 typedef pthread_mutex_t mtx_t;
 #endif
 
+/* Deadlines are measured against the monotonic clock where condition variables can be told to use it,
+so timespec_get() and cnd_timedwait() always agree */
+#if !defined(_MSC_VER) && defined(CLOCK_MONOTONIC) && !defined(__APPLE__)
+#define C11_COMPAT_CND_MONOTONIC 1
+#else
+#define C11_COMPAT_CND_MONOTONIC 0
+#endif
 #define TIME_UTC 1
 inline int timespec_get(struct timespec *ts, int base)
 {
@@ -312,7 +328,7 @@ inline int timespec_get(struct timespec *ts, int base)
   }
   return base;
 #else
-#ifdef CLOCK_MONOTONIC
+#if C11_COMPAT_CND_MONOTONIC
   clock_gettime(CLOCK_MONOTONIC, ts);
 #else
   struct timeval tv;
@@ -340,8 +356,10 @@ inline int cnd_timedwait(cnd_t *RESTRICT cond, mtx_t *RESTRICT mtx, const struct
 {
   struct timespec now;
   DWORD interval;
+  long long diff;
   timespec_get(&now, TIME_UTC);
-  interval=(DWORD)(timespec_diff(ts, &now)/1000000);
+  diff=timespec_diff(ts, &now);
+  interval=diff>0 ? (DWORD)(diff/1000000) : 0;
   return SleepConditionVariableSRW(cond, mtx, interval, 0) ? thrd_success : thrd_timeout;
 }
 inline int cnd_wait(cnd_t *cond, mtx_t *mtx) { return SleepConditionVariableSRW(cond, mtx, INFINITE, 0) ? thrd_success : thrd_timeout; }
@@ -355,7 +373,20 @@ inline int mtx_unlock(mtx_t *mtx) { ReleaseSRWLockExclusive(mtx); return thrd_su
 #else
 #define cnd_broadcast pthread_cond_broadcast
 #define cnd_destroy pthread_cond_destroy
-#define cnd_init(a) pthread_cond_init((a), NULL)
+inline int cnd_init(cnd_t *cond)
+{
+#if C11_COMPAT_CND_MONOTONIC
+  int ret;
+  pthread_condattr_t attr;
+  if((ret=pthread_condattr_init(&attr))) return ret;
+  if(!(ret=pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)))
+    ret=pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+  return ret;
+#else
+  return pthread_cond_init(cond, NULL);
+#endif
+}
 #define cnd_signal pthread_cond_signal
 #define cnd_timedwait pthread_cond_timedwait
 #define cnd_wait pthread_cond_wait
@@ -381,7 +412,19 @@ typedef uintptr_t thrd_t;
 
 inline int thrd_create(thrd_t *thr, thrd_start_t func, void *arg)
 {
-  *thr=_beginthread((void (*)(void *)) func, 0, arg);
+  *thr=_beginthreadex(NULL, 0, (unsigned (__stdcall *)(void *)) func, arg, 0, NULL);
+  return *thr ? thrd_success : thrd_error;
+}
+inline int thrd_join(thrd_t thr, int *res)
+{
+  DWORD code;
+  if(WAIT_OBJECT_0!=WaitForSingleObject((HANDLE) thr, INFINITE)) return thrd_error;
+  if(res)
+  {
+    GetExitCodeThread((HANDLE) thr, &code);
+    *res=(int) code;
+  }
+  CloseHandle((HANDLE) thr);
   return thrd_success;
 }
 inline int thrd_sleep(const struct timespec *duration, const struct timespec *remaining)
@@ -399,7 +442,13 @@ typedef pthread_t thrd_t;
 
 inline int thrd_create(thrd_t *thr, thrd_start_t func, void *arg)
 {
-  pthread_create(thr, NULL, (void *(*)(void *))func, arg);
+  return pthread_create(thr, NULL, (void *(*)(void *))func, arg) ? thrd_error : thrd_success;
+}
+inline int thrd_join(thrd_t thr, int *res)
+{
+  void *ret;
+  if(pthread_join(thr, &ret)) return thrd_error;
+  if(res) *res=(int)(size_t) ret;
   return thrd_success;
 }
 inline int thrd_sleep(const struct timespec *duration, struct timespec *remaining)
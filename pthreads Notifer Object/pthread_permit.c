@@ -28,14 +28,15 @@ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 DEALINGS IN THE SOFTWARE.
 */
 
-//! The maximum number of pthread_permit_select which can occur simultaneously
-#define MAX_PTHREAD_PERMIT_SELECTS 64
+//! The number of permits pthread_permit_select() can link to without calling malloc(). Documented as 32 in pthread_permit.h.
+#define PTHREAD_PERMIT_SELECT_INLINE_LINKS 32
 //! The magic to use for consuming permits
 #define PERMIT_CONSUMING_PERMIT_MAGIC (*(const unsigned *)"CPER")
 //! The magic to use for non-consuming permits
 #define PERMIT_NONCONSUMING_PERMIT_MAGIC (*(const unsigned *)"NCPR")
 
 #include "pthread_permit.h"
+#include <stddef.h>
 #include <string.h>
 
 #ifdef _WIN32
@@ -75,17 +76,31 @@ DEALINGS IN THE SOFTWARE.
 #include <unistd.h>
 #include <poll.h>
 #endif
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-typedef struct pthread_permit_select_s
+struct pthread_permit_waiter_s
 {
-  atomic_uint magic;                  /* Used to ensure this structure is valid */
-  cnd_t cond;                         /* Wakes anything waiting for a permit */
-} pthread_permit_select_t;
-static pthread_permit_select_t pthread_permit_selects[MAX_PTHREAD_PERMIT_SELECTS];
+  atomic_uint state;                  /* PTHREAD_PERMIT_WAITER_*. Also the futex word if PTHREAD_PERMIT_USE_FUTEX */
+  pthread_permit_waiter_t *prev, *next; /* Other waiters queued on the same permit, oldest first */
+#if !PTHREAD_PERMIT_USE_FUTEX
+  mtx_t lock;                         /* Serialises state with cond */
+  cnd_t cond;                         /* Wakes the waiter */
+#endif
+};
+typedef struct pthread_permit_select_link_s
+{
+  pthread_permit_waiter_t *select;    /* The select waiting on the permit this link is linked into */
+  pthread_permit_select_link_t *prev, *next; /* Other selects waiting on the same permit */
+  unsigned generation;                /* The generation of the permit when the select began waiting */
+  int taken;                          /* Nonzero once the select has taken the permit */
+} pthread_permit_select_link_t;
 typedef struct pthread_permit_s pthread_permit_t;
 typedef struct pthread_permit_hook_s pthread_permit_hook_t;
 typedef struct pthread_permit_hook_s
@@ -94,226 +109,780 @@ typedef struct pthread_permit_hook_s
   void *data;
   pthread_permit_hook_t *next;
 } pthread_permit_hook_t;
-static char pthread_permitc_hook_t_size_check[sizeof(pthread_permitc_hook_t)==sizeof(pthread_permit_hook_t)];
-static char pthread_permitnc_hook_t_size_check[sizeof(pthread_permitnc_hook_t)==sizeof(pthread_permit_hook_t)];
+/* Compile time checks that the public and private definitions agree, each failing the build as a negative sized array if not */
+static char pthread_permitc_hook_t_size_check[sizeof(pthread_permitc_hook_t)==sizeof(pthread_permit_hook_t) ? 1 : -1];
+static char pthread_permitnc_hook_t_size_check[sizeof(pthread_permitnc_hook_t)==sizeof(pthread_permit_hook_t) ? 1 : -1];
+/* Granters write permit and spin on lockWake while waiters hammer waiters and waited, so the two
+groups are kept on separate cache lines. Hook chains are rarely used so they live out of line. */
 typedef struct pthread_permit_s
-{ /* NOTE: KEEP THIS HEADER THE SAME AS pthread_permit1_t to allow its grant() to optionally work here */
+{
+  /* Read mostly or written by granters */
   atomic_uint magic;                  /* Used to ensure this structure is valid */
   atomic_uint permit;                 /* =0 no permit, =1 yes permit */
-  atomic_uint waiters, waited;        /* Keeps track of when a thread waits and wakes */
-  cnd_t cond;                         /* Wakes anything waiting for a permit */
-
-  /* Extensions from pthread_permit1_t type */
-  unsigned replacePermit;             /* What to replace the permit with when consumed */
   atomic_uint lockWake;               /* Used to exclude new wakers if and only if waiters don't consume */
-  pthread_permit_hook_t *RESTRICT hooks[PTHREAD_PERMIT_HOOK_TYPE_LAST];
-  pthread_permit_select_t *volatile RESTRICT selects[MAX_PTHREAD_PERMIT_SELECTS]; /* select permit parent */
+  unsigned replacePermit;             /* What to replace the permit with when consumed */
+  unsigned flags;                     /* The PTHREAD_PERMIT_FLAG_* this permit was initialised with */
+  atomic_uint lockSelects;            /* Serialises the list of selects */
+  pthread_permit_select_link_t *selects; /* Selects currently waiting on this permit */
+  pthread_permit_hook_t *RESTRICT *hooks; /* PTHREAD_PERMIT_HOOK_TYPE_LAST hook chains, allocated on first hook push */
+  atomic_uint lockHooks;              /* Serialises changes to the hook chains */
+  atomic_uint hookEpoch;              /* Advanced by each hook removal */
+  atomic_uint hookReaders[2];         /* Count of threads calling hooks, by parity of the epoch they entered in */
+  atomic_uint generation;             /* Advanced by each grant if waiters don't consume */
+  char padding[PTHREAD_PERMIT_CACHE_LINE_SIZE-11*sizeof(unsigned)-2*sizeof(void *)];
+
+  /* Written by waiters */
+  atomic_uint waiters, waited;        /* Keeps track of when a thread waits and wakes */
+  atomic_uint spinAverage;            /* Running average of backoff spent spinning before a grant arrived */
+  atomic_uint continuationState;      /* PTHREAD_PERMIT_CONTINUATIONS_* */
+  pthread_permit_continuation_t *continuations; /* The newest queued continuation */
+  atomic_uint lockQueue;              /* Serialises the queue of waiters */
+  atomic_uint queued;                 /* The number of waiters queued, or sleeping if process shared */
+  pthread_permit_waiter_t *queue, *queueTail; /* Waiters queued for a grant to wake them, oldest first */
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+  atomic_uint counters[PTHREAD_PERMIT_COUNTER_LAST]; /* Indexed by PTHREAD_PERMIT_COUNTER_* */
+#endif
 } pthread_permit_t;
-static char pthread_permitc_t_size_check[sizeof(pthread_permitc_t)==sizeof(pthread_permit_t)];
-static char pthread_permitnc_t_size_check[sizeof(pthread_permitnc_t)==sizeof(pthread_permit_t)];
+static char pthread_permitc_t_size_check[sizeof(pthread_permitc_t)==sizeof(pthread_permit_t) ? 1 : -1];
+static char pthread_permitnc_t_size_check[sizeof(pthread_permitnc_t)==sizeof(pthread_permit_t) ? 1 : -1];
+// The padding is sized by hand, so check the waiter written fields really do begin the second cache line
+static char pthread_permit_t_layout_check[offsetof(pthread_permit_t, waiters)==PTHREAD_PERMIT_CACHE_LINE_SIZE ? 1 : -1];
+static char pthread_permitc_t_layout_check[offsetof(pthread_permitc_t, waiters)==PTHREAD_PERMIT_CACHE_LINE_SIZE ? 1 : -1];
+static char pthread_permitnc_t_layout_check[offsetof(pthread_permitnc_t, waiters)==PTHREAD_PERMIT_CACHE_LINE_SIZE ? 1 : -1];
 #define PTHREAD_PERMIT_WAITERS_DONT_CONSUME 1
+//! The head of a permit's hook chain of a given type, or NULL if it has none. Only valid between
+//! pthread_permit_hooks_enter() and pthread_permit_hooks_exit() or while holding lockHooks.
+#define PTHREAD_PERMIT_HOOKS(permit, type) ((permit)->hooks ? (permit)->hooks[type] : NULL)
+//! The flags which may be passed to pthread_permitX_init_flags()
+#if PTHREAD_PERMIT_USE_FUTEX
+#define PTHREAD_PERMIT_FLAGS_PUBLIC (PTHREAD_PERMIT_FLAG_ADAPTIVE|PTHREAD_PERMIT_FLAG_FAIR|PTHREAD_PERMIT_FLAG_PSHARED)
+#else
+#define PTHREAD_PERMIT_FLAGS_PUBLIC (PTHREAD_PERMIT_FLAG_ADAPTIVE|PTHREAD_PERMIT_FLAG_FAIR)
+#endif
+//! True if the permit may be used by other processes, so must keep nothing specific to this one
+#define PTHREAD_PERMIT_PSHARED(permit) (((permit)->flags&PTHREAD_PERMIT_FLAG_PSHARED)!=0)
+
+/* Adaptive spinning. A waiter spins for at most twice the running average of what recent waits
+upon that permit needed plus PTHREAD_PERMIT_SPIN_MIN, capped at PTHREAD_PERMIT_SPIN_MAX. All are
+measured in CPU relax instructions. */
+//! The minimum number of CPU relaxes an adaptive waiter spins for
+#define PTHREAD_PERMIT_SPIN_MIN 64
+//! The maximum number of CPU relaxes an adaptive waiter spins for
+#define PTHREAD_PERMIT_SPIN_MAX 16384
+//! The maximum number of CPU relaxes an adaptive waiter does between attempts
+#define PTHREAD_PERMIT_SPIN_BACKOFF_MAX 256
+#if defined(_MSC_VER)
+#define PTHREAD_PERMIT_CPU_RELAX() YieldProcessor()
+#elif defined(__i386__) || defined(__x86_64__)
+#define PTHREAD_PERMIT_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define PTHREAD_PERMIT_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define PTHREAD_PERMIT_CPU_RELAX() atomic_thread_fence(memory_order_seq_cst)
+#endif
+
+typedef struct pthread_permit_backoff_s
+{
+  unsigned budget, spent, pause;
+} pthread_permit_backoff_t;
+/* Sets up a spin using the average spin an adaptive permit needed recently. A budget of zero means don't spin. */
+static void pthread_permit_backoff_init(pthread_permit_backoff_t *b, const pthread_permit_t *permit)
+{
+  b->spent=0;
+  b->pause=1;
+  if(permit->flags&PTHREAD_PERMIT_FLAG_ADAPTIVE)
+  {
+    unsigned average=atomic_load_explicit((atomic_uint *) &permit->spinAverage, memory_order_relaxed);
+    b->budget=(average<(PTHREAD_PERMIT_SPIN_MAX-PTHREAD_PERMIT_SPIN_MIN)/2) ? 2*average+PTHREAD_PERMIT_SPIN_MIN : PTHREAD_PERMIT_SPIN_MAX;
+  }
+  else
+    b->budget=0;
+}
+/* Spins once with exponential backoff, returning zero when the budget is exhausted and the caller should sleep */
+static int pthread_permit_backoff(pthread_permit_backoff_t *b)
+{
+  unsigned n;
+  if(b->spent>=b->budget) return 0;
+  for(n=0; n<b->pause; n++)
+    PTHREAD_PERMIT_CPU_RELAX();
+  b->spent+=b->pause;
+  if(b->pause<PTHREAD_PERMIT_SPIN_BACKOFF_MAX) b->pause<<=1;
+  return 1;
+}
+/* Folds how long a wait spun into the permit's running average. Waits which had to sleep decay
+the average so permits which are granted slowly stop spinning. */
+static void pthread_permit_backoff_learn(pthread_permit_t *permit, const pthread_permit_backoff_t *b)
+{
+  unsigned average;
+  if(!(permit->flags&PTHREAD_PERMIT_FLAG_ADAPTIVE)) return;
+  average=atomic_load_explicit(&permit->spinAverage, memory_order_relaxed);
+  if(b->spent<b->budget)
+    average=(unsigned)((int) average+((int) b->spent-(int) average)/8);
+  else
+    average-=average/8;
+  atomic_store_explicit(&permit->spinAverage, average, memory_order_relaxed);
+}
 
 static int pthread_permit_init(pthread_permit_t *permit, unsigned magic, unsigned flags, _Bool initial)
 {
+  // Process shared waiters can't queue, so can't be served in order
+  if(!(flags&PTHREAD_PERMIT_WAITERS_DONT_CONSUME) && (flags&PTHREAD_PERMIT_FLAG_FAIR) && (flags&PTHREAD_PERMIT_FLAG_PSHARED))
+    return thrd_error;
   memset(permit, 0, sizeof(pthread_permit_t));
   permit->permit=initial;
-  if(thrd_success!=cnd_init(&permit->cond)) return thrd_error;
   permit->replacePermit=(flags&PTHREAD_PERMIT_WAITERS_DONT_CONSUME)!=0;
+  permit->flags=flags&PTHREAD_PERMIT_FLAGS_PUBLIC;
   atomic_store_explicit(&permit->magic, magic, memory_order_seq_cst);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_INIT, permit, 0);
   return thrd_success;
 }
 
-static int pthread_permit_pushhook(pthread_permit_t *permit, pthread_permit_hook_type_t type, pthread_permit_hook_t *hook)
+/* Hook chains are read without any lock by the permit operations calling them. Changes to the chains are
+serialised by lockHooks, and are published such that a reader sees either the old or the new chain. A
+delinked hook may still be being called though, so removal waits for every reader which entered before
+the removal to exit before it returns the hook to its owner. Readers never wait for anything, though
+one racing a removal retries its entry. */
+static unsigned pthread_permit_hooks_enter(pthread_permit_t *permit)
+{
+  unsigned epoch;
+  for(;;)
+  {
+    epoch=atomic_load_explicit(&permit->hookEpoch, memory_order_seq_cst);
+    atomic_fetch_add_explicit(&permit->hookReaders[epoch&1], 1U, memory_order_seq_cst);
+    // Pairs with the fence in pthread_permit_hooks_synchronise(), so a reader it doesn't wait for sees the removal
+    atomic_thread_fence(memory_order_seq_cst);
+    /* If the epoch moved between the load and the increment, a removal may already have waited on
+    this parity and the next one will wait on the other, so this reader would be counted by neither */
+    if(epoch==atomic_load_explicit(&permit->hookEpoch, memory_order_seq_cst))
+      return epoch&1;
+    atomic_fetch_add_explicit(&permit->hookReaders[epoch&1], (unsigned)-1, memory_order_release);
+  }
+}
+static void pthread_permit_hooks_exit(pthread_permit_t *permit, unsigned epoch)
+{
+  atomic_fetch_add_explicit(&permit->hookReaders[epoch], (unsigned)-1, memory_order_release);
+}
+/* Calls the hook chain of a type, if there is one */
+static void pthread_permit_callhooks(pthread_permit_t *permit, pthread_permit_hook_type_t type)
+{
+  pthread_permit_hook_t *hook;
+  unsigned epoch;
+  if(!permit->hooks) return;
+  PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_HOOKCALLS);
+  epoch=pthread_permit_hooks_enter(permit);
+  if((hook=permit->hooks[type]))
+    hook->func(type, permit, hook);
+  pthread_permit_hooks_exit(permit, epoch);
+}
+static void pthread_permit_hooks_lock(pthread_permit_t *permit)
 {
   unsigned expected;
+  while((expected=0, !atomic_compare_exchange_weak_explicit(&permit->lockHooks, &expected, 1U, memory_order_acquire, memory_order_relaxed)))
+    thrd_yield();
+}
+static void pthread_permit_hooks_unlock(pthread_permit_t *permit)
+{
+  atomic_store_explicit(&permit->lockHooks, 0U, memory_order_release);
+}
+/* Waits until no reader can still be calling a hook delinked before this call. Call with lockHooks held
+and never from within a hook of the same permit. */
+static void pthread_permit_hooks_synchronise(pthread_permit_t *permit)
+{
+  unsigned epoch=atomic_load_explicit(&permit->hookEpoch, memory_order_relaxed);
+  atomic_store_explicit(&permit->hookEpoch, epoch+1, memory_order_seq_cst);
+  atomic_thread_fence(memory_order_seq_cst);
+  // Readers entering from now on see the new chains, so only those of the old epoch matter
+  while(atomic_load_explicit(&permit->hookReaders[epoch&1], memory_order_acquire))
+    thrd_yield();
+}
+
+static int pthread_permit_pushhook(pthread_permit_t *permit, pthread_permit_hook_type_t type, pthread_permit_hook_t *hook)
+{
+  pthread_permit_hook_t *RESTRICT *hooks=0;
   if(type<0 || type>=PTHREAD_PERMIT_HOOK_TYPE_LAST) return thrd_error;
-  // Serialise
-  while((expected=0, !atomic_compare_exchange_weak_explicit(&permit->lockWake, &expected, 1U, memory_order_relaxed, memory_order_relaxed)))
-  {
-    //if(1==cpus) thrd_yield();
+  // Another process could neither call the hook nor free the chains
+  if(PTHREAD_PERMIT_PSHARED(permit)) return thrd_error;
+  // Allocate the hook chains outside the lock if this is the first hook
+  if(!permit->hooks && !(hooks=(pthread_permit_hook_t *RESTRICT *) calloc(PTHREAD_PERMIT_HOOK_TYPE_LAST, sizeof(pthread_permit_hook_t *))))
+    return thrd_nomem;
+  pthread_permit_hooks_lock(permit);
+  if(!permit->hooks)
+  { // Publish the zeroed chains before anything can see them
+    atomic_thread_fence(memory_order_release);
+    permit->hooks=hooks;
+    hooks=0;
   }
   hook->next=permit->hooks[type];
+  // Publish the hook's next before the hook itself
+  atomic_thread_fence(memory_order_release);
   permit->hooks[type]=hook;
-  // Unlock
-  permit->lockWake=0;
+  pthread_permit_hooks_unlock(permit);
+  free(hooks);
   return thrd_success;
 }
 
+/* Delinks a specific hook wherever it is in the chain. Call with lockHooks held, and synchronise before
+letting go of the hook. */
+static int pthread_permit_unlinkhook(pthread_permit_t *permit, pthread_permit_hook_type_t type, pthread_permit_hook_t *hook)
+{
+  pthread_permit_hook_t *RESTRICT *hookptr;
+  if(!permit->hooks) return thrd_error;
+  for(hookptr=&permit->hooks[type]; *hookptr; hookptr=&(*hookptr)->next)
+  {
+    if(*hookptr==hook)
+    {
+      *hookptr=(*hookptr)->next;
+      return thrd_success;
+    }
+  }
+  return thrd_error;
+}
+
+/* Delinks a specific hook wherever it is in the chain, returning once nothing can be calling it */
+static int pthread_permit_removehook(pthread_permit_t *permit, pthread_permit_hook_type_t type, pthread_permit_hook_t *hook)
+{
+  int ret;
+  pthread_permit_hooks_lock(permit);
+  if(thrd_success==(ret=pthread_permit_unlinkhook(permit, type, hook)))
+    pthread_permit_hooks_synchronise(permit);
+  pthread_permit_hooks_unlock(permit);
+  return ret;
+}
+
 static pthread_permit_hook_t *pthread_permit_pophook(pthread_permit_t *permit, pthread_permit_hook_type_t type)
 {
-  unsigned expected;
   pthread_permit_hook_t *ret;
   if(type<0 || type>=PTHREAD_PERMIT_HOOK_TYPE_LAST) { return (pthread_permit_hook_t *)(size_t)-1; }
-  // Serialise
-  while((expected=0, !atomic_compare_exchange_weak_explicit(&permit->lockWake, &expected, 1U, memory_order_relaxed, memory_order_relaxed)))
+  pthread_permit_hooks_lock(permit);
+  if((ret=PTHREAD_PERMIT_HOOKS(permit, type)))
   {
-    //if(1==cpus) thrd_yield();
+    permit->hooks[type]=ret->next;
+    pthread_permit_hooks_synchronise(permit);
+  }
+  pthread_permit_hooks_unlock(permit);
+  return ret;
+}
+
+/* Called after a waiter has taken the permit */
+static void pthread_permit_consumed(pthread_permit_t *permit)
+{
+  if(!permit->replacePermit)
+    pthread_permit_callhooks(permit, PTHREAD_PERMIT_HOOK_TYPE_WAIT);
+}
+
+/* Hands a granted permit to queued continuations, oldest first, until either none remain or
+the permit has been consumed */
+static void pthread_permit_run_continuations(pthread_permit_t *permit)
+{
+  pthread_permit_continuation_t *c;
+  while((c=pthread_permit_continuations_take(&permit->permit, permit->replacePermit, &permit->continuationState, &permit->continuations)))
+  {
+    pthread_permit_consumed(permit);
+    c->func(c);
+  }
+}
+
+static void pthread_permit_lockselects(pthread_permit_t *permit)
+{
+  unsigned expected;
+  // Grants wake selects while holding this, so yield rather than spin against a granter we preempted
+  while((expected=0, !atomic_compare_exchange_weak_explicit(&permit->lockSelects, &expected, 1U, memory_order_acquire, memory_order_relaxed)))
+    thrd_yield();
+}
+static void pthread_permit_unlockselects(pthread_permit_t *permit)
+{
+  atomic_store_explicit(&permit->lockSelects, 0U, memory_order_release);
+}
+
+/* If waiters don't consume permits, every waiter present at the time of a grant must be released
+even if the permit is revoked before it gets to look. Rather than holding off new waiters until
+everything present has left, each grant advances the permit's generation, and a waiter which sees
+the generation change from when it entered has been released. This tries to take the permit, which
+for a non-consuming permit therefore includes having been released by a grant since entering
+generation. */
+static int pthread_permit_take(pthread_permit_t *permit, unsigned generation)
+{
+  unsigned expected=1;
+  if(atomic_compare_exchange_weak_explicit(&permit->permit, &expected, permit->replacePermit, memory_order_relaxed, memory_order_relaxed))
+    return 1;
+  return permit->replacePermit && atomic_load_explicit(&permit->generation, memory_order_acquire)!=generation;
+}
+
+/* Waiters which are about to sleep queue a node on their stack holding their own park word, so each
+grant wakes exactly the waiters it means to and then returns. A grant of a consuming permit hands
+the permit directly to the oldest queued waiter, though waiters not yet queued may still take it
+first unless the permit is fair. A grant of a non-consuming permit releases every waiter queued at
+the time. A node is QUEUED while on the queue, DEQUEUED once a grant has removed it to wake it, and
+GRANTED once the granter has finished with it, after which its waiter may return. Selects park
+upon a node too, which a grant claims by moving it from QUEUED to DEQUEUED so each select is woken
+once however many of its permits are granted, and which the select rearms before looking again. */
+#define PTHREAD_PERMIT_WAITER_QUEUED 0U
+#define PTHREAD_PERMIT_WAITER_DEQUEUED 1U
+#define PTHREAD_PERMIT_WAITER_GRANTED 2U
+static int pthread_permit_waiter_init(pthread_permit_waiter_t *w)
+{
+  atomic_store_explicit(&w->state, PTHREAD_PERMIT_WAITER_QUEUED, memory_order_relaxed);
+  w->prev=w->next=0;
+#if !PTHREAD_PERMIT_USE_FUTEX
+  if(thrd_success!=mtx_init(&w->lock, mtx_plain)) return thrd_error;
+  if(thrd_success!=cnd_init(&w->cond))
+  {
+    mtx_destroy(&w->lock);
+    return thrd_error;
+  }
+#endif
+  return thrd_success;
+}
+static void pthread_permit_waiter_destroy(pthread_permit_waiter_t *w)
+{
+#if !PTHREAD_PERMIT_USE_FUTEX
+  // The granter may still hold the lock having just set GRANTED
+  mtx_lock(&w->lock);
+  mtx_unlock(&w->lock);
+  cnd_destroy(&w->cond);
+  mtx_destroy(&w->lock);
+#else
+  (void) w;
+#endif
+}
+/* Sleeps until the waiter is granted, a signal arrives or ts passes, diff being the nanoseconds until it does */
+static int pthread_permit_waiter_sleep(pthread_permit_waiter_t *w, const struct timespec *ts, long long diff)
+{
+#if PTHREAD_PERMIT_USE_FUTEX
+  unsigned state=atomic_load_explicit(&w->state, memory_order_acquire);
+  struct timespec rel;
+  if(PTHREAD_PERMIT_WAITER_GRANTED==state) return thrd_success;
+  rel.tv_sec=(time_t)(diff/1000000000);
+  rel.tv_nsec=(long)(diff%1000000000);
+  return pthread_permit_futex_wait(&w->state, state, ts ? &rel : NULL);
+#else
+  int ret=thrd_success;
+  (void) diff;
+  mtx_lock(&w->lock);
+  while(thrd_success==ret && PTHREAD_PERMIT_WAITER_GRANTED!=atomic_load_explicit(&w->state, memory_order_relaxed))
+    ret=ts ? cnd_timedwait(&w->cond, &w->lock, ts) : cnd_wait(&w->cond, &w->lock);
+  mtx_unlock(&w->lock);
+  return ret;
+#endif
+}
+/* Wakes a waiter dequeued by a grant. It may return as soon as it sees GRANTED. */
+static void pthread_permit_waiter_unpark(pthread_permit_waiter_t *w)
+{
+#if PTHREAD_PERMIT_USE_FUTEX
+  atomic_store_explicit(&w->state, PTHREAD_PERMIT_WAITER_GRANTED, memory_order_seq_cst);
+  // If the waiter saw GRANTED and left already this wakes at most a spurious wakeup elsewhere, which
+  // every futex sleeper must tolerate anyway
+  pthread_permit_futex_wake(&w->state, 1);
+#else
+  mtx_lock(&w->lock);
+  atomic_store_explicit(&w->state, PTHREAD_PERMIT_WAITER_GRANTED, memory_order_release);
+  cnd_signal(&w->cond);
+  mtx_unlock(&w->lock);
+#endif
+}
+
+/* Process shared permits can't queue waiters, as a granter in another process can't reach their
+nodes, so their waiters instead sleep upon the permit word of a consuming permit or the generation
+of a non-consuming one, counting themselves in queued so granters know to wake them. Nothing is
+locked whilst waiting, so a waiting process which dies leaves at most queued too high. */
+#if PTHREAD_PERMIT_USE_FUTEX
+/* As pthread_permit_futex_wait(), but upon a word which other processes may sleep upon too */
+static int pthread_permit_futex_wait_shared(atomic_uint *addr, unsigned expected, const struct timespec *reltime)
+{
+  if(-1==syscall(SYS_futex, (unsigned *) addr, FUTEX_WAIT, expected, reltime, NULL, 0))
+  {
+    if(ETIMEDOUT==errno) return thrd_timeout;
+    if(EAGAIN!=errno && EINTR!=errno) return thrd_error;
+  }
+  return thrd_success;
+}
+/* Wakes up to count threads of any process sleeping upon addr, returning how many were woken */
+static unsigned pthread_permit_futex_wake_shared(atomic_uint *addr, int count)
+{
+  long woken=syscall(SYS_futex, (unsigned *) addr, FUTEX_WAKE, count, NULL, NULL, 0);
+  return woken>0 ? (unsigned) woken : 0;
+}
+#else
+// Process shared permits can't be initialised without futexes, so these are never called
+static int pthread_permit_futex_wait_shared(atomic_uint *addr, unsigned expected, const struct timespec *reltime)
+{
+  (void) addr; (void) expected; (void) reltime;
+  return thrd_error;
+}
+static unsigned pthread_permit_futex_wake_shared(atomic_uint *addr, int count)
+{
+  (void) addr; (void) count;
+  return 0;
+}
+#endif
+/* Sleeps until a process shared permit is taken or ts passes */
+static int pthread_permit_pshared_park(pthread_permit_t *permit, unsigned generation, pthread_mutex_t *mtx, const struct timespec *ts)
+{
+  int ret=thrd_success;
+  struct timespec now, rel;
+  atomic_fetch_add_explicit(&permit->queued, 1U, memory_order_seq_cst);
+  // Pairs with the granter's change of the word then check of queued, so it either sees us or we see it
+  atomic_thread_fence(memory_order_seq_cst);
+  while(!pthread_permit_take(permit, generation))
+  {
+    if(ts)
+    {
+      long long diff;
+      timespec_get(&now, TIME_UTC);
+      if((diff=timespec_diff(ts, &now))<=0) { ret=thrd_timeout; break; }
+      rel.tv_sec=(time_t)(diff/1000000000);
+      rel.tv_nsec=(long)(diff%1000000000);
+    }
+    PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_SLEEPS);
+    mtx_unlock(mtx);
+    if(permit->replacePermit)
+      ret=pthread_permit_futex_wait_shared(&permit->generation, generation, ts ? &rel : NULL);
+    else
+      ret=pthread_permit_futex_wait_shared(&permit->permit, 0U, ts ? &rel : NULL);
+    mtx_lock(mtx);
+    if(thrd_success!=ret && thrd_timeout!=ret) break;
+    ret=thrd_success;
   }
-  ret=permit->hooks[type];
-  permit->hooks[type]=ret->next;
-  // Unlock
-  permit->lockWake=0;
+  atomic_fetch_add_explicit(&permit->queued, (unsigned)-1, memory_order_seq_cst);
+  // The grant's wake of a consuming permit may have picked us as we gave up, so pass it on
+  if(thrd_success!=ret && !permit->replacePermit && atomic_load_explicit(&permit->permit, memory_order_seq_cst)
+    && atomic_load_explicit(&permit->queued, memory_order_seq_cst))
+    pthread_permit_futex_wake_shared(&permit->permit, 1);
   return ret;
 }
+/* Wakes the sleepers of a just granted process shared permit, returning how many were woken. Only
+one is woken for a consuming permit, which may find it taken already by a thread not sleeping. */
+static unsigned pthread_permit_pshared_wake(pthread_permit_t *permit)
+{
+  unsigned woken, n;
+  if(!atomic_load_explicit(&permit->queued, memory_order_seq_cst)) return 0;
+  if(permit->replacePermit)
+    woken=pthread_permit_futex_wake_shared(&permit->generation, INT_MAX);
+  else
+    woken=pthread_permit_futex_wake_shared(&permit->permit, 1);
+  for(n=0; n<woken; n++)
+    PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_WAKES);
+  return woken;
+}
+
+static void pthread_permit_lockqueue(pthread_permit_t *permit)
+{
+  unsigned expected;
+  while((expected=0, !atomic_compare_exchange_weak_explicit(&permit->lockQueue, &expected, 1U, memory_order_acquire, memory_order_relaxed)))
+    thrd_yield();
+}
+static void pthread_permit_unlockqueue(pthread_permit_t *permit)
+{
+  atomic_store_explicit(&permit->lockQueue, 0U, memory_order_release);
+}
+/* Appends a waiter to the queue. Call with the queue locked. */
+static void pthread_permit_enqueue(pthread_permit_t *permit, pthread_permit_waiter_t *w)
+{
+  w->next=0;
+  if((w->prev=permit->queueTail)) w->prev->next=w; else permit->queue=w;
+  permit->queueTail=w;
+  atomic_fetch_add_explicit(&permit->queued, 1U, memory_order_seq_cst);
+}
+/* Removes a waiter from the queue. Call with the queue locked. */
+static void pthread_permit_dequeue(pthread_permit_t *permit, pthread_permit_waiter_t *w)
+{
+  if(w->next) w->next->prev=w->prev; else permit->queueTail=w->prev;
+  if(w->prev) w->prev->next=w->next; else permit->queue=w->next;
+  atomic_fetch_add_explicit(&permit->queued, (unsigned)-1, memory_order_relaxed);
+}
+/* Hands a granted consuming permit to the oldest queued waiter, if there is one, returning how many waiters were woken */
+static unsigned pthread_permit_handoff(pthread_permit_t *permit)
+{
+  pthread_permit_waiter_t *w=0;
+  unsigned expected=1;
+  if(!atomic_load_explicit(&permit->queued, memory_order_seq_cst)) return 0;
+  pthread_permit_lockqueue(permit);
+  if(permit->queue && atomic_compare_exchange_strong_explicit(&permit->permit, &expected, 0U, memory_order_relaxed, memory_order_relaxed))
+  {
+    w=permit->queue;
+    pthread_permit_dequeue(permit, w);
+    atomic_store_explicit(&w->state, PTHREAD_PERMIT_WAITER_DEQUEUED, memory_order_relaxed);
+  }
+  pthread_permit_unlockqueue(permit);
+  if(!w) return 0;
+  PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_WAKES);
+  pthread_permit_waiter_unpark(w);
+  return 1;
+}
+/* Releases every queued waiter, as when granting a non-consuming permit or destroying it, returning how many were woken */
+static unsigned pthread_permit_releasequeue(pthread_permit_t *permit)
+{
+  pthread_permit_waiter_t *w, *next;
+  unsigned woken=0;
+  if(!atomic_load_explicit(&permit->queued, memory_order_seq_cst)) return 0;
+  pthread_permit_lockqueue(permit);
+  w=permit->queue;
+  for(next=w; next; next=next->next)
+    atomic_store_explicit(&next->state, PTHREAD_PERMIT_WAITER_DEQUEUED, memory_order_relaxed);
+  permit->queue=permit->queueTail=0;
+  atomic_store_explicit(&permit->queued, 0U, memory_order_relaxed);
+  pthread_permit_unlockqueue(permit);
+  for(; w; w=next, woken++)
+  {
+    next=w->next;
+    PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_WAKES);
+    pthread_permit_waiter_unpark(w);
+  }
+  return woken;
+}
+
+/* Wakes every select currently linked into the permit which no other grant has woken since it last
+looked, returning how many were woken */
+static unsigned pthread_permit_signalselects(pthread_permit_t *permit)
+{
+  pthread_permit_select_link_t *link;
+  unsigned woken=0;
+  pthread_permit_lockselects(permit);
+  for(link=permit->selects; link; link=link->next)
+  {
+    unsigned expected=PTHREAD_PERMIT_WAITER_QUEUED;
+    // The select can't delink and exit while we hold the select lock, so can be woken after claiming
+    if(atomic_compare_exchange_strong_explicit(&link->select->state, &expected, PTHREAD_PERMIT_WAITER_DEQUEUED, memory_order_relaxed, memory_order_relaxed))
+    {
+      PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_WAKES);
+      pthread_permit_waiter_unpark(link->select);
+      woken++;
+    }
+  }
+  pthread_permit_unlockselects(permit);
+  return woken;
+}
 
 static void pthread_permit_destroy(pthread_permit_t *permit)
 {
-  if(permit->hooks[PTHREAD_PERMIT_HOOK_TYPE_DESTROY])
-    permit->hooks[PTHREAD_PERMIT_HOOK_TYPE_DESTROY]->func(PTHREAD_PERMIT_HOOK_TYPE_DESTROY, permit, permit->hooks[PTHREAD_PERMIT_HOOK_TYPE_DESTROY]);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_DESTROY, permit, 0);
+  pthread_permit_callhooks(permit, PTHREAD_PERMIT_HOOK_TYPE_DESTROY);
   /* Mark this object as invalid for further use */
   atomic_store_explicit(&permit->magic, 0U, memory_order_seq_cst);
   permit->replacePermit=1;
   permit->permit=1;
-  cnd_destroy(&permit->cond);
+  /* Release every queued continuation, waiter and select */
+  pthread_permit_run_continuations(permit);
+  if(PTHREAD_PERMIT_PSHARED(permit))
+  { // Sleepers of either kind of permit recheck their take, which now always succeeds
+    atomic_fetch_add_explicit(&permit->generation, 1U, memory_order_seq_cst);
+    pthread_permit_futex_wake_shared(&permit->permit, INT_MAX);
+    pthread_permit_futex_wake_shared(&permit->generation, INT_MAX);
+  }
+  else
+  {
+    pthread_permit_releasequeue(permit);
+    pthread_permit_signalselects(permit);
+  }
+  free(permit->hooks);
+  permit->hooks=0;
 }
 
-static int pthread_permit_grant(pthread_permitX_t _permit)
-{ // If permits aren't consumed, prevent any new waiters or granters
-  pthread_permit_t *permit=(pthread_permit_t *) _permit;
-  int ret=thrd_success;
-  size_t n;
+/* Granting is split into phases so pthread_permit_grant_many() can batch the waking of many permits.
+Each phase returns how many threads it woke. */
+static unsigned pthread_permit_grant_begin(pthread_permit_t *permit)
+{
   if(permit->replacePermit)
   {
     unsigned expected;
-    // Only one grant may occur concurrently if permits aren't consumed
+    // Only one grant may occur concurrently if permits aren't consumed. Waiters never wait on this.
     while((expected=0, !atomic_compare_exchange_weak_explicit(&permit->lockWake, &expected, 1U, memory_order_relaxed, memory_order_relaxed)))
     {
+      PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_LOCKWAKEATTEMPTS);
       //if(1==cpus) thrd_yield();
     }
   }
-  // Grant permit
-  atomic_store_explicit(&permit->permit, 1U, memory_order_seq_cst);
-  if(permit->hooks[PTHREAD_PERMIT_HOOK_TYPE_GRANT])
-    permit->hooks[PTHREAD_PERMIT_HOOK_TYPE_GRANT]->func(PTHREAD_PERMIT_HOOK_TYPE_GRANT, permit, permit->hooks[PTHREAD_PERMIT_HOOK_TYPE_GRANT]);
-  // Are there waiters on the permit?
-  if(atomic_load_explicit(&permit->waiters, memory_order_relaxed)!=atomic_load_explicit(&permit->waited, memory_order_relaxed))
-  { // There are indeed waiters. If waiters don't consume permits, release everything
-    if(permit->replacePermit)
-    { // Loop waking until nothing is waiting
-      do
-      {
-        if(thrd_success!=cnd_broadcast(&permit->cond))
-        {
-          ret=thrd_error;
-          goto exit;
-        }
-        // Are there select operations on the permit?
-        for(n=0; n<MAX_PTHREAD_PERMIT_SELECTS; n++)
-        {
-          if(permit->selects[n])
-          {
-            if(thrd_success!=cnd_signal(&permit->selects[n]->cond))
-            {
-              ret=thrd_error;
-              goto exit;
-            }
-          }
-        }
-        //if(1==cpus) thrd_yield();
-      } while(atomic_load_explicit(&permit->waiters, memory_order_relaxed)!=atomic_load_explicit(&permit->waited, memory_order_relaxed));
-    }
-    else
-    { // Loop waking until at least one thread takes the permit
-      while(atomic_load_explicit(&permit->permit, memory_order_relaxed))
-      {
-        if(thrd_success!=cnd_signal(&permit->cond))
-        {
-          ret=thrd_error;
-          goto exit;
-        }
-        // Are there select operations on the permit?
-        for(n=0; n<MAX_PTHREAD_PERMIT_SELECTS; n++)
-        {
-          if(permit->selects[n])
-          {
-            if(thrd_success!=cnd_signal(&permit->selects[n]->cond))
-            {
-              ret=thrd_error;
-              goto exit;
-            }
-          }
-        }
-        //if(1==cpus) thrd_yield();
-      }
-    }
+  PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_GRANTS);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_GRANT, permit, 0);
+  // Grant permit. Regranting an already granted consuming permit changes nothing, so isn't hooked
+  if(!atomic_exchange_explicit(&permit->permit, 1U, memory_order_seq_cst) || permit->replacePermit)
+  {
+    pthread_permit_callhooks(permit, PTHREAD_PERMIT_HOOK_TYPE_GRANT);
   }
-exit:
-  // If permits aren't consumed, granting has completed, so permit new waiters and granters
+  if(permit->replacePermit) // Release everything which entered before now
+    atomic_fetch_add_explicit(&permit->generation, 1U, memory_order_seq_cst);
+  // Continuations are served before any sleeping waiter is woken
+  pthread_permit_run_continuations(permit);
+  if(PTHREAD_PERMIT_PSHARED(permit))
+    return pthread_permit_pshared_wake(permit);
+  // Hand a consuming permit straight to the oldest sleeping waiter, else release every sleeping waiter
+  return permit->replacePermit ? pthread_permit_releasequeue(permit) : pthread_permit_handoff(permit);
+}
+
+/* Wakes the selects upon the permit once, unless a sleeping waiter was handed a consuming permit.
+Selects rearm themselves before looking at their permits, so can't sleep through this. */
+static unsigned pthread_permit_grant_wake(pthread_permit_t *permit)
+{
+  if(PTHREAD_PERMIT_PSHARED(permit)) // Nothing can select upon it
+    return 0;
+  if(permit->replacePermit || atomic_load_explicit(&permit->permit, memory_order_seq_cst))
+    return pthread_permit_signalselects(permit);
+  return 0;
+}
+
+static void pthread_permit_grant_end(pthread_permit_t *permit)
+{ // If permits aren't consumed, granting has completed, so permit new granters
   if(permit->replacePermit)
     permit->lockWake=0;
-  return ret;
+}
+
+static int pthread_permit_grant(pthread_permitX_t _permit)
+{
+  pthread_permit_t *permit=(pthread_permit_t *) _permit;
+  unsigned woken=pthread_permit_grant_begin(permit);
+  woken+=pthread_permit_grant_wake(permit);
+  pthread_permit_grant_end(permit);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_GRANTED, permit, woken);
+  (void) woken;
+  return thrd_success;
 }
 
 static void pthread_permit_revoke(pthread_permit_t *permit)
 {
-  atomic_store_explicit(&permit->permit, 0U, memory_order_relaxed);
-  if(permit->hooks[PTHREAD_PERMIT_HOOK_TYPE_REVOKE])
-    permit->hooks[PTHREAD_PERMIT_HOOK_TYPE_REVOKE]->func(PTHREAD_PERMIT_HOOK_TYPE_REVOKE, permit, permit->hooks[PTHREAD_PERMIT_HOOK_TYPE_REVOKE]);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_REVOKE, permit, 0);
+  // Revoking an ungranted consuming permit changes nothing, so isn't hooked
+  if(atomic_exchange_explicit(&permit->permit, 0U, memory_order_relaxed) || permit->replacePermit)
+    pthread_permit_callhooks(permit, PTHREAD_PERMIT_HOOK_TYPE_REVOKE);
 }
 
-static int pthread_permit_wait(pthread_permit_t *permit, pthread_mutex_t *mtx)
+/* Waits until a grant wakes a queued waiter, or ts passes */
+static int pthread_permit_waiter_park(pthread_permit_t *permit, pthread_permit_waiter_t *w, pthread_mutex_t *mtx, const struct timespec *ts, pthread_permit_backoff_t *backoff)
 {
-  int ret=thrd_success;
-  unsigned expected;
-  // If permits aren't consumed, if a permit is executing then wait here
-  if(permit->replacePermit)
-  {
-    while(atomic_load_explicit(&permit->lockWake, memory_order_acquire))
+  int ret;
+  struct timespec now;
+  (void) permit; // Only used when counting
+  while(PTHREAD_PERMIT_WAITER_GRANTED!=atomic_load_explicit(&w->state, memory_order_acquire))
+  { // Not yet granted, so spin if adaptive, else sleep if we have a mutex
+    long long diff=0;
+    if(ts)
     {
-      //if(1==cpus) thrd_yield();
+      timespec_get(&now, TIME_UTC);
+      if((diff=timespec_diff(ts, &now))<=0) return thrd_timeout;
     }
-  }
-  // Increment the monotonic count to indicate we have entered a wait
-  atomic_fetch_add_explicit(&permit->waiters, 1U, memory_order_acquire);
-  // Fetch me a permit, excluding all other threads if replacePermit is zero
-  while((expected=1, !atomic_compare_exchange_weak_explicit(&permit->permit, &expected, permit->replacePermit, memory_order_relaxed, memory_order_relaxed)))
-  { // Permit is not granted, so wait if we have a mutex
-    if(mtx)
+    if(pthread_permit_backoff(backoff)) continue;
+    if(!mtx)
     {
-      if(thrd_success!=cnd_wait(&permit->cond, mtx)) ret=thrd_error;
+      thrd_yield();
+      continue;
     }
-    else thrd_yield();
+    PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_SLEEPS);
+    mtx_unlock(mtx);
+    ret=pthread_permit_waiter_sleep(w, ts, diff);
+    mtx_lock(mtx);
+    if(thrd_success!=ret && thrd_timeout!=ret) return ret;
   }
-  // Increment the monotonic count to indicate we have exited a wait
-  atomic_fetch_add_explicit(&permit->waited, 1U, memory_order_relaxed);
-  return ret;
+  return thrd_success;
 }
 
-static int pthread_permit_timedwait(pthread_permit_t *permit, pthread_mutex_t *mtx, const struct timespec *ts)
+/* Waits upon a permit. If ts is null, waits forever unless timed, in which case it doesn't wait at all. */
+static int pthread_permit_queuewait(pthread_permit_t *permit, pthread_mutex_t *mtx, const struct timespec *ts, int timed)
 {
-  int ret=thrd_success;
-  unsigned expected;
+  int ret=thrd_success, fair=!permit->replacePermit && (permit->flags&PTHREAD_PERMIT_FLAG_FAIR)!=0;
+  unsigned generation;
+  pthread_permit_waiter_t me;
+  pthread_permit_backoff_t backoff;
   struct timespec now;
-  // If permits aren't consumed, if a permit is executing then wait here
-  if(permit->replacePermit)
-  {
-    while(atomic_load_explicit(&permit->lockWake, memory_order_acquire))
-    {
-      //if(1==cpus) thrd_yield();
-    }
-  }
+  PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_WAITS);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_WAIT, permit, 0);
   // Increment the monotonic count to indicate we have entered a wait
-  atomic_fetch_add_explicit(&permit->waiters, 1U, memory_order_acquire);
-  // Fetch me a permit, excluding all other threads if replacePermit is zero
-  while((expected=1, !atomic_compare_exchange_weak_explicit(&permit->permit, &expected, permit->replacePermit, memory_order_relaxed, memory_order_relaxed)))
-  { // Permit is not granted, so wait if we have a mutex
-    if(!ts) { ret=thrd_timeout; break; }
-    else
+  atomic_fetch_add_explicit(&permit->waiters, 1U, memory_order_seq_cst);
+  generation=atomic_load_explicit(&permit->generation, memory_order_seq_cst);
+  pthread_permit_backoff_init(&backoff, permit);
+  if(fair)
+  { // Only take the permit directly if nobody is queued before us
+    if(!atomic_load_explicit(&permit->queued, memory_order_seq_cst) && pthread_permit_take(permit, 0))
+      goto taken;
+    if(timed && !ts) { ret=thrd_timeout; goto done; }
+  }
+  else
+  { // Try for the permit until we would sleep. Spinning waiters never queue.
+    while(!pthread_permit_take(permit, generation))
     {
-      long long diff;
-      timespec_get(&now, TIME_UTC);
-      diff=timespec_diff(ts, &now);
-      if(diff<=0) { ret=thrd_timeout; break; }
+      if(timed)
+      {
+        if(!ts) { ret=thrd_timeout; goto done; }
+        timespec_get(&now, TIME_UTC);
+        if(timespec_diff(ts, &now)<=0) { ret=thrd_timeout; goto done; }
+      }
+      if(pthread_permit_backoff(&backoff)) continue;
+      if(mtx && PTHREAD_PERMIT_PSHARED(permit))
+      {
+        if(thrd_success!=(ret=pthread_permit_pshared_park(permit, generation, mtx, ts))) goto done;
+        goto taken;
+      }
+      if(mtx) goto queue;
+      thrd_yield();
     }
-    if(mtx)
-    {
-      int cndret=cnd_timedwait(&permit->cond, mtx, ts);
-      if(thrd_success!=cndret && thrd_timeout!=cndret) { ret=cndret; break; }
+    goto taken;
+  }
+queue:
+  if(thrd_success!=(ret=pthread_permit_waiter_init(&me))) goto done;
+  pthread_permit_lockqueue(permit);
+  if((!fair || !permit->queue) && pthread_permit_take(permit, generation))
+  {
+    pthread_permit_unlockqueue(permit);
+    pthread_permit_waiter_destroy(&me);
+    goto taken;
+  }
+  pthread_permit_enqueue(permit, &me);
+  pthread_permit_unlockqueue(permit);
+  atomic_thread_fence(memory_order_seq_cst);
+  if(!permit->replacePermit)
+  { // A grant which didn't see us queued left the permit granted, so hand it on ourselves
+    if(atomic_load_explicit(&permit->permit, memory_order_relaxed))
+      pthread_permit_handoff(permit);
+    ret=pthread_permit_waiter_park(permit, &me, mtx, ts, &backoff);
+  }
+  else // A grant which didn't see us queued has released us already
+    ret=pthread_permit_take(permit, generation) ? thrd_busy : pthread_permit_waiter_park(permit, &me, mtx, ts, &backoff);
+  if(thrd_success!=ret)
+  { // Leave the queue, unless a grant has already removed us to wake us
+    int queued;
+    pthread_permit_lockqueue(permit);
+    if((queued=PTHREAD_PERMIT_WAITER_QUEUED==atomic_load_explicit(&me.state, memory_order_relaxed)))
+      pthread_permit_dequeue(permit, &me);
+    pthread_permit_unlockqueue(permit);
+    if(!queued)
+    { // The grant has yet to finish with us
+      while(PTHREAD_PERMIT_WAITER_GRANTED!=atomic_load_explicit(&me.state, memory_order_acquire))
+        pthread_permit_waiter_sleep(&me, NULL, 0);
+      ret=thrd_success;
     }
-    else thrd_yield();
+    else if(thrd_busy==ret)
+      ret=thrd_success;
   }
+  pthread_permit_waiter_destroy(&me);
+  if(thrd_success!=ret) goto done;
+taken:
+  pthread_permit_backoff_learn(permit, &backoff);
+  pthread_permit_consumed(permit);
+done:
   // Increment the monotonic count to indicate we have exited a wait
   atomic_fetch_add_explicit(&permit->waited, 1U, memory_order_relaxed);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_WAITED, permit, ret);
+  return ret;
+}
+
+static int pthread_permit_wait(pthread_permit_t *permit, pthread_mutex_t *mtx)
+{
+  return pthread_permit_queuewait(permit, mtx, NULL, 0);
+}
+
+static int pthread_permit_timedwait(pthread_permit_t *permit, pthread_mutex_t *mtx, const struct timespec *ts)
+{
+  return pthread_permit_queuewait(permit, mtx, ts, 1);
+}
+
+static int pthread_permit_await(pthread_permit_t *permit, pthread_permit_continuation_t *c)
+{
+  int ret;
+  // Another process could neither call the continuation nor reach it to queue others behind it
+  if(PTHREAD_PERMIT_PSHARED(permit)) return thrd_error;
+  ret=pthread_permit_continuations_await(&permit->permit, permit->replacePermit, &permit->continuationState, &permit->continuations, c);
+  if(thrd_success==ret)
+    pthread_permit_consumed(permit);
+  else // The permit may have been granted since we looked, in which case no granter saw us
+    pthread_permit_run_continuations(permit);
   return ret;
 }
 
@@ -324,6 +893,12 @@ PTHREAD_PERMIT_API_DEFINE(int, permittype##_init, (pthread_##permittype##_t *per
   return pthread_permit_init((pthread_permit_t *) permit, PERMIT_MAGIC, PERMIT_FLAGS, initial); \
 } \
 \
+PTHREAD_PERMIT_API_DEFINE(int, permittype##_init_flags, (pthread_##permittype##_t *permit, _Bool initial, unsigned flags)) \
+{ \
+  if(flags&~PTHREAD_PERMIT_FLAGS_PUBLIC) return thrd_error; \
+  return pthread_permit_init((pthread_permit_t *) permit, PERMIT_MAGIC, PERMIT_FLAGS|flags, initial); \
+} \
+\
 PTHREAD_PERMIT_API_DEFINE(int, permittype##_pushhook, (pthread_##permittype##_t *permit, pthread_permit_hook_type_t type, pthread_##permittype##_hook_t *hook)) \
 { \
   if(PERMIT_MAGIC!=((pthread_permit_t *) permit)->magic) return thrd_error; \
@@ -364,12 +939,25 @@ PTHREAD_PERMIT_API_DEFINE(int , permittype##_timedwait, (pthread_##permittype##_
 { \
   if(PERMIT_MAGIC!=((pthread_permit_t *) permit)->magic) return thrd_error; \
   return pthread_permit_timedwait((pthread_permit_t *) permit, mtx, ts); \
-}
-
-#define PERMIT permitc
-#define PERMIT_MAGIC PERMIT_CONSUMING_PERMIT_MAGIC
-#define PERMIT_FLAGS 0
-PERMIT_IMPL(permitc)
+} \
+\
+PTHREAD_PERMIT_API_DEFINE(int , permittype##_waitfor, (pthread_##permittype##_t *permit, pthread_mutex_t *mtx, const struct timespec *reltime)) \
+{ \
+  struct timespec deadline; \
+  if(PERMIT_MAGIC!=((pthread_permit_t *) permit)->magic) return thrd_error; \
+  return pthread_permit_timedwait((pthread_permit_t *) permit, mtx, pthread_permit_deadline(&deadline, reltime)); \
+} \
+\
+PTHREAD_PERMIT_API_DEFINE(int , permittype##_await, (pthread_##permittype##_t *permit, pthread_permit_continuation_t *c)) \
+{ \
+  if(PERMIT_MAGIC!=((pthread_permit_t *) permit)->magic) return thrd_error; \
+  return pthread_permit_await((pthread_permit_t *) permit, c); \
+}
+
+#define PERMIT permitc
+#define PERMIT_MAGIC PERMIT_CONSUMING_PERMIT_MAGIC
+#define PERMIT_FLAGS 0
+PERMIT_IMPL(permitc)
 #undef PERMIT_FLAGS
 #undef PERMIT_MAGIC
 
@@ -381,126 +969,1145 @@ PERMIT_IMPL(permitnc)
 
 #undef PERMIT_IMPL
 
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+atomic_uint PTHREAD_PERMIT_MANGLEAPI(permit_counters_global)[PTHREAD_PERMIT_COUNTER_LAST];
+#endif
+PTHREAD_PERMIT_API_DEFINE(int , permit_counters, (pthread_permitX_t _permit, unsigned *counters))
+{
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+  pthread_permit_t *permit=(pthread_permit_t *) _permit;
+  atomic_uint *from;
+  int n;
+  if(!permit)
+    from=PTHREAD_PERMIT_MANGLEAPI(permit_counters_global);
+  else if(*(const unsigned *)"1PER"==permit->magic)
+    from=((pthread_permit1_t *) permit)->counters;
+  else if(PERMIT_CONSUMING_PERMIT_MAGIC==permit->magic || PERMIT_NONCONSUMING_PERMIT_MAGIC==permit->magic)
+    from=permit->counters;
+  else
+    return thrd_error;
+  for(n=0; n<PTHREAD_PERMIT_COUNTER_LAST; n++)
+    counters[n]=atomic_load_explicit(&from[n], memory_order_relaxed);
+  return thrd_success;
+#else
+  (void) _permit;
+  memset(counters, 0, PTHREAD_PERMIT_COUNTER_LAST*sizeof(unsigned));
+  return thrd_error;
+#endif
+}
 
-static int pthread_permit_select_int(size_t no, pthread_permit_t **RESTRICT permits, pthread_mutex_t *mtx, const struct timespec *ts)
+#if PTHREAD_PERMIT_ENABLE_TRACE
+//! The number of most recent events kept per thread. Must be a power of two.
+#ifndef PTHREAD_PERMIT_TRACE_RING_SIZE
+#define PTHREAD_PERMIT_TRACE_RING_SIZE 4096
+#endif
+//! The number of threads which may trace. Threads beyond this aren't traced.
+#ifndef PTHREAD_PERMIT_TRACE_MAX_THREADS
+#define PTHREAD_PERMIT_TRACE_MAX_THREADS 256
+#endif
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#define PTHREAD_PERMIT_TRACE_TICKS() __rdtsc()
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+#include <x86intrin.h>
+#define PTHREAD_PERMIT_TRACE_TICKS() __rdtsc()
+#else
+#define PTHREAD_PERMIT_TRACE_TICKS() pthread_permit_trace_ns()
+#endif
+static unsigned long long pthread_permit_trace_ns(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (unsigned long long) ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+typedef struct pthread_permit_trace_buffer_s
+{
+  unsigned thread;                    /* Sequential number of the owning thread */
+  atomic_uint head;                   /* Count of events ever recorded. Only the owning thread writes this */
+  pthread_permit_trace_event_t events[PTHREAD_PERMIT_TRACE_RING_SIZE];
+} pthread_permit_trace_buffer_t;
+static pthread_permit_trace_buffer_t *pthread_permit_trace_buffers[PTHREAD_PERMIT_TRACE_MAX_THREADS];
+static atomic_uint pthread_permit_trace_nbuffers;
+static atomic_uint pthread_permit_trace_generation; /* Advanced by each release, orphaning every thread's ring */
+static unsigned long long pthread_permit_trace_tickbase, pthread_permit_trace_nsbase;
+static thread_local pthread_permit_trace_buffer_t *pthread_permit_trace_mybuffer;
+static thread_local unsigned pthread_permit_trace_mygeneration; /* The generation mybuffer and untraced belong to */
+static thread_local int pthread_permit_trace_untraced;
+
+static pthread_permit_trace_buffer_t *pthread_permit_trace_newbuffer(void)
+{
+  pthread_permit_trace_buffer_t *buffer;
+  unsigned slot, generation=atomic_load_explicit(&pthread_permit_trace_generation, memory_order_relaxed);
+  if(generation!=pthread_permit_trace_mygeneration)
+  { // The rings were released since this thread last traced, so start afresh
+    pthread_permit_trace_mybuffer=0;
+    pthread_permit_trace_untraced=0;
+    pthread_permit_trace_mygeneration=generation;
+  }
+  if(pthread_permit_trace_untraced) return 0;
+  if((slot=atomic_fetch_add_explicit(&pthread_permit_trace_nbuffers, 1U, memory_order_relaxed))>=PTHREAD_PERMIT_TRACE_MAX_THREADS
+    || !(buffer=(pthread_permit_trace_buffer_t *) calloc(1, sizeof(pthread_permit_trace_buffer_t))))
+  {
+    pthread_permit_trace_untraced=1;
+    return 0;
+  }
+  if(!slot)
+  { // The first thread to trace sets the timebase
+    pthread_permit_trace_nsbase=pthread_permit_trace_ns();
+    pthread_permit_trace_tickbase=PTHREAD_PERMIT_TRACE_TICKS();
+  }
+  buffer->thread=slot;
+  // Publish the zeroed buffer before anything can see it
+  atomic_thread_fence(memory_order_release);
+  pthread_permit_trace_buffers[slot]=buffer;
+  return pthread_permit_trace_mybuffer=buffer;
+}
+#endif
+
+PTHREAD_PERMIT_API_DEFINE(void , permit_trace, (unsigned type, const void *permit, unsigned arg))
+{
+#if PTHREAD_PERMIT_ENABLE_TRACE
+  pthread_permit_trace_buffer_t *buffer=pthread_permit_trace_mybuffer;
+  pthread_permit_trace_event_t *event;
+  unsigned head;
+  if((!buffer || pthread_permit_trace_mygeneration!=atomic_load_explicit(&pthread_permit_trace_generation, memory_order_relaxed))
+    && !(buffer=pthread_permit_trace_newbuffer())) return;
+  head=atomic_load_explicit(&buffer->head, memory_order_relaxed);
+  event=&buffer->events[head&(PTHREAD_PERMIT_TRACE_RING_SIZE-1)];
+  event->timestamp=PTHREAD_PERMIT_TRACE_TICKS();
+  event->permit=(unsigned long long)(size_t) permit;
+  event->type=type;
+  event->arg=arg;
+  atomic_store_explicit(&buffer->head, head+1, memory_order_release);
+#else
+  (void) type; (void) permit; (void) arg;
+#endif
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permit_trace_save, (FILE *out))
+{
+#if PTHREAD_PERMIT_ENABLE_TRACE
+  pthread_permit_trace_header_t header;
+  pthread_permit_trace_event_t *events;
+  unsigned n, nbuffers=atomic_load_explicit(&pthread_permit_trace_nbuffers, memory_order_acquire);
+  if(nbuffers>PTHREAD_PERMIT_TRACE_MAX_THREADS) nbuffers=PTHREAD_PERMIT_TRACE_MAX_THREADS;
+  if(!(events=(pthread_permit_trace_event_t *) malloc(sizeof(pthread_permit_trace_event_t)*PTHREAD_PERMIT_TRACE_RING_SIZE))) return thrd_nomem;
+  memcpy(header.magic, "PTRC", 4);
+  header.version=1;
+  header.rings=0;
+  for(n=0; n<nbuffers; n++)
+    if(pthread_permit_trace_buffers[n]) header.rings++;
+  header.reserved=0;
+  header.tickbase=pthread_permit_trace_tickbase;
+  header.nspertick=1;
+  if(header.rings)
+  { // Calibrate ticks against the clock over the life of the trace
+    unsigned long long ticks=PTHREAD_PERMIT_TRACE_TICKS(), ns=pthread_permit_trace_ns();
+    if(ticks>pthread_permit_trace_tickbase && ns>pthread_permit_trace_nsbase)
+      header.nspertick=(double)(ns-pthread_permit_trace_nsbase)/(double)(ticks-pthread_permit_trace_tickbase);
+  }
+  if(1!=fwrite(&header, sizeof(header), 1, out)) goto fail;
+  for(n=0; n<nbuffers; n++)
+  {
+    pthread_permit_trace_buffer_t *buffer=pthread_permit_trace_buffers[n];
+    pthread_permit_trace_ring_t ring;
+    unsigned head, tail, now, m;
+    if(!buffer) continue;
+    head=atomic_load_explicit(&buffer->head, memory_order_acquire);
+    tail=head>PTHREAD_PERMIT_TRACE_RING_SIZE ? head-PTHREAD_PERMIT_TRACE_RING_SIZE : 0;
+    for(m=tail; m!=head; m++)
+      events[m-tail]=buffer->events[m&(PTHREAD_PERMIT_TRACE_RING_SIZE-1)];
+    /* The owning thread may have overwritten the oldest events while we copied them, so drop those. Having
+    published now events it may be writing event now, which overwrites event now-RING_SIZE, so every event
+    before now+1-RING_SIZE may be torn. */
+    atomic_thread_fence(memory_order_acquire);
+    now=atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    m=0;
+    if(now-tail>=PTHREAD_PERMIT_TRACE_RING_SIZE)
+      m=(now+1-PTHREAD_PERMIT_TRACE_RING_SIZE-tail<head-tail) ? now+1-PTHREAD_PERMIT_TRACE_RING_SIZE-tail : head-tail;
+    ring.thread=buffer->thread;
+    ring.events=head-tail-m;
+    if(1!=fwrite(&ring, sizeof(ring), 1, out)) goto fail;
+    if(ring.events && ring.events!=fwrite(events+m, sizeof(pthread_permit_trace_event_t), ring.events, out)) goto fail;
+  }
+  free(events);
+  return fflush(out) ? thrd_error : thrd_success;
+fail:
+  free(events);
+  return thrd_error;
+#else
+  (void) out;
+  return thrd_error;
+#endif
+}
+
+PTHREAD_PERMIT_API_DEFINE(void , permit_trace_release, (void))
+{
+#if PTHREAD_PERMIT_ENABLE_TRACE
+  unsigned n, nbuffers=atomic_load_explicit(&pthread_permit_trace_nbuffers, memory_order_acquire);
+  if(nbuffers>PTHREAD_PERMIT_TRACE_MAX_THREADS) nbuffers=PTHREAD_PERMIT_TRACE_MAX_THREADS;
+  // Any thread tracing after this sees the new generation and allocates a new ring rather than using its freed one
+  atomic_fetch_add_explicit(&pthread_permit_trace_generation, 1U, memory_order_seq_cst);
+  for(n=0; n<nbuffers; n++)
+  {
+    free(pthread_permit_trace_buffers[n]);
+    pthread_permit_trace_buffers[n]=0;
+  }
+  atomic_store_explicit(&pthread_permit_trace_nbuffers, 0U, memory_order_release);
+#endif
+}
+
+typedef struct pthread_permit_then_s
+{
+  pthread_permit_continuation_t continuation; /* Must be first */
+  void (*fn)(void *);
+  void *arg;
+  pthread_permit_executor_t *executor;
+} pthread_permit_then_t;
+static void pthread_permit_then_received(pthread_permit_continuation_t *c)
+{
+  pthread_permit_then_t *then=(pthread_permit_then_t *) c;
+  void (*fn)(void *)=then->fn;
+  void *arg=then->arg;
+  pthread_permit_executor_t *executor=then->executor;
+  free(then);
+  if(executor)
+    executor->post(executor, fn, arg);
+  else
+    fn(arg);
+}
+PTHREAD_PERMIT_API_DEFINE(int , permit_then, (pthread_permitX_t _permit, void (*fn)(void *), void *arg, pthread_permit_executor_t *executor))
+{
+  pthread_permit_t *permit=(pthread_permit_t *) _permit;
+  pthread_permit_then_t *then;
+  int ret;
+  if(!permit || !fn) return thrd_error;
+  if(!(then=(pthread_permit_then_t *) malloc(sizeof(pthread_permit_then_t)))) return thrd_nomem;
+  then->continuation.func=pthread_permit_then_received;
+  then->continuation.data=0;
+  then->fn=fn;
+  then->arg=arg;
+  then->executor=executor;
+  if(*(const unsigned *)"1PER"==permit->magic)
+    ret=pthread_permit1_await((pthread_permit1_t *) permit, &then->continuation);
+  else if(PERMIT_CONSUMING_PERMIT_MAGIC==permit->magic || PERMIT_NONCONSUMING_PERMIT_MAGIC==permit->magic)
+    ret=pthread_permit_await(permit, &then->continuation);
+  else
+    ret=thrd_error;
+  if(thrd_busy==ret) return thrd_success; /* Queued, and may have been called already */
+  if(thrd_success==ret)
+    pthread_permit_then_received(&then->continuation);
+  else
+    free(then);
+  return ret;
+}
+
+
+/* Waits until any of the permits is granted, then takes up to max of the permits granted at that
+moment, returning how many in *taken */
+static int pthread_permit_select_int(size_t no, pthread_permit_t **RESTRICT permits, size_t max, size_t *taken, pthread_mutex_t *mtx, const struct timespec *ts)
 {
   int ret=thrd_success;
-  unsigned expected;
   struct timespec now;
-  pthread_permit_select_t *myselect=0;
-  size_t n, totalpermits=0, replacePermits=0, selectslot=(size_t)-1, selectedpermit=(size_t)-1;
-  // Sanity check permits
+  pthread_permit_waiter_t myselect;
+  pthread_permit_select_link_t inlinelinks[PTHREAD_PERMIT_SELECT_INLINE_LINKS], *links=inlinelinks, *link;
+  pthread_permit_backoff_t backoff;
+  size_t n, totalpermits=0, selected=0;
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+  int woken=0;
+#endif
+  *taken=0;
+  if(!max) return thrd_error;
+  // Sanity check permits. The selects of a process shared permit can't point into this process.
   for(n=0; n<no; n++)
   {
     if(permits[n])
     {
-      if(PERMIT_CONSUMING_PERMIT_MAGIC!=permits[n]->magic && PERMIT_NONCONSUMING_PERMIT_MAGIC!=permits[n]->magic)
+      if((PERMIT_CONSUMING_PERMIT_MAGIC!=permits[n]->magic && PERMIT_NONCONSUMING_PERMIT_MAGIC!=permits[n]->magic)
+        || PTHREAD_PERMIT_PSHARED(permits[n]))
       {
         permits[n]=0;
-        if(thrd_success!=ret) ret=thrd_error;
+        ret=thrd_error;
       }
-      if(permits[n]->replacePermit) replacePermits++;
-      totalpermits++;
+      else
+        totalpermits++;
     }
   }
   if(thrd_success!=ret || !totalpermits) return ret;
-  // Find a free slot for us to use
-  for(n=0; n<MAX_PTHREAD_PERMIT_SELECTS; n++)
+  // We need one link per permit, so if there are more than fit on the stack allocate them
+  if(totalpermits>PTHREAD_PERMIT_SELECT_INLINE_LINKS)
   {
-    expected=0;
-    if(atomic_compare_exchange_weak_explicit(&pthread_permit_selects[n].magic, &expected, *(const unsigned *)"SPER", memory_order_relaxed, memory_order_relaxed))
-    {
-      selectslot=n;
-      break;
-    }
+    if(!(links=(pthread_permit_select_link_t *) malloc(totalpermits*sizeof(pthread_permit_select_link_t)))) return thrd_nomem;
+  }
+  if(thrd_success!=(ret=pthread_permit_waiter_init(&myselect)))
+  {
+    if(links!=inlinelinks) free(links);
+    return ret;
   }
-  if(MAX_PTHREAD_PERMIT_SELECTS==n) return thrd_nomem;
-  myselect=&pthread_permit_selects[selectslot];
-  if(thrd_success!=(ret=cnd_init(&myselect->cond))) return ret;
 
-  // Link each of the permits into our select slot
-  for(n=0; n<no; n++)
+  // Don't spin unless some permit linked below is adaptive
+  backoff.budget=backoff.spent=0;
+  backoff.pause=1;
+  // Link our select into each of the permits
+  for(n=0, link=links; n<no; n++)
   {
     if(permits[n])
     {
-      // If the permit isn't consumed, if the permit is executing then wait here
-      if(permits[n]->replacePermit)
+      // Set the select
+      link->select=&myselect;
+      link->prev=0;
+      link->taken=0;
+      pthread_permit_lockselects(permits[n]);
+      if((link->next=permits[n]->selects)) link->next->prev=link;
+      permits[n]->selects=link;
+      pthread_permit_unlockselects(permits[n]);
+      PTHREAD_PERMIT_COUNT(permits[n], PTHREAD_PERMIT_COUNTER_WAITS);
+      PTHREAD_PERMIT_COUNT(permits[n], PTHREAD_PERMIT_COUNTER_SELECTLINKS);
+      PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_SELECT_LINK, permits[n], 0);
+      // Increment the monotonic count to indicate we have entered a wait
+      atomic_fetch_add_explicit(&permits[n]->waiters, 1U, memory_order_seq_cst);
+      link->generation=atomic_load_explicit(&permits[n]->generation, memory_order_seq_cst);
+      link++;
+      // Spin for as long as the most patient adaptive permit would
       {
-        while(atomic_load_explicit(&permits[n]->lockWake, memory_order_acquire))
-        {
-          //if(1==cpus) thrd_yield();
-        }
-        replacePermits--;
+        pthread_permit_backoff_t b;
+        pthread_permit_backoff_init(&b, permits[n]);
+        if(b.budget>backoff.budget) backoff=b;
       }
-      // Increment the monotonic count to indicate we have entered a wait
-      atomic_fetch_add_explicit(&permits[n]->waiters, 1U, memory_order_acquire);
-      // Set the select
-      assert(!permits[n]->selects[selectslot]);
-      permits[n]->selects[selectslot]=myselect;
     }
   }
-  assert(!replacePermits);
 
   // Loop the permits, trying to grab a permit
   for(;;)
   {
-    for(n=0; n<no; n++)
+    long long diff=0;
+    // Rearm before looking so any grant from now on wakes us
+    atomic_store_explicit(&myselect.state, PTHREAD_PERMIT_WAITER_QUEUED, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+    for(n=0, link=links; n<no && selected<max; n++)
     {
       if(permits[n])
       {
-        expected=1;
-        if(atomic_compare_exchange_weak_explicit(&permits[n]->permit, &expected, permits[n]->replacePermit, memory_order_relaxed, memory_order_relaxed))
+        if((link->taken=pthread_permit_take(permits[n], link->generation)))
         { // Permit is granted
-          selectedpermit=n;
-          break;
+          pthread_permit_backoff_learn(permits[n], &backoff);
+          pthread_permit_consumed(permits[n]);
+          selected++;
         }
+        link++;
       }
     }
-    if((size_t)-1!=selectedpermit) break;
-    // Permit is not granted, so wait if we have a mutex
+    if(selected)
+    {
+      *taken=selected;
+      break;
+    }
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+    // Something else took the grant we were woken for
+    for(n=0; woken && n<no; n++)
+      if(permits[n]) PTHREAD_PERMIT_COUNT(permits[n], PTHREAD_PERMIT_COUNTER_EXTRAWAKES);
+    woken=0;
+#endif
+    // Permit is not granted, so spin if adaptive, else wait if we have a mutex
     if(ts)
     {
-      long long diff;
       timespec_get(&now, TIME_UTC);
       diff=timespec_diff(ts, &now);
       if(diff<=0) { ret=thrd_timeout; break; }
     }
+    if(pthread_permit_backoff(&backoff)) continue;
     if(mtx)
     {
-      int cndret=(ts ? cnd_timedwait(&myselect->cond, mtx, ts) : cnd_wait(&myselect->cond, mtx));
-      if(thrd_success!=cndret && thrd_timeout!=cndret) { ret=cndret; break; }
+      int sleepret;
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+      for(n=0; n<no; n++)
+        if(permits[n]) PTHREAD_PERMIT_COUNT(permits[n], PTHREAD_PERMIT_COUNTER_SLEEPS);
+#endif
+      mtx_unlock(mtx);
+      sleepret=pthread_permit_waiter_sleep(&myselect, ts, diff);
+      mtx_lock(mtx);
+      if(thrd_success!=sleepret && thrd_timeout!=sleepret) { ret=sleepret; break; }
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+      woken=PTHREAD_PERMIT_WAITER_GRANTED==atomic_load_explicit(&myselect.state, memory_order_relaxed);
+#endif
     }
     else thrd_yield();
   }
 
-  // Delink each of the permits from our select slot
-  for(n=0; n<no; n++)
+  // Delink our select from each of the permits
+  for(n=0, link=links; n<no; n++)
   {
     if(permits[n])
     {
       // Unset the select
-      assert(permits[n]->selects[selectslot]==myselect);
-      permits[n]->selects[selectslot]=0;
+      assert(link->select==&myselect);
+      pthread_permit_lockselects(permits[n]);
+      if(link->next) link->next->prev=link->prev;
+      if(link->prev) link->prev->next=link->next; else permits[n]->selects=link->next;
+      pthread_permit_unlockselects(permits[n]);
+      PTHREAD_PERMIT_COUNT(permits[n], PTHREAD_PERMIT_COUNTER_SELECTUNLINKS);
+      PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_SELECT_UNLINK, permits[n], link->taken);
       // Increment the monotonic count to indicate we have exited a wait
       atomic_fetch_add_explicit(&permits[n]->waited, 1U, memory_order_relaxed);
       // Zero if not selected
-      if(selectedpermit!=n) permits[n]=0;
+      if(!link->taken) permits[n]=0;
+      link++;
     }
   }
-  // Destroy the select slot's condition variable and reset
-  cnd_destroy(&myselect->cond);
-  myselect->magic=0;
+  // Destroy our park word, now that no granter can see it
+  pthread_permit_waiter_destroy(&myselect);
+  if(links!=inlinelinks) free(links);
   return ret;
 }
 PTHREAD_PERMIT_API_DEFINE(int , permit_select, (size_t no, pthread_permitX_t *permits, pthread_mutex_t *mtx, const struct timespec *ts))
 {
-  return pthread_permit_select_int(no, (pthread_permit_t **RESTRICT) permits, mtx, ts);
+  size_t taken;
+  return pthread_permit_select_int(no, (pthread_permit_t **RESTRICT) permits, 1, &taken, mtx, ts);
+}
+PTHREAD_PERMIT_API_DEFINE(int , permit_select_many, (size_t no, pthread_permitX_t *permits, size_t max, size_t *taken, pthread_mutex_t *mtx, const struct timespec *ts))
+{
+  return pthread_permit_select_int(no, (pthread_permit_t **RESTRICT) permits, max, taken, mtx, ts);
+}
+
+static int pthread_permit_addresscompare(const void *a, const void *b)
+{
+  size_t _a=(size_t) *(pthread_permit_t *const *) a, _b=(size_t) *(pthread_permit_t *const *) b;
+  return _a<_b ? -1 : _a>_b;
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permit_grant_many, (size_t no, pthread_permitX_t *permits))
+{
+  int ret=thrd_success;
+  pthread_permit_t *inlinebatch[PTHREAD_PERMIT_SELECT_INLINE_LINKS], **batch=inlinebatch;
+  unsigned inlinewoken[PTHREAD_PERMIT_SELECT_INLINE_LINKS], *woken=inlinewoken;
+  size_t n, m, totalpermits=0;
+  if(no>PTHREAD_PERMIT_SELECT_INLINE_LINKS)
+  {
+    if(!(batch=(pthread_permit_t **) malloc(no*(sizeof(pthread_permit_t *)+sizeof(unsigned))))) return thrd_nomem;
+    woken=(unsigned *)(batch+no);
+  }
+  for(n=0; n<no; n++)
+  {
+    pthread_permit_t *permit=(pthread_permit_t *) permits[n];
+    if(!permit) continue;
+    if(*(const unsigned *)"1PER"==permit->magic)
+    { // Simple permits have no hooks nor selects, and wake at most one thread anyway
+      if(thrd_success!=pthread_permit1_grant(permit)) ret=thrd_error;
+    }
+    else if(PERMIT_CONSUMING_PERMIT_MAGIC==permit->magic || PERMIT_NONCONSUMING_PERMIT_MAGIC==permit->magic)
+      batch[totalpermits++]=permit;
+    else
+      ret=thrd_error;
+  }
+  // Non-consuming permits stay locked until all waking is done, so lock them in address order to
+  // avoid deadlocking against concurrent batches. This also removes duplicates.
+  qsort(batch, totalpermits, sizeof(pthread_permit_t *), pthread_permit_addresscompare);
+  for(n=0, m=0; n<totalpermits; n++)
+    if(!m || batch[m-1]!=batch[n]) batch[m++]=batch[n];
+  totalpermits=m;
+  // Grant every permit before waking any select so each woken select sees all the grants. A select
+  // upon several of the permits is woken by whichever reaches it first and skipped by the rest.
+  for(n=0; n<totalpermits; n++)
+    woken[n]=pthread_permit_grant_begin(batch[n]);
+  for(n=0; n<totalpermits; n++)
+  {
+    woken[n]+=pthread_permit_grant_wake(batch[n]);
+    pthread_permit_grant_end(batch[n]);
+    PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_GRANTED, batch[n], woken[n]);
+  }
+  if(batch!=inlinebatch) free(batch);
+  return ret;
+}
+
+
+//! The magic to use for select sets
+#define PERMIT_SELECTSET_MAGIC (*(const unsigned *)"SSET")
+typedef struct pthread_permit_selectset_member_s
+{
+  pthread_permit_hook_t grant;        /* Our grant hook, whose data points at us */
+  pthread_permit_selectset_t *set;    /* The set we are a member of */
+  pthread_permit_t *permit;           /* The permit we represent */
+  pthread_permit_selectset_member_t *next; /* Next member of the set */
+  pthread_permit_selectset_member_t *readynext; /* Next member on the set's ready list */
+  atomic_uint queued;                 /* Nonzero if on the set's ready list */
+} pthread_permit_selectset_member_t;
+
+static void pthread_permit_selectset_lock(pthread_permit_selectset_t *set)
+{
+  unsigned expected;
+  while((expected=0, !atomic_compare_exchange_weak_explicit(&set->lock, &expected, 1U, memory_order_acquire, memory_order_relaxed)))
+  {
+    //if(1==cpus) thrd_yield();
+  }
+}
+static void pthread_permit_selectset_unlock(pthread_permit_selectset_t *set)
+{
+  atomic_store_explicit(&set->lock, 0U, memory_order_release);
+}
+
+/* Appends a member to its set's ready list if it isn't already on it, waking a sleeping waiter */
+static void pthread_permit_selectset_push(pthread_permit_selectset_member_t *member)
+{
+  pthread_permit_selectset_t *set=member->set;
+  unsigned expected=0;
+  if(!atomic_compare_exchange_strong_explicit(&member->queued, &expected, 1U, memory_order_relaxed, memory_order_relaxed)) return;
+  pthread_permit_selectset_lock(set);
+  member->readynext=0;
+  if(set->readytail)
+    set->readytail->readynext=member;
+  else
+    set->readyhead=member;
+  set->readytail=member;
+  atomic_fetch_add_explicit(&set->ready, 1U, memory_order_seq_cst);
+  pthread_permit_selectset_unlock(set);
+  // Anyone asleep? If so, taking sleeplock guarantees they are inside cnd_wait() before we signal
+  if(atomic_load_explicit(&set->sleepers, memory_order_seq_cst))
+  {
+    mtx_lock(&set->sleeplock);
+    cnd_signal(&set->cond);
+    mtx_unlock(&set->sleeplock);
+  }
+}
+
+/* Removes the oldest member from the ready list */
+static pthread_permit_selectset_member_t *pthread_permit_selectset_pop(pthread_permit_selectset_t *set)
+{
+  pthread_permit_selectset_member_t *member;
+  if(!atomic_load_explicit(&set->ready, memory_order_seq_cst)) return 0;
+  pthread_permit_selectset_lock(set);
+  if((member=set->readyhead))
+  {
+    if(!(set->readyhead=member->readynext)) set->readytail=0;
+    atomic_fetch_add_explicit(&set->ready, (unsigned)-1, memory_order_relaxed);
+    atomic_store_explicit(&member->queued, 0U, memory_order_seq_cst);
+  }
+  pthread_permit_selectset_unlock(set);
+  return member;
+}
+
+/* Delinks a member from the set's ready list if it is on it. Must be called with the set locked. */
+static void pthread_permit_selectset_unready(pthread_permit_selectset_t *set, pthread_permit_selectset_member_t *member)
+{
+  pthread_permit_selectset_member_t **memberptr, *prev=0;
+  for(memberptr=&set->readyhead; *memberptr; prev=*memberptr, memberptr=&(*memberptr)->readynext)
+  {
+    if(*memberptr==member)
+    {
+      *memberptr=member->readynext;
+      if(set->readytail==member) set->readytail=prev;
+      atomic_fetch_add_explicit(&set->ready, (unsigned)-1, memory_order_relaxed);
+      atomic_store_explicit(&member->queued, 0U, memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+static int pthread_permit_selectset_hook_grant(pthread_permit_hook_type_t type, pthread_permit_t *permit, pthread_permit_hook_t *hookdata)
+{
+  pthread_permit_selectset_push((pthread_permit_selectset_member_t *) hookdata->data);
+  return hookdata->next ? hookdata->next->func(type, permit, hookdata->next) : 0;
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permit_selectset_init, (pthread_permit_selectset_t *set))
+{
+  memset(set, 0, sizeof(pthread_permit_selectset_t));
+  if(thrd_success!=mtx_init(&set->sleeplock, mtx_plain)) return thrd_error;
+  if(thrd_success!=cnd_init(&set->cond))
+  {
+    mtx_destroy(&set->sleeplock);
+    return thrd_error;
+  }
+  atomic_store_explicit(&set->magic, PERMIT_SELECTSET_MAGIC, memory_order_seq_cst);
+  return thrd_success;
+}
+
+PTHREAD_PERMIT_API_DEFINE(void , permit_selectset_destroy, (pthread_permit_selectset_t *set))
+{
+  if(PERMIT_SELECTSET_MAGIC!=set->magic) return;
+  while(set->members)
+    PTHREAD_PERMIT_MANGLEAPI(permit_selectset_remove)(set, set->members->permit);
+  /* Mark this object as invalid for further use */
+  atomic_store_explicit(&set->magic, 0U, memory_order_seq_cst);
+  cnd_destroy(&set->cond);
+  mtx_destroy(&set->sleeplock);
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permit_selectset_add, (pthread_permit_selectset_t *set, pthread_permitX_t _permit))
+{
+  pthread_permit_t *permit=(pthread_permit_t *) _permit;
+  pthread_permit_selectset_member_t *member;
+  if(PERMIT_SELECTSET_MAGIC!=set->magic) return thrd_error;
+  if(PERMIT_CONSUMING_PERMIT_MAGIC!=permit->magic && PERMIT_NONCONSUMING_PERMIT_MAGIC!=permit->magic) return thrd_error;
+  member=(pthread_permit_selectset_member_t *) calloc(1, sizeof(pthread_permit_selectset_member_t));
+  if(!member) return thrd_nomem;
+  member->grant.func=pthread_permit_selectset_hook_grant;
+  member->grant.data=member;
+  member->set=set;
+  member->permit=permit;
+  pthread_permit_selectset_lock(set);
+  member->next=set->members;
+  set->members=member;
+  pthread_permit_selectset_unlock(set);
+  if(thrd_success!=pthread_permit_pushhook(permit, PTHREAD_PERMIT_HOOK_TYPE_GRANT, &member->grant))
+  {
+    PTHREAD_PERMIT_MANGLEAPI(permit_selectset_remove)(set, permit);
+    return thrd_error;
+  }
+  // If already granted, it's ready now
+  if(atomic_load_explicit(&permit->permit, memory_order_seq_cst))
+    pthread_permit_selectset_push(member);
+  return thrd_success;
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permit_selectset_remove, (pthread_permit_selectset_t *set, pthread_permitX_t permit))
+{
+  pthread_permit_selectset_member_t **memberptr, *member=0;
+  if(PERMIT_SELECTSET_MAGIC!=set->magic) return thrd_error;
+  pthread_permit_selectset_lock(set);
+  for(memberptr=&set->members; *memberptr; memberptr=&(*memberptr)->next)
+  {
+    if((*memberptr)->permit==permit)
+    {
+      member=*memberptr;
+      *memberptr=member->next;
+      pthread_permit_selectset_unready(set, member);
+      break;
+    }
+  }
+  pthread_permit_selectset_unlock(set);
+  if(!member) return thrd_error;
+  pthread_permit_removehook(member->permit, PTHREAD_PERMIT_HOOK_TYPE_GRANT, &member->grant);
+  free(member);
+  return thrd_success;
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permit_selectset_wait, (pthread_permit_selectset_t *set, pthread_permitX_t *permit, pthread_mutex_t *mtx, const struct timespec *ts))
+{
+  int ret=thrd_success;
+  struct timespec now;
+  if(PERMIT_SELECTSET_MAGIC!=set->magic) return thrd_error;
+  *permit=0;
+  for(;;)
+  {
+    pthread_permit_selectset_member_t *member;
+    // Examine ready permits, oldest first
+    while((member=pthread_permit_selectset_pop(set)))
+    {
+      unsigned expected=1;
+      pthread_permit_t *p=member->permit;
+      if(atomic_compare_exchange_strong_explicit(&p->permit, &expected, p->replacePermit, memory_order_relaxed, memory_order_relaxed))
+      { // Permit is granted. Non-consuming permits remain granted, so remain ready.
+        if(p->replacePermit)
+          pthread_permit_selectset_push(member);
+        else
+          pthread_permit_consumed(p);
+        *permit=p;
+        return thrd_success;
+      }
+      // Otherwise someone else took it or it was revoked, so drop it
+    }
+    // Nothing is ready, so wait if we have a mutex
+    if(ts)
+    {
+      long long diff;
+      timespec_get(&now, TIME_UTC);
+      diff=timespec_diff(ts, &now);
+      if(diff<=0) { ret=thrd_timeout; break; }
+    }
+    if(mtx)
+    {
+      int cndret=thrd_success;
+      mtx_unlock(mtx);
+      mtx_lock(&set->sleeplock);
+      atomic_fetch_add_explicit(&set->sleepers, 1U, memory_order_seq_cst);
+      if(!atomic_load_explicit(&set->ready, memory_order_seq_cst))
+        cndret=(ts ? cnd_timedwait(&set->cond, &set->sleeplock, ts) : cnd_wait(&set->cond, &set->sleeplock));
+      atomic_fetch_add_explicit(&set->sleepers, (unsigned)-1, memory_order_relaxed);
+      mtx_unlock(&set->sleeplock);
+      mtx_lock(mtx);
+      if(thrd_success!=cndret && thrd_timeout!=cndret) { ret=cndret; break; }
+    }
+    else thrd_yield();
+  }
+  return ret;
+}
+
+#ifdef __linux__
+//! The magic to use for reactors
+#define PERMIT_REACTOR_MAGIC (*(const unsigned *)"REAC")
+
+typedef struct pthread_permit_reactor_member_s
+{
+  pthread_permit_hook_t grant;        /* Our grant hook, whose data points at us */
+  pthread_permit_reactor_t *reactor;  /* The reactor we are a member of */
+  pthread_permit_t *permit;           /* The permit we represent, or null if unused */
+  atomic_uint queued;                 /* Nonzero if on the reactor's ready queue */
+  unsigned next;                      /* Index plus one of the next member on the ready queue */
+} pthread_permit_reactor_member_t;
+
+/* Pushes a member onto its reactor's ready queue if it isn't already on it, waking the reactor if the
+queue was empty. Any number of granters may push concurrently. As members are only ever pushed
+individually and taken all at once, this is immune to ABA. */
+static void pthread_permit_reactor_push(pthread_permit_reactor_member_t *member)
+{
+  pthread_permit_reactor_t *reactor=member->reactor;
+  unsigned expected=0, self=(unsigned)(member-reactor->members)+1;
+  if(!atomic_compare_exchange_strong_explicit(&member->queued, &expected, 1U, memory_order_seq_cst, memory_order_relaxed)) return;
+  expected=atomic_load_explicit(&reactor->ready, memory_order_relaxed);
+  do
+  {
+    member->next=expected;
+  } while(!atomic_compare_exchange_weak_explicit(&reactor->ready, &expected, self, memory_order_release, memory_order_relaxed));
+  // Only the grant which finds the queue empty need wake the reactor
+  if(!expected)
+  {
+    uint64_t one=1;
+    write(reactor->fd, &one, sizeof(one));
+  }
+}
+
+static int pthread_permit_reactor_hook_grant(pthread_permit_hook_type_t type, pthread_permit_t *permit, pthread_permit_hook_t *hookdata)
+{
+  pthread_permit_reactor_push((pthread_permit_reactor_member_t *) hookdata->data);
+  return hookdata->next ? hookdata->next->func(type, permit, hookdata->next) : 0;
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permit_reactor_init, (pthread_permit_reactor_t *reactor, size_t capacity))
+{
+  size_t n;
+  memset(reactor, 0, sizeof(pthread_permit_reactor_t));
+  if(!capacity || capacity>=UINT_MAX) return thrd_error;
+  reactor->members=(pthread_permit_reactor_member_t *) calloc(capacity, sizeof(pthread_permit_reactor_member_t));
+  reactor->freeslot=(unsigned *) malloc(capacity*sizeof(unsigned));
+  if(!reactor->members || !reactor->freeslot)
+  {
+    free(reactor->freeslot);
+    free(reactor->members);
+    return thrd_nomem;
+  }
+  if(-1==(reactor->fd=eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK)))
+  {
+    free(reactor->freeslot);
+    free(reactor->members);
+    return thrd_error;
+  }
+  // Hand out the lowest slots first
+  for(n=0; n<capacity; n++)
+    reactor->freeslot[n]=(unsigned)(capacity-1-n);
+  reactor->capacity=reactor->freeslots=capacity;
+  atomic_store_explicit(&reactor->magic, PERMIT_REACTOR_MAGIC, memory_order_seq_cst);
+  return thrd_success;
+}
+
+PTHREAD_PERMIT_API_DEFINE(void , permit_reactor_destroy, (pthread_permit_reactor_t *reactor))
+{
+  size_t n;
+  if(PERMIT_REACTOR_MAGIC!=reactor->magic) return;
+  for(n=0; n<reactor->capacity; n++)
+  {
+    if(reactor->members[n].permit)
+      PTHREAD_PERMIT_MANGLEAPI(permit_reactor_remove)(reactor, reactor->members[n].permit);
+  }
+  /* Mark this object as invalid for further use */
+  atomic_store_explicit(&reactor->magic, 0U, memory_order_seq_cst);
+  close(reactor->fd);
+  free(reactor->freeslot);
+  free(reactor->members);
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permit_reactor_fd, (pthread_permit_reactor_t *reactor))
+{
+  if(PERMIT_REACTOR_MAGIC!=reactor->magic) return -1;
+  return reactor->fd;
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permit_reactor_add, (pthread_permit_reactor_t *reactor, pthread_permitX_t _permit))
+{
+  pthread_permit_t *permit=(pthread_permit_t *) _permit;
+  pthread_permit_reactor_member_t *member;
+  if(PERMIT_REACTOR_MAGIC!=reactor->magic) return thrd_error;
+  if(PERMIT_CONSUMING_PERMIT_MAGIC!=permit->magic && PERMIT_NONCONSUMING_PERMIT_MAGIC!=permit->magic) return thrd_error;
+  if(!reactor->freeslots) return thrd_nomem;
+  /* A reused member may still be on the ready queue from its previous permit, in which case it
+  stays there and the poll which takes it simply finds its new permit not granted */
+  member=&reactor->members[reactor->freeslot[--reactor->freeslots]];
+  member->grant.func=pthread_permit_reactor_hook_grant;
+  member->grant.data=member;
+  member->reactor=reactor;
+  member->permit=permit;
+  if(thrd_success!=pthread_permit_pushhook(permit, PTHREAD_PERMIT_HOOK_TYPE_GRANT, &member->grant))
+  {
+    member->permit=0;
+    reactor->freeslots++;
+    return thrd_nomem;
+  }
+  // If already granted, it's ready now
+  if(atomic_load_explicit(&permit->permit, memory_order_seq_cst))
+    pthread_permit_reactor_push(member);
+  return thrd_success;
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permit_reactor_remove, (pthread_permit_reactor_t *reactor, pthread_permitX_t _permit))
+{
+  pthread_permit_t *permit=(pthread_permit_t *) _permit;
+  pthread_permit_hook_t *hook;
+  if(PERMIT_REACTOR_MAGIC!=reactor->magic) return thrd_error;
+  // Our member is found from the permit's hooks rather than by searching the reactor
+  pthread_permit_hooks_lock(permit);
+  for(hook=PTHREAD_PERMIT_HOOKS(permit, PTHREAD_PERMIT_HOOK_TYPE_GRANT); hook; hook=hook->next)
+  {
+    pthread_permit_reactor_member_t *member=(pthread_permit_reactor_member_t *) hook->data;
+    if(pthread_permit_reactor_hook_grant==hook->func && reactor==member->reactor)
+    {
+      pthread_permit_unlinkhook(permit, PTHREAD_PERMIT_HOOK_TYPE_GRANT, hook);
+      pthread_permit_hooks_synchronise(permit);
+      pthread_permit_hooks_unlock(permit);
+      member->permit=0;
+      reactor->freeslot[reactor->freeslots++]=(unsigned)(member-reactor->members);
+      return thrd_success;
+    }
+  }
+  pthread_permit_hooks_unlock(permit);
+  return thrd_error;
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permit_reactor_poll, (pthread_permit_reactor_t *reactor, pthread_permitX_t *permits, size_t *no))
+{
+  size_t taken=0;
+  uint64_t value;
+  if(PERMIT_REACTOR_MAGIC!=reactor->magic) return thrd_error;
+  // Reset the eventfd before taking the ready queue, so any grant after this rewakes it
+  read(reactor->fd, &value, sizeof(value));
+  // If nothing is left over from last time, take the whole ready queue, reversing it into oldest first
+  if(!reactor->pending)
+  {
+    unsigned idx=atomic_exchange_explicit(&reactor->ready, 0U, memory_order_acquire);
+    while(idx)
+    {
+      pthread_permit_reactor_member_t *member=&reactor->members[idx-1];
+      unsigned next=member->next;
+      member->next=reactor->pending;
+      reactor->pending=idx;
+      idx=next;
+    }
+  }
+  while(taken<*no && reactor->pending)
+  {
+    pthread_permit_reactor_member_t *member=&reactor->members[reactor->pending-1];
+    pthread_permit_t *p;
+    unsigned expected=1;
+    reactor->pending=member->next;
+    // Once dequeued any new grant requeues it, so the permit must be examined afterwards
+    atomic_store_explicit(&member->queued, 0U, memory_order_seq_cst);
+    if(!(p=member->permit)) continue;
+    if(atomic_compare_exchange_strong_explicit(&p->permit, &expected, p->replacePermit, memory_order_relaxed, memory_order_relaxed))
+    { // Permit is granted
+      if(!p->replacePermit)
+        pthread_permit_consumed(p);
+      permits[taken++]=p;
+    }
+    // Otherwise someone else took it or it was revoked, so drop it
+  }
+  /* If some were left over, keep the eventfd readable so level triggered pollers come back. The same goes
+  for grants queued since the ready queue was last taken, as the read above may have swallowed their wake
+  and a grant finding the queue nonempty doesn't wake again. */
+  if(reactor->pending || atomic_load_explicit(&reactor->ready, memory_order_seq_cst))
+  {
+    value=1;
+    write(reactor->fd, &value, sizeof(value));
+  }
+  *no=taken;
+  return thrd_success;
+}
+#endif
+
+#define PERMIT_SET_MAGIC (*(const unsigned *)"PSET")
+//! The number of permits held by each word of a permit set
+#define PTHREAD_PERMITSET_WORD_BITS (8*sizeof(unsigned))
+#if defined(_MSC_VER)
+#include <intrin.h>
+static unsigned pthread_permitset_ctz(unsigned v)
+{
+  unsigned long n;
+  _BitScanForward(&n, v);
+  return (unsigned) n;
+}
+#else
+#define pthread_permitset_ctz(v) ((unsigned) __builtin_ctz(v))
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#include <emmintrin.h>
+#define PTHREAD_PERMITSET_SSE2 1
+#endif
+
+/* Returns the first word in [from, to) with any permit granted, else to. The vector loops read words
+non-atomically, which is fine as what they find is only ever used as where to try an atomic take. */
+static size_t pthread_permitset_scan(const pthread_permitset_t *set, size_t from, size_t to)
+{
+  atomic_uint *bits=set->bits;
+#if defined(__AVX2__)
+  for(; from<to && (from&7); from++)
+    if(atomic_load_explicit(&bits[from], memory_order_relaxed)) return from;
+  for(; from+8<=to; from+=8)
+  {
+    __m256i v=_mm256_load_si256((const __m256i *)(bits+from));
+    if(!_mm256_testz_si256(v, v)) break;
+  }
+#elif defined(PTHREAD_PERMITSET_SSE2)
+  const __m128i zero=_mm_setzero_si128();
+  for(; from<to && (from&3); from++)
+    if(atomic_load_explicit(&bits[from], memory_order_relaxed)) return from;
+  for(; from+4<=to; from+=4)
+  {
+    __m128i v=_mm_load_si128((const __m128i *)(bits+from));
+    if(0xffff!=_mm_movemask_epi8(_mm_cmpeq_epi32(v, zero))) break;
+  }
+#endif
+  for(; from<to; from++)
+    if(atomic_load_explicit(&bits[from], memory_order_relaxed)) return from;
+  return to;
+}
+
+/* Tries to take any granted permit, which for a non-consuming set includes having been released by
+a grant since entering generation. Scans from the most recently granted permit to the end, then
+from the start to it. */
+static int pthread_permitset_take(pthread_permitset_t *set, unsigned generation, size_t *i)
+{
+  size_t pass, word, from=atomic_load_explicit(&set->hint, memory_order_relaxed), to=set->words;
+  for(pass=0; pass<2; pass++, to=from, from=0)
+  {
+    for(word=from; (word=pthread_permitset_scan(set, word, to))<to; word++)
+    {
+      unsigned v=atomic_load_explicit(&set->bits[word], memory_order_relaxed);
+      while(v)
+      { // Consuming sets claim the lowest granted bit, retrying with whatever else is set if beaten to it
+        unsigned bit=v&(0U-v);
+        if(set->replacePermit || atomic_compare_exchange_weak_explicit(&set->bits[word], &v, v&~bit, memory_order_relaxed, memory_order_relaxed))
+        {
+          *i=word*PTHREAD_PERMITSET_WORD_BITS+pthread_permitset_ctz(bit);
+          return 1;
+        }
+      }
+    }
+  }
+  if(set->replacePermit && atomic_load_explicit(&set->generation, memory_order_acquire)!=generation)
+  {
+    *i=atomic_load_explicit(&set->lastGranted, memory_order_relaxed);
+    return 1;
+  }
+  return 0;
+}
+
+/* Sleeps until a grant moves the generation on from seen, a signal arrives or ts passes, diff being
+the nanoseconds until it does */
+static int pthread_permitset_sleep(pthread_permitset_t *set, unsigned seen, const struct timespec *ts, long long diff)
+{
+#if PTHREAD_PERMIT_USE_FUTEX
+  struct timespec rel;
+  rel.tv_sec=(time_t)(diff/1000000000);
+  rel.tv_nsec=(long)(diff%1000000000);
+  return pthread_permit_futex_wait(&set->generation, seen, ts ? &rel : NULL);
+#else
+  int ret=thrd_success;
+  (void) diff;
+  mtx_lock(&set->lock);
+  while(thrd_success==ret && seen==atomic_load_explicit(&set->generation, memory_order_relaxed))
+    ret=ts ? cnd_timedwait(&set->cond, &set->lock, ts) : cnd_wait(&set->cond, &set->lock);
+  mtx_unlock(&set->lock);
+  return ret;
+#endif
+}
+
+/* Wakes one sleeper, or all of them */
+static void pthread_permitset_wake(pthread_permitset_t *set, int all)
+{
+#if PTHREAD_PERMIT_USE_FUTEX
+  pthread_permit_futex_wake(&set->generation, all ? INT_MAX : 1);
+#else
+  pthread_permit_cnd_wake(&set->lock, &set->cond, all);
+#endif
+}
+
+/* Waits upon a permit set. If ts is null, waits forever unless timed, in which case it doesn't wait at all. */
+static int pthread_permitset_wait_int(pthread_permitset_t *set, size_t *i, pthread_mutex_t *mtx, const struct timespec *ts, int timed)
+{
+  int ret=thrd_success;
+  unsigned generation, seen;
+  struct timespec now;
+  if(PERMIT_SET_MAGIC!=set->magic) return thrd_error;
+  // Destruction waits for every thread counted here to leave, so nothing below can touch freed memory
+  atomic_fetch_add_explicit(&set->waiting, 1U, memory_order_seq_cst);
+  generation=atomic_load_explicit(&set->generation, memory_order_seq_cst);
+  for(;;)
+  {
+    long long diff=0;
+    /* A grant after this moves the generation on, so our sleep returns at once. A woken sleeper
+    always looks before giving up, so a wake of one is never lost to a timeout. Destruction also
+    moves the generation on after clearing the magic. */
+    seen=atomic_load_explicit(&set->generation, memory_order_seq_cst);
+    if(PERMIT_SET_MAGIC!=atomic_load_explicit(&set->magic, memory_order_seq_cst))
+    {
+      ret=thrd_error;
+      break;
+    }
+    if(pthread_permitset_take(set, generation, i)) break;
+    if(timed)
+    {
+      if(!ts)
+      {
+        ret=thrd_timeout;
+        break;
+      }
+      timespec_get(&now, TIME_UTC);
+      if((diff=timespec_diff(ts, &now))<=0)
+      {
+        ret=thrd_timeout;
+        break;
+      }
+    }
+    if(!mtx)
+    {
+      thrd_yield();
+      continue;
+    }
+    atomic_fetch_add_explicit(&set->sleepers, 1U, memory_order_seq_cst);
+    mtx_unlock(mtx);
+    ret=pthread_permitset_sleep(set, seen, ts, diff);
+    mtx_lock(mtx);
+    atomic_fetch_add_explicit(&set->sleepers, (unsigned)-1, memory_order_relaxed);
+    if(thrd_success!=ret && thrd_timeout!=ret) break;
+    ret=thrd_success;
+  }
+  atomic_fetch_add_explicit(&set->waiting, (unsigned)-1, memory_order_release);
+  return ret;
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permitset_init, (pthread_permitset_t *set, size_t no, _Bool consuming))
+{
+  const size_t lineWords=PTHREAD_PERMIT_CACHE_LINE_SIZE/sizeof(unsigned);
+  memset(set, 0, sizeof(pthread_permitset_t));
+  if(!no || no>=UINT_MAX) return thrd_error;
+  // Whole cache lines let the scan use aligned vector loads right up to the end
+  set->words=(no+PTHREAD_PERMITSET_WORD_BITS-1)/PTHREAD_PERMITSET_WORD_BITS;
+  set->words=(set->words+lineWords-1)/lineWords*lineWords;
+  if(!(set->allocation=calloc(set->words*sizeof(unsigned)+PTHREAD_PERMIT_CACHE_LINE_SIZE, 1)))
+    return thrd_nomem;
+  set->bits=(atomic_uint *)(((size_t) set->allocation+PTHREAD_PERMIT_CACHE_LINE_SIZE-1)&~(size_t)(PTHREAD_PERMIT_CACHE_LINE_SIZE-1));
+#if !PTHREAD_PERMIT_USE_FUTEX
+  if(thrd_success!=mtx_init(&set->lock, mtx_plain))
+  {
+    free(set->allocation);
+    return thrd_error;
+  }
+  if(thrd_success!=cnd_init(&set->cond))
+  {
+    mtx_destroy(&set->lock);
+    free(set->allocation);
+    return thrd_error;
+  }
+#endif
+  set->no=no;
+  set->replacePermit=!consuming;
+  atomic_store_explicit(&set->magic, PERMIT_SET_MAGIC, memory_order_seq_cst);
+  return thrd_success;
+}
+
+PTHREAD_PERMIT_API_DEFINE(void , permitset_destroy, (pthread_permitset_t *set))
+{
+  if(PERMIT_SET_MAGIC!=set->magic) return;
+  /* Mark this object as invalid for further use */
+  atomic_store_explicit(&set->magic, 0U, memory_order_seq_cst);
+  /* Release every waiter, which sees the magic cleared and returns an error, and wait for them all to
+  leave. A waiter may first need to relock its mutex, so keep waking any which slept meanwhile. */
+  while(atomic_load_explicit(&set->waiting, memory_order_acquire))
+  {
+    atomic_fetch_add_explicit(&set->generation, 1U, memory_order_seq_cst);
+    pthread_permitset_wake(set, 1);
+    thrd_yield();
+  }
+#if !PTHREAD_PERMIT_USE_FUTEX
+  cnd_destroy(&set->cond);
+  mtx_destroy(&set->lock);
+#endif
+  free(set->allocation);
+  set->allocation=0;
+  set->bits=0;
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permitset_grant, (pthread_permitset_t *set, size_t i))
+{
+  atomic_uint *word;
+  unsigned bit, expected;
+  if(PERMIT_SET_MAGIC!=set->magic || i>=set->no) return thrd_error;
+  word=&set->bits[i/PTHREAD_PERMITSET_WORD_BITS];
+  bit=1U<<(i%PTHREAD_PERMITSET_WORD_BITS);
+  if(set->replacePermit)
+  { // Only one grant may occur concurrently if permits aren't consumed, so released waiters see its permit
+    while((expected=0, !atomic_compare_exchange_weak_explicit(&set->lockWake, &expected, 1U, memory_order_acquire, memory_order_relaxed)))
+      thrd_yield();
+  }
+  expected=atomic_load_explicit(word, memory_order_relaxed);
+  while(!(expected&bit) && !atomic_compare_exchange_weak_explicit(word, &expected, expected|bit, memory_order_seq_cst, memory_order_relaxed));
+  // Regranting an already granted consuming permit changes nothing
+  if(!set->replacePermit && (expected&bit)) return thrd_success;
+  atomic_store_explicit(&set->hint, (unsigned)(i/PTHREAD_PERMITSET_WORD_BITS), memory_order_relaxed);
+  if(set->replacePermit)
+    atomic_store_explicit(&set->lastGranted, (unsigned) i, memory_order_relaxed);
+  // Wake sleepers, and if permits aren't consumed release everything which entered before now
+  atomic_fetch_add_explicit(&set->generation, 1U, memory_order_seq_cst);
+  if(set->replacePermit)
+    atomic_store_explicit(&set->lockWake, 0U, memory_order_release);
+  // A consuming permit can only be taken once, so wakes just one sleeper
+  if(atomic_load_explicit(&set->sleepers, memory_order_seq_cst))
+    pthread_permitset_wake(set, set->replacePermit);
+  return thrd_success;
+}
+
+PTHREAD_PERMIT_API_DEFINE(void , permitset_revoke, (pthread_permitset_t *set, size_t i))
+{
+  atomic_uint *word;
+  unsigned bit, expected;
+  if(PERMIT_SET_MAGIC!=set->magic || i>=set->no) return;
+  word=&set->bits[i/PTHREAD_PERMITSET_WORD_BITS];
+  bit=1U<<(i%PTHREAD_PERMITSET_WORD_BITS);
+  expected=atomic_load_explicit(word, memory_order_relaxed);
+  while((expected&bit) && !atomic_compare_exchange_weak_explicit(word, &expected, expected&~bit, memory_order_relaxed, memory_order_relaxed));
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permitset_wait, (pthread_permitset_t *set, size_t *i, pthread_mutex_t *mtx))
+{
+  return pthread_permitset_wait_int(set, i, mtx, NULL, 0);
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permitset_timedwait, (pthread_permitset_t *set, size_t *i, pthread_mutex_t *mtx, const struct timespec *ts))
+{
+  return pthread_permitset_wait_int(set, i, mtx, ts, 1);
+}
+
+PTHREAD_PERMIT_API_DEFINE(int , permitset_waitfor, (pthread_permitset_t *set, size_t *i, pthread_mutex_t *mtx, const struct timespec *reltime))
+{
+  struct timespec deadline;
+  return pthread_permitset_wait_int(set, i, mtx, pthread_permit_deadline(&deadline, reltime), 1);
 }
 
 typedef struct pthread_permitnc_association_s
 {
-  struct pthread_permitnc_hook_s grant, revoke;
+  struct pthread_permitnc_hook_s grant, revoke, wait;
+  int ownsfd;                         /* Nonzero if the descriptor was created by and is closed with the association */
+  int fd;                             /* The owned descriptor */
+  unsigned mirrored;                  /* Nonzero if the owned descriptor currently shows the permit granted */
+  atomic_uint lock;                   /* Serialises updating the owned descriptor against the permit's state */
 } *pthread_permitnc_association_t;
+typedef struct pthread_permitc_association_s
+{
+  struct pthread_permitc_hook_s grant, revoke, wait;
+  int ownsfd;                         /* Nonzero if the descriptor was created by and is closed with the association */
+  int fd;                             /* The owned descriptor */
+  unsigned mirrored;                  /* Nonzero if the owned descriptor currently shows the permit granted */
+  atomic_uint lock;                   /* Serialises updating the owned descriptor against the permit's state */
+} *pthread_permitc_association_t;
+static char pthread_permitc_association_t_size_check[sizeof(struct pthread_permitc_association_s)==sizeof(struct pthread_permitnc_association_s) ? 1 : -1];
 static int pthread_permitnc_associate_fd_hook_grant(pthread_permit_hook_type_t type, pthread_permitnc_t *permit, pthread_permitnc_hook_t *hookdata)
 {
   int fd=(int)(size_t)(hookdata->data);
@@ -562,30 +2169,117 @@ PTHREAD_PERMIT_API_DEFINE(pthread_permitnc_association_t , permitnc_associate_fd
   return pthread_permit_associate_fd((pthread_permit_t *) permit, fds);
 }
 
-static void pthread_permit_deassociate(pthread_permit_t *permit, pthread_permitnc_association_t assoc)
+#ifdef __linux__
+/* Reads or writes an eventfd's counter, retrying if interrupted. \returns 0 or an errno. As the eventfd is
+nonblocking, EAGAIN means there was nothing to read, and is also returned as 0 as then the eventfd
+already shows what it should. */
+static int pthread_permit_associate_eventfd_io(int fd, int writing)
 {
-  pthread_permitnc_hook_t *RESTRICT *hookptr;
-  if(PERMIT_NONCONSUMING_PERMIT_MAGIC!=permit->magic || !permit->replacePermit) return;
-  for(hookptr=(pthread_permitnc_hook_t *RESTRICT *) &permit->hooks[PTHREAD_PERMIT_HOOK_TYPE_GRANT]; *hookptr; hookptr=&(*hookptr)->next)
+  uint64_t value=1;
+  ssize_t bytes;
+  do
   {
-    if(*hookptr==&assoc->grant)
-    {
-      *hookptr=(*hookptr)->next;
-      break;
-    }
+    bytes=writing ? write(fd, &value, sizeof(value)) : read(fd, &value, sizeof(value));
+  } while(-1==bytes && EINTR==errno);
+  if(-1==bytes) return EAGAIN==errno ? 0 : errno;
+  return sizeof(value)==bytes ? 0 : EIO;
+}
+/* Brings the eventfd into line with whether the permit is now granted. Only the permit's state is read,
+never which operation ran the hook, so however grants, revokes and takes race one another, the last of
+them to reconcile finds the final state and leaves the eventfd showing it. The lock keeps the reconciles
+themselves from interleaving, so mirrored always says what the eventfd holds. */
+static int pthread_permit_associate_eventfd_reconcile(pthread_permit_t *permit, pthread_permitnc_association_t assoc)
+{
+  unsigned expected, granted;
+  int ret=0;
+  while((expected=0, !atomic_compare_exchange_weak_explicit(&assoc->lock, &expected, 1U, memory_order_acquire, memory_order_relaxed)))
+    thrd_yield();
+  granted=atomic_load_explicit(&permit->permit, memory_order_seq_cst) ? 1U : 0U;
+  if(granted!=assoc->mirrored && !(ret=pthread_permit_associate_eventfd_io(assoc->fd, granted)))
+    assoc->mirrored=granted;
+  atomic_store_explicit(&assoc->lock, 0U, memory_order_release);
+  return ret;
+}
+/* Hooks can't fail the permit operation calling them, so any error is returned up the hook chain for
+hooks pushed before this one to see */
+static int pthread_permit_associate_eventfd_hook(pthread_permit_hook_type_t type, pthread_permitnc_t *permit, pthread_permitnc_hook_t *hookdata)
+{
+  int ret=pthread_permit_associate_eventfd_reconcile((pthread_permit_t *) permit, (pthread_permitnc_association_t) hookdata->data), nextret;
+  nextret=hookdata->next ? hookdata->next->func(type, permit, hookdata->next) : 0;
+  return ret ? ret : nextret;
+}
+static pthread_permitnc_association_t pthread_permit_associate_eventfd(pthread_permit_t *permit, int *fd)
+{
+  pthread_permitnc_association_t ret;
+  int efd;
+  ret=(pthread_permitnc_association_t) calloc(1, sizeof(struct pthread_permitnc_association_s));
+  if(!ret) return ret;
+  /* The counter is only ever written while zero and read while one, but is still nonblocking so that a
+  hook can never sleep a granter or waiter, even if the descriptor was read by someone else. It starts
+  unset and is reconciled once the hooks are in, so a change racing the association isn't missed. */
+  efd=eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+  if(-1==efd)
+  {
+    free(ret);
+    return 0;
   }
-  for(hookptr=(pthread_permitnc_hook_t *RESTRICT *) &permit->hooks[PTHREAD_PERMIT_HOOK_TYPE_REVOKE]; *hookptr; hookptr=&(*hookptr)->next)
+  ret->grant.func=ret->revoke.func=ret->wait.func=pthread_permit_associate_eventfd_hook;
+  ret->grant.data=ret->revoke.data=ret->wait.data=ret;
+  ret->ownsfd=1;
+  ret->fd=efd;
+  if(thrd_success!=pthread_permit_pushhook(permit, PTHREAD_PERMIT_HOOK_TYPE_GRANT, (pthread_permit_hook_t *) &ret->grant))
+    goto fail;
+  if(thrd_success!=pthread_permit_pushhook(permit, PTHREAD_PERMIT_HOOK_TYPE_REVOKE, (pthread_permit_hook_t *) &ret->revoke))
   {
-    if(*hookptr==&assoc->revoke)
-    {
-      *hookptr=(*hookptr)->next;
-      break;
-    }
+    pthread_permit_pophook(permit, PTHREAD_PERMIT_HOOK_TYPE_GRANT);
+    goto fail;
+  }
+  if(!permit->replacePermit && thrd_success!=pthread_permit_pushhook(permit, PTHREAD_PERMIT_HOOK_TYPE_WAIT, (pthread_permit_hook_t *) &ret->wait))
+  {
+    pthread_permit_pophook(permit, PTHREAD_PERMIT_HOOK_TYPE_REVOKE);
+    pthread_permit_pophook(permit, PTHREAD_PERMIT_HOOK_TYPE_GRANT);
+    goto fail;
   }
+  pthread_permit_associate_eventfd_reconcile(permit, ret);
+  *fd=efd;
+  return ret;
+fail:
+  close(efd);
+  free(ret);
+  return 0;
+}
+PTHREAD_PERMIT_API_DEFINE(pthread_permitc_association_t , permitc_associate_eventfd, (pthread_permitc_t *permit, int *fd))
+{
+  if(PERMIT_CONSUMING_PERMIT_MAGIC!=((pthread_permit_t *) permit)->magic) return 0;
+  return (pthread_permitc_association_t) pthread_permit_associate_eventfd((pthread_permit_t *) permit, fd);
+}
+PTHREAD_PERMIT_API_DEFINE(pthread_permitnc_association_t , permitnc_associate_eventfd, (pthread_permitnc_t *permit, int *fd))
+{
+  if(PERMIT_NONCONSUMING_PERMIT_MAGIC!=((pthread_permit_t *) permit)->magic) return 0;
+  return pthread_permit_associate_eventfd((pthread_permit_t *) permit, fd);
+}
+#endif
+
+static void pthread_permit_deassociate(pthread_permit_t *permit, pthread_permitnc_association_t assoc)
+{
+  pthread_permit_hooks_lock(permit);
+  pthread_permit_unlinkhook(permit, PTHREAD_PERMIT_HOOK_TYPE_GRANT, (pthread_permit_hook_t *) &assoc->grant);
+  pthread_permit_unlinkhook(permit, PTHREAD_PERMIT_HOOK_TYPE_REVOKE, (pthread_permit_hook_t *) &assoc->revoke);
+  pthread_permit_unlinkhook(permit, PTHREAD_PERMIT_HOOK_TYPE_WAIT, (pthread_permit_hook_t *) &assoc->wait);
+  // One wait covers all three
+  pthread_permit_hooks_synchronise(permit);
+  pthread_permit_hooks_unlock(permit);
+  if(assoc->ownsfd) close(assoc->fd);
   free(assoc);
 }
+PTHREAD_PERMIT_API_DEFINE(void , permitc_deassociate, (pthread_permitc_t *permit, pthread_permitc_association_t assoc))
+{
+  if(PERMIT_CONSUMING_PERMIT_MAGIC!=((pthread_permit_t *) permit)->magic) return;
+  pthread_permit_deassociate((pthread_permit_t *) permit, (pthread_permitnc_association_t) assoc);
+}
 PTHREAD_PERMIT_API_DEFINE(void , permitnc_deassociate, (pthread_permitnc_t *permit, pthread_permitnc_association_t assoc))
 {
+  if(PERMIT_NONCONSUMING_PERMIT_MAGIC!=((pthread_permit_t *) permit)->magic || !((pthread_permit_t *) permit)->replacePermit) return;
   pthread_permit_deassociate((pthread_permit_t *) permit, assoc);
 }
 
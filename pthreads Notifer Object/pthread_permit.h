@@ -35,10 +35,38 @@ DEALINGS IN THE SOFTWARE.
 \brief Defines and declares the API for POSIX threads permit objects
 */
 
+//! Set to 1 to have permits sleep threads directly upon their permit word using Linux futexes. Defaults to 1 on Linux.
+#ifndef PTHREAD_PERMIT_USE_FUTEX
+#if defined(__linux__) && !defined(DOXYGEN_PREPROCESSOR)
+#define PTHREAD_PERMIT_USE_FUTEX 1
+#else
+#define PTHREAD_PERMIT_USE_FUTEX 0
+#endif
+#endif
+//! The CPU cache line size used to keep granter written and waiter written permit state apart. Defaults to 64.
+#ifndef PTHREAD_PERMIT_CACHE_LINE_SIZE
+#define PTHREAD_PERMIT_CACHE_LINE_SIZE 64
+#endif
+//! Set to 1 to have permits keep performance counters, see \ref pthread_permit_counters. Defaults to 0.
+#ifndef PTHREAD_PERMIT_ENABLE_COUNTERS
+#define PTHREAD_PERMIT_ENABLE_COUNTERS 0
+#endif
+//! Set to 1 to have permits record a binary event trace, see \ref pthread_permit_trace. Defaults to 0.
+#ifndef PTHREAD_PERMIT_ENABLE_TRACE
+#define PTHREAD_PERMIT_ENABLE_TRACE 0
+#endif
+
 #ifndef DOXYGEN_PREPROCESSOR
 #include "../c11_compat.h"
 typedef mtx_t pthread_mutex_t;
 #include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#if PTHREAD_PERMIT_USE_FUTEX
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 #endif // DOXYGEN_PREPROCESSOR
 
 #if !defined(PTHREAD_PERMIT_APIEXPORT) && defined(_USRDLL)
@@ -97,7 +125,7 @@ exactly \em one actor may own a permit at any one time. This strong guarantee al
 permits to be much safer and more predictable in many-granter many-waiter scenarios than event
 objects.
 
-There are three permit objects:
+There are four permit objects:
 1. A simple implementation, pthread_permit1_t. This is the simplest and fastest implementation of
 a POSIX threads permit. It is typically compiled inline, and it is always consuming, non-hookable
 and non-selectable.
@@ -107,6 +135,9 @@ returns after any one of the supplied permits receives a grant.
 3. A pthread_permitnc_t denotes a non-consuming POSIX threads permit. It is also hookable and
 selectable. Non-consuming permits can also optionally mirror their state onto a kernel file
 descriptor, allowing the use of select() and poll().
+4. A pthread_permitcount_t denotes a counting permit. It is consuming, non-hookable and non-selectable
+like pthread_permit1_t, but holds any number of permits so that many may be granted and waited
+upon in a single call (see \ref pthread_permitcount_t).
 
 \section features Features
 POSIX threads permit objects are guaranteed to not use dynamic memory except in those
@@ -125,6 +156,10 @@ Studio 2010, GCC v4.6 and clang v3.2.
 The simple permit object costs 48/0/142 CPU cycles for grant/revoke/wait uncontended and 359/4/372
 cycles when contended between two threads. These results are for an Intel Core 2 processor.
 
+On Linux the simple permit object sleeps threads directly upon its permit word using a futex rather
+than a condition variable (see PTHREAD_PERMIT_USE_FUTEX). Granting then costs a single atomic store
+plus, only if a thread is actually sleeping, a single FUTEX_WAKE system call.
+
 \section whynecessary Why is it necessary that a permit object be added to POSIX threads?
 There are many occasions in threaded programming when a third party library goes off and does
 something asynchronous in the background. In the meantime, the foreground thread may do other tasks,
@@ -198,6 +233,8 @@ typedef struct pthread_permit1_s pthread_permit1_t;
 typedef struct pthread_permitc_s pthread_permitc_t;
 //! A non-consuming POSIX threads permit. Hookable and selectable
 typedef struct pthread_permitnc_s pthread_permitnc_t;
+//! A counting POSIX threads permit. Always consuming, non-hookable and non-selectable
+typedef struct pthread_permitcount_s pthread_permitcount_t;
 //! A pointer to any of pthread_permit1_t, pthread_permitc_t and pthread_permitnc_t
 typedef void *pthread_permitX_t;
 //! A permit grant function prototype for any of the permit grant functions
@@ -214,6 +251,10 @@ state mirroring. The following hooks are available:
 - PTHREAD_PERMIT_HOOK_TYPE_DESTROY: Called just before a permit is destroyed.
 - PTHREAD_PERMIT_HOOK_TYPE_GRANT: Called just after a permit is granted, but before waiters are woken.
 - PTHREAD_PERMIT_HOOK_TYPE_REVOKE: Called just after a permit is revoked.
+- PTHREAD_PERMIT_HOOK_TYPE_WAIT: Called just after a waiter consumes a consuming permit.
+
+Consuming permits only call their grant and revoke hooks when the permit actually changes state i.e.
+granting an already granted consuming permit, or revoking an ungranted one, calls no hooks.
 
 pthread_permit_hook_t_np is a structure defined as follows:
 \code
@@ -241,6 +282,14 @@ To add a hook, pthread_permitc_pushhook() and pthread_permitnc_pushhook() pushes
 is called first) by setting its \em next member to the previous top hook. pthread_permitc_pophook() and
 pthread_permitnc_pophook() delink the top hook and return it.
 
+Hooks may be pushed and popped at any time, even while the permit is in use. Granting, revoking and
+waiting never wait for a hook to be pushed or popped. Popping a hook waits for any thread still
+calling the hook to finish, so once pop returns the hook may be freed. A hook therefore must not pop
+a hook of the permit it is called for, nor deassociate it.
+
+Pushing the first hook onto a permit allocates its hook chains using calloc(), which are freed when
+the permit is destroyed. Permits which are never hooked therefore use no dynamic memory.
+
 @{
 */
 //! The hook data structure type
@@ -253,7 +302,7 @@ typedef enum pthread_permit_hook_type
   PTHREAD_PERMIT_HOOK_TYPE_DESTROY,
   PTHREAD_PERMIT_HOOK_TYPE_GRANT,
   PTHREAD_PERMIT_HOOK_TYPE_REVOKE,
-  PTHREAD_PERMIT_HOOK_TYPE_WAIT,    // Not currently used
+  PTHREAD_PERMIT_HOOK_TYPE_WAIT,
 
   PTHREAD_PERMIT_HOOK_TYPE_LAST
 } pthread_permit_hook_type_t;
@@ -271,9 +320,9 @@ typedef struct pthread_permitnc_hook_s
   void *data;
   pthread_permitnc_hook_t *next;
 } pthread_permitnc_hook_t;
-//! Pushes a hook
+//! Pushes a hook, allocating the permit's hook chains if this is its first. \returns 0: success; EINVAL: bad permit or type; ENOMEM: out of memory.
 PTHREAD_PERMIT_API(int , permitc_pushhook, (pthread_permitc_t *permit, pthread_permit_hook_type_t type, pthread_permitc_hook_t *hook));
-//! Pushes a hook
+//! Pushes a hook, allocating the permit's hook chains if this is its first. \returns 0: success; EINVAL: bad permit or type; ENOMEM: out of memory.
 PTHREAD_PERMIT_API(int , permitnc_pushhook, (pthread_permitnc_t *permit, pthread_permit_hook_type_t type, pthread_permitnc_hook_t *hook));
 //! Pops a hook
 PTHREAD_PERMIT_API(pthread_permitc_hook_t *, permitc_pophook, (pthread_permitc_t *permit, pthread_permit_hook_type_t type));
@@ -284,15 +333,51 @@ PTHREAD_PERMIT_API(pthread_permitnc_hook_t *, permitnc_pophook, (pthread_permitn
 
 /*! \defgroup pthread_permitX_init Permit initialisation
 \brief Initialises a permit
-\returns 0: success; EINVAL: bad/incorrect permit.
+\returns 0: success; EINVAL: bad/incorrect permit or flags.
+
+Consuming and non-consuming permits may optionally be initialised with flags altering their behaviour:
+
+- PTHREAD_PERMIT_FLAG_ADAPTIVE: Waiters spin with exponential backoff before sleeping (or before
+yielding if no mutex is supplied). How long they spin is learned from how long recent waits upon
+that permit took to receive their grant, so permits which are typically granted within a few
+microseconds of being waited upon never enter the kernel, while permits which are granted much
+later quickly stop wasting CPU on spinning.
+- PTHREAD_PERMIT_FLAG_FAIR: Waiters of a consuming permit receive grants strictly in the order they
+began waiting. A waiter which finds the permit ungranted queues, and each grant hands the permit
+directly to the oldest queued waiter, waking just that waiter, so a newly arrived waiter can never
+take a grant from under a waiter already queued. This bounds how long any waiter can wait at
+some cost in throughput, as the permit cannot be taken by whichever thread happens to be running.
+Selects and continuations are not queued, so they receive grants only when no waiter is queued.
+Non-consuming permits release all their waiters anyway, and so ignore this flag.
+- PTHREAD_PERMIT_FLAG_PSHARED: The permit may be placed in memory shared between processes, e.g.
+a mapping of shm_open() or memfd_create(), and waited upon and granted by any process mapping it at
+any address. Its waiters sleep upon a word within the permit rather than queuing, so nothing within
+it refers to memory of any one process, and nothing within it is locked while waiting, so a process
+dying whilst waiting leaves the permit fully usable by the others. Such a process does leave the
+count of sleepers too high, which costs each later grant a needless wake. Hooks,
+continuations, selects, select sets, reactors and associations all keep pointers into one process
+within the permit, so they return failure upon a process shared permit. A consuming permit cannot be both fair and process
+shared. Only available where PTHREAD_PERMIT_USE_FUTEX is set, as it needs futexes which aren't
+private to a process.
 @{
 */
+//! Flags which may be supplied to pthread_permitc_init_flags() and pthread_permitnc_init_flags()
+typedef enum pthread_permit_flag
+{
+  PTHREAD_PERMIT_FLAG_ADAPTIVE=(1<<8),
+  PTHREAD_PERMIT_FLAG_FAIR=(1<<9),
+  PTHREAD_PERMIT_FLAG_PSHARED=(1<<10)
+} pthread_permit_flag_t;
 //! Initialises a pthread_permit1_t
 inline int pthread_permit1_init(pthread_permit1_t *permit, _Bool initial);
 //! Initialises a pthread_permitc_t
 PTHREAD_PERMIT_API(int , permitc_init, (pthread_permitc_t *permit, _Bool initial));
 //! Initialises a pthread_permitnc_t
 PTHREAD_PERMIT_API(int , permitnc_init, (pthread_permitnc_t *permit, _Bool initial));
+//! Initialises a pthread_permitc_t with flags
+PTHREAD_PERMIT_API(int , permitc_init_flags, (pthread_permitc_t *permit, _Bool initial, unsigned flags));
+//! Initialises a pthread_permitnc_t with flags
+PTHREAD_PERMIT_API(int , permitnc_init_flags, (pthread_permitnc_t *permit, _Bool initial, unsigned flags));
 //! @}
 
 /*! \defgroup pthread_permitX_destroy Permit destruction
@@ -314,14 +399,17 @@ PTHREAD_PERMIT_API(void , permitnc_destroy, (pthread_permitnc_t *permit));
 Grants permit to one waiting thread. If there is no waiting thread, permits the next thread to wait.
 
 If the permit is consuming (pthread_permit1_t and pthread_permitc_t), the permit is atomically
-transferred to the winning thread.
+transferred to the winning thread. The granter never waits for that thread to wake: a
+pthread_permitc_t is handed directly to the oldest sleeping waiter, which is then woken, and a
+pthread_permit1_t wakes exactly one sleeper. Either way the grant returns having issued at most one
+wake, unless selects are waiting upon the permit.
 
 If the permit is non-consuming (pthread_permitnc_t), the permit is still atomically transferred to
 the winning thread, but the permit is atomically regranted. You are furthermore guaranteed that exactly
-every waiter at the time of grant will be released before the grant operation returns. Note that
-because of this guarantee, only one grant may occur at any one time per permit instance i.e. grant is a
-critical section. This implies that if a grant is operating, any new waits hold until the grant
-completes.
+every waiter at the time of grant will be released, even if the permit is revoked before the waiter
+gets to run. Each grant advances a generation which waiters capture on entry, so new waits never hold
+for a grant in progress. Grants of the same permit instance are still serialised with respect to one
+another.
 
 The parameter of the grant functions is a pthread_permitX_t which denotes any of pthread_permit1_t,
 pthread_permitc_t and pthread_permitnc_t.
@@ -349,6 +437,20 @@ inline int pthread_permit1_grant(pthread_permitX_t permit);
 PTHREAD_PERMIT_API(int , permitc_grant, (pthread_permitX_t permit));
 //! Grants a pthread_permitnc_t
 PTHREAD_PERMIT_API(int , permitnc_grant, (pthread_permitX_t permit));
+
+/*! \brief Grants many permits.
+\returns 0: success; EINVAL: a bad permit was supplied; ENOMEM: out of memory.
+
+Grants every permit in the supplied list of permits, which may be any mix of pthread_permit1_t,
+pthread_permitc_t and pthread_permitnc_t. Null pointers and duplicates are ignored, and if a bad permit
+is supplied the others are still granted. This is equivalent to calling each permit's grant function in
+turn except that all permits are granted before any waiter is woken, and waiters are then woken in
+batched passes over all the permits during which a select waiting upon several of the permits is
+woken only once.
+
+For more than 32 permits this call uses malloc().
+*/
+PTHREAD_PERMIT_API(int , permit_grant_many, (size_t no, pthread_permitX_t *permits));
 //! @}
 
 /*! \defgroup pthread_permitX_revoke Permit revoking
@@ -372,6 +474,16 @@ PTHREAD_PERMIT_API(void , permitnc_revoke, (pthread_permitnc_t *permit));
 Waits for permit to become available, atomically unlocking the specified mutex when waiting.
 If mtx is NULL, never sleeps instead looping forever waiting for permit. If ts is NULL,
 returns immediately instead of waiting.
+
+The deadline ts of the timed waits is absolute, measured against timespec_get(TIME_UTC) which on
+POSIX reads CLOCK_MONOTONIC, as do the condition variables permits sleep upon. The waitfor variants
+instead take a time period relative to now.
+
+No wait, nor select, needs the mutex to avoid lost wakeups, as each sleeps upon a futex
+(PTHREAD_PERMIT_USE_FUTEX) or upon a condition variable of its own, so the mutex is simply unlocked
+while sleeping and relocked afterwards. A sleeping waiter of a pthread_permitc_t, pthread_permitnc_t
+or select parks upon a node on its own stack which a grant wakes directly, so grants wake exactly
+the threads they release rather than broadcasting to everything waiting upon the permit.
 @{
 */
 //! Waits on a pthread_permit1_t
@@ -386,9 +498,16 @@ inline int pthread_permit1_timedwait(pthread_permit1_t *permit, pthread_mutex_t
 PTHREAD_PERMIT_API(int , permitc_timedwait, (pthread_permitc_t *permit, pthread_mutex_t *mtx, const struct timespec *ts));
 //! Waits on a pthread_permitnc_t for a time
 PTHREAD_PERMIT_API(int , permitnc_timedwait, (pthread_permitnc_t *permit, pthread_mutex_t *mtx, const struct timespec *ts));
+//! Waits on a pthread_permit1_t for a period
+inline int pthread_permit1_waitfor(pthread_permit1_t *permit, pthread_mutex_t *mtx, const struct timespec *reltime);
+//! Waits on a pthread_permitc_t for a period
+PTHREAD_PERMIT_API(int , permitc_waitfor, (pthread_permitc_t *permit, pthread_mutex_t *mtx, const struct timespec *reltime));
+//! Waits on a pthread_permitnc_t for a period
+PTHREAD_PERMIT_API(int , permitnc_waitfor, (pthread_permitnc_t *permit, pthread_mutex_t *mtx, const struct timespec *reltime));
 
 /*! \brief Waits on many permits.
-\returns 0: success; EINVAL: bad permit, mutex or timespec; ETIMEDOUT: the time period specified by ts expired.
+\returns 0: success; EINVAL: bad permit, mutex or timespec; ENOMEM: more than 32 permits were supplied
+and their links could not be allocated; ETIMEDOUT: the time period specified by ts expired.
 
 Waits for a time for any permit in the supplied list of permits to become available, 
 atomically unlocking the specified mutex when waiting. If mtx is NULL, never sleeps instead
@@ -402,13 +521,436 @@ On exit, if error then only errored permits are zeroed. In this case many elemen
 Note that the permit array you supply may contain null pointers - if so, these entries are ignored. This
 allows a convenient "rinse and repeat" idiom.
 
-The complexity of this call is O(no). If we could use dynamic memory, or had OS support, we could achieve O(1).
+Any number of selects may wait concurrently upon any number of permits. A select links a small node
+into each permit it waits upon, which lives on the stack for up to 32 non-null permits. Above that
+this call allocates the nodes using malloc() and frees them before returning, returning ENOMEM without
+waiting if the allocation fails. Selecting upon 32 or fewer permits therefore uses no dynamic memory.
+
+The complexity of this call is O(no), as every call links into and out of every permit supplied.
+If you repeatedly wait upon the same permits, see \ref pthread_permit_selectset which registers them
+once and then waits in O(1).
 */
 PTHREAD_PERMIT_API(int , permit_select, (size_t no, pthread_permitX_t *permits, pthread_mutex_t *mtx, const struct timespec *ts));
+
+/*! \brief Waits on many permits, taking every one granted.
+\returns 0: success; EINVAL: bad permit, mutex, timespec or max; ENOMEM: more than 32 permits were
+supplied and their links could not be allocated; ETIMEDOUT: the time period specified by ts expired.
+
+As pthread_permit_select(), including when it allocates, but once any permit is granted takes every permit granted at that
+moment, up to max of them, setting *taken to how many were taken. Granted consuming permits are
+consumed, and granted non-consuming permits are observed without being consumed, exactly as
+pthread_permit_select() would. Permits are taken in array order, so if more than max are granted
+the later ones are left granted for the next call.
+
+On exit, if no error the permits array has all permits not taken zeroed. On exit, if error then only
+errored permits are zeroed and *taken is zero.
+
+A thread able to handle many ready permits at once thus links into and out of every permit once
+per batch rather than once per permit.
+*/
+PTHREAD_PERMIT_API(int , permit_select_many, (size_t no, pthread_permitX_t *permits, size_t max, size_t *taken, pthread_mutex_t *mtx, const struct timespec *ts));
+//! @}
+
+/*! \defgroup pthread_permitX_await Permit continuations
+\brief Waits on a permit without blocking a thread
+\returns 0: the permit was taken immediately and the continuation will not be called; EBUSY: the
+continuation was queued, and will be called once it receives the permit; EINVAL: bad permit.
+
+Rather than sleeping the calling thread, queues an intrusive continuation upon the permit. When the
+permit is granted, the granting thread takes the permit on behalf of the oldest queued continuation
+exactly as a waiting thread would, and then calls its \em func. A consuming permit is therefore received
+by exactly one continuation or waiting thread per grant, while a non-consuming permit releases every
+queued continuation. A continuation may also be called by the thread queuing it if the permit was
+granted while it was being queued, so \em func may have already been called before the await returns.
+
+No dynamic memory is used: you supply the continuation, which must remain valid until its \em func is
+called. Destroying a permit calls every queued continuation. As \em func is called from within the
+grant, it should be brief and must not wait upon nor grant the same permit. Typically it hands
+itself to some executor. C++ 20 coroutines can \c co_await a permit using pthread_permit_coroutine.hpp.
+
+\code
+static void resume(pthread_permit_continuation_t *c)
+{
+  // Permit has been received. c->data is yours to use.
+}
+pthread_permit_continuation_t c={resume, mystate};
+if(0==pthread_permitc_await(&permit, &c))
+  resume(&c);
+\endcode
+@{
+*/
+//! The type of a permit continuation
+typedef struct pthread_permit_continuation_s pthread_permit_continuation_t;
+//! A permit continuation
+struct pthread_permit_continuation_s
+{
+  void (*func)(pthread_permit_continuation_t *c);  //!< Called once the permit has been received
+  void *data;                                        //!< Yours to use
+  pthread_permit_continuation_t *next;               //!< Used internally
+};
+//! Queues a continuation upon a pthread_permit1_t
+inline int pthread_permit1_await(pthread_permit1_t *permit, pthread_permit_continuation_t *c);
+//! Queues a continuation upon a pthread_permitc_t
+PTHREAD_PERMIT_API(int , permitc_await, (pthread_permitc_t *permit, pthread_permit_continuation_t *c));
+//! Queues a continuation upon a pthread_permitnc_t
+PTHREAD_PERMIT_API(int , permitnc_await, (pthread_permitnc_t *permit, pthread_permit_continuation_t *c));
+
+//! The type of an executor for pthread_permit_then()
+typedef struct pthread_permit_executor_s pthread_permit_executor_t;
+//! An executor which runs callbacks on behalf of pthread_permit_then()
+struct pthread_permit_executor_s
+{
+  void (*post)(pthread_permit_executor_t *executor, void (*fn)(void *), void *arg); //!< Arranges for fn(arg) to be called
+  void *data;                                        //!< Yours to use
+};
+/*! \brief Calls fn(arg) once the permit has been received
+\returns 0: success; ENOMEM: out of memory; EINVAL: bad permit.
+
+A convenience around the continuations above for when you have nowhere to keep one: it is allocated
+for you and freed before \em fn is called. The permit is received exactly as a waiting thread
+would receive it, so each grant of a consuming permit calls exactly one callback. If the permit is
+already granted \em fn is received immediately, otherwise later by the granting thread. Either way,
+if \em executor is null \em fn is called inline by that thread, else it is handed to \em executor->post.
+Destroying a permit calls every outstanding callback.
+*/
+PTHREAD_PERMIT_API(int , permit_then, (pthread_permitX_t permit, void (*fn)(void *), void *arg, pthread_permit_executor_t *executor));
+//! @}
+
+/*! \defgroup pthread_permit_selectset Persistent permit select sets
+\brief A persistent set of permits which can be waited upon in O(1)
+
+pthread_permit_select() must link itself into and out of every permit it is given on every call, so
+its cost is O(no) even when a permit is immediately available. If you repeatedly wait upon the same
+large set of consuming and/or non-consuming permits, a pthread_permit_selectset_t is much cheaper:
+permits are registered with the set once, and thereafter each grant of a registered permit appends
+that permit to the set's ready list. pthread_permit_selectset_wait() simply takes the oldest permit
+from the ready list, so its cost is proportional to the number of ready permits examined rather than
+the number registered.
+
+\code
+pthread_permit_selectset_t set;
+pthread_permitX_t permit;
+pthread_permit_selectset_init(&set);
+pthread_permit_selectset_add(&set, &permitc1);
+pthread_permit_selectset_add(&set, &permitnc2);
+...
+while(0==pthread_permit_selectset_wait(&set, &permit, &mtx, NULL))
+{
+  // permit has been granted to this thread
+}
+\endcode
+
+Registration pushes a hook onto the permit (see \ref pthread_permit_hook_t), so these functions use
+malloc() in pthread_permit_selectset_add() only. As with pthread_permitnc_associate_fd(), adding
+and removing permits is not thread safe with respect to concurrent grants of the permit being added
+or removed nor with respect to concurrent waits upon the set, and you must remove a permit from all
+sets before destroying it. A permit must not be
+added to the same set twice.
+
+pthread_permit_selectset_wait() has the same semantics as pthread_permit_select() i.e. a granted
+consuming permit is consumed by exactly one waiter, a granted non-consuming permit is returned to
+every waiter until it is revoked, the mutex is unlocked whilst sleeping, a NULL mutex means never
+sleep and a NULL timespec means wait forever.
+@{
+*/
+//! The type of a persistent permit select set
+typedef struct pthread_permit_selectset_s pthread_permit_selectset_t;
+//! Initialises a select set. \returns 0: success; EINVAL: failed to initialise.
+PTHREAD_PERMIT_API(int , permit_selectset_init, (pthread_permit_selectset_t *set));
+//! Removes all permits from and destroys a select set
+PTHREAD_PERMIT_API(void , permit_selectset_destroy, (pthread_permit_selectset_t *set));
+//! Registers a pthread_permitc_t or pthread_permitnc_t with a select set. \returns 0: success; EINVAL: bad set or permit; ENOMEM: out of memory.
+PTHREAD_PERMIT_API(int , permit_selectset_add, (pthread_permit_selectset_t *set, pthread_permitX_t permit));
+//! Deregisters a permit from a select set. \returns 0: success; EINVAL: bad set or permit not registered.
+PTHREAD_PERMIT_API(int , permit_selectset_remove, (pthread_permit_selectset_t *set, pthread_permitX_t permit));
+//! Waits for any permit in a select set, returning it in *permit. \returns 0: success; EINVAL: bad set or mutex; ETIMEDOUT: the time period specified by ts expired.
+PTHREAD_PERMIT_API(int , permit_selectset_wait, (pthread_permit_selectset_t *set, pthread_permitX_t *permit, pthread_mutex_t *mtx, const struct timespec *ts));
+//! @}
+
+/*! \defgroup pthread_permit_reactor Permit reactors
+\brief Multiplexes any number of permits onto a single kernel file descriptor
+
+Mirroring each permit onto its own file descriptor (see \ref pthread_permitnc_associate) costs a
+descriptor per permit, which does not scale past a few thousand permits. On Linux, a
+pthread_permit_reactor_t instead multiplexes any number of consuming and/or non-consuming permits
+onto a single eventfd which can be added to an epoll set alongside sockets:
+
+\code
+pthread_permit_reactor_t reactor;
+pthread_permitX_t granted[64];
+size_t n, no;
+struct epoll_event ev={EPOLLIN};
+pthread_permit_reactor_init(&reactor, 65536);
+pthread_permit_reactor_add(&reactor, &connection->permit);
+...
+ev.data.ptr=&reactor;
+epoll_ctl(epollfd, EPOLL_CTL_ADD, pthread_permit_reactor_fd(&reactor), &ev);
+...
+// In the event loop, when the reactor's descriptor is readable
+no=64;
+while(0==pthread_permit_reactor_poll(&reactor, granted, &no) && no)
+{
+  for(n=0; n<no; n++)
+  {
+    // granted[n] has been granted to this thread
+  }
+  no=64;
+}
+\endcode
+
+Registration pushes a grant hook onto the permit (see \ref pthread_permit_hook_t). Each grant of a
+registered permit pushes that permit onto a lock-free ready queue, and only the grant which finds the
+queue empty writes to the eventfd. pthread_permit_reactor_poll() never sleeps: it takes up to *no
+permits from the ready queue, oldest first, and claims them exactly as pthread_permit_select() would
+i.e. a granted consuming permit is consumed, while a granted non-consuming permit is returned once per
+grant. If more permits are ready than fit, the eventfd is left readable.
+
+The reactor's capacity is fixed at initialisation, which is the only time it calls malloc(). Adding and
+removing permits is not thread safe with respect to each other, to pthread_permit_reactor_poll() nor to
+concurrent grants of the permit being added or removed, but it is safe with respect to grants of every
+other registered permit. Only one thread may call pthread_permit_reactor_poll() at any one time. You
+must remove a permit from all reactors before destroying it, and a permit must not be added to the same
+reactor twice.
+@{
+*/
+//! The type of a permit reactor
+typedef struct pthread_permit_reactor_s pthread_permit_reactor_t;
+#if defined(__linux__) || defined(DOXYGEN_PREPROCESSOR)
+//! Initialises a reactor able to hold capacity permits. \returns 0: success; EINVAL: failed to initialise; ENOMEM: out of memory.
+PTHREAD_PERMIT_API(int , permit_reactor_init, (pthread_permit_reactor_t *reactor, size_t capacity));
+//! Removes all permits from and destroys a reactor
+PTHREAD_PERMIT_API(void , permit_reactor_destroy, (pthread_permit_reactor_t *reactor));
+//! Returns the file descriptor which is readable whenever a registered permit has been granted
+PTHREAD_PERMIT_API(int , permit_reactor_fd, (pthread_permit_reactor_t *reactor));
+//! Registers a pthread_permitc_t or pthread_permitnc_t with a reactor. \returns 0: success; EINVAL: bad reactor or permit; ENOMEM: the reactor is full.
+PTHREAD_PERMIT_API(int , permit_reactor_add, (pthread_permit_reactor_t *reactor, pthread_permitX_t permit));
+//! Deregisters a permit from a reactor. \returns 0: success; EINVAL: bad reactor or permit not registered.
+PTHREAD_PERMIT_API(int , permit_reactor_remove, (pthread_permit_reactor_t *reactor, pthread_permitX_t permit));
+//! Takes up to *no granted permits into permits, setting *no to how many were taken. Never sleeps. \returns 0: success; EINVAL: bad reactor.
+PTHREAD_PERMIT_API(int , permit_reactor_poll, (pthread_permit_reactor_t *reactor, pthread_permitX_t *permits, size_t *no));
+#endif
+//! @}
+
+/*! \defgroup pthread_permitset Permit sets
+\brief A dense array of permits sharing one set of waiters
+
+Workloads with tens of thousands of fine grained flags can afford neither a pthread_permitc_t per
+flag nor pthread_permit_select() linking itself into every one of them. A pthread_permitset_t keeps
+just one bit per permit in a cache line aligned array, with waiters shared by all of them.
+pthread_permitset_grant() sets a permit's bit and pthread_permitset_revoke() clears it.
+pthread_permitset_wait() waits for any permit of the set to be granted and returns its index. It
+finds a set bit by scanning the array 128 or 256 bits at a time where the compiler targets SSE2 or
+AVX2, starting from the most recently granted permit.
+
+A set is either consuming or non-consuming, and its permits behave exactly as pthread_permitc_t or
+pthread_permitnc_t respectively would. A consuming permit is taken by atomically clearing its bit,
+so each grant is taken by exactly one waiter, and wakes at most one sleeping waiter. A non-consuming
+permit is returned to every waiter until it is revoked, and its grant releases every waiter present
+at the time even if it is revoked immediately after, in which case such a waiter is returned the
+permit most recently granted. As with other permits, the mutex is unlocked whilst sleeping, a NULL
+mutex means never sleep and a NULL timespec means wait forever.
+
+\code
+pthread_permitset_t set;
+size_t i;
+pthread_permitset_init(&set, 65536, 1);
+...
+// Producers
+pthread_permitset_grant(&set, connection->index);
+...
+// Workers
+while(0==pthread_permitset_wait(&set, &i, &mtx))
+{
+  // Permit i has been granted to this thread
+}
+\endcode
+
+pthread_permitset_init() is the only function which calls malloc(). Destroying a set releases every
+thread waiting upon it, each returning EINVAL, and returns once they all have. It therefore must not
+be called holding a mutex such a waiter would relock, and nothing may grant or revoke concurrently.
+@{
+*/
+//! The type of a permit set
+typedef struct pthread_permitset_s pthread_permitset_t;
+//! Initialises a set of no permits, none granted, which are consumed by waiters if consuming is set. \returns 0: success; EINVAL: failed to initialise; ENOMEM: out of memory.
+PTHREAD_PERMIT_API(int , permitset_init, (pthread_permitset_t *set, size_t no, _Bool consuming));
+//! Destroys a permit set, releasing its waiters with EINVAL
+PTHREAD_PERMIT_API(void , permitset_destroy, (pthread_permitset_t *set));
+//! Grants permit i of a set. \returns 0: success; EINVAL: bad set or index.
+PTHREAD_PERMIT_API(int , permitset_grant, (pthread_permitset_t *set, size_t i));
+//! Revokes permit i of a set
+PTHREAD_PERMIT_API(void , permitset_revoke, (pthread_permitset_t *set, size_t i));
+//! Waits for any permit of a set, returning its index in *i. \returns 0: success; EINVAL: bad set.
+PTHREAD_PERMIT_API(int , permitset_wait, (pthread_permitset_t *set, size_t *i, pthread_mutex_t *mtx));
+//! Waits for a time for any permit of a set, returning its index in *i. \returns 0: success; EINVAL: bad set; ETIMEDOUT: the time period specified by ts expired.
+PTHREAD_PERMIT_API(int , permitset_timedwait, (pthread_permitset_t *set, size_t *i, pthread_mutex_t *mtx, const struct timespec *ts));
+//! Waits for a period for any permit of a set, returning its index in *i. \returns 0: success; EINVAL: bad set; ETIMEDOUT: the time period specified by reltime expired.
+PTHREAD_PERMIT_API(int , permitset_waitfor, (pthread_permitset_t *set, size_t *i, pthread_mutex_t *mtx, const struct timespec *reltime));
+//! @}
+
+/*! \defgroup pthread_permitcount_t Counting permits
+\brief A permit holding any number of permits
+
+A pthread_permitcount_t is a consuming permit which counts its grants rather than holding a single
+permit, so granting it k times without any intervening waits lets the next k waits proceed. This
+lets a producer hand out k units of work with a single pthread_permitcount_grant(), which adds k
+permits and wakes at most k sleeping waiters in one pass, rather than running the full wake
+loop k times. Likewise a consumer may take up to k permits in a single pthread_permitcount_wait_many().
+
+Every permit granted is taken by exactly one waiter, and the lost wakeup guarantees of
+pthread_permit1_t apply equally here. As with pthread_permit1_t, it is typically compiled inline
+and on Linux sleeps threads directly upon its count using a futex (see PTHREAD_PERMIT_USE_FUTEX).
+
+Because pthread_permitcount_grant() takes a count, it does not match pthread_permitX_grant_func.
+
+\code
+pthread_permitcount_t permit;
+unsigned taken;
+pthread_permitcount_init(&permit, 0);
+...
+// I/O completion thread
+pthread_permitcount_grant(&permit, completions);
+...
+// Worker threads
+while(0==pthread_permitcount_wait_many(&permit, 16, &taken, &mtx))
+{
+  // Process taken units of work
+}
+\endcode
+@{
+*/
+//! Initialises a pthread_permitcount_t holding initial permits. \returns 0: success; EINVAL: failed to initialise.
+inline int pthread_permitcount_init(pthread_permitcount_t *permit, unsigned initial);
+//! Destroys a pthread_permitcount_t
+inline void pthread_permitcount_destroy(pthread_permitcount_t *permit);
+//! Grants k permits, waking up to k waiters. \returns 0: success; EINVAL: bad permit or the count would overflow.
+inline int pthread_permitcount_grant(pthread_permitcount_t *permit, unsigned k);
+//! Revokes all outstanding permits
+inline void pthread_permitcount_revoke(pthread_permitcount_t *permit);
+//! Waits for and takes one permit. \returns as pthread_permit1_wait().
+inline int pthread_permitcount_wait(pthread_permitcount_t *permit, pthread_mutex_t *mtx);
+//! Waits for a time for and takes one permit. \returns as pthread_permit1_timedwait().
+inline int pthread_permitcount_timedwait(pthread_permitcount_t *permit, pthread_mutex_t *mtx, const struct timespec *ts);
+//! Waits for a period for and takes one permit. \returns as pthread_permit1_timedwait().
+inline int pthread_permitcount_waitfor(pthread_permitcount_t *permit, pthread_mutex_t *mtx, const struct timespec *reltime);
+//! Waits for at least one permit, then takes up to k permits, returning how many in *taken. \returns as pthread_permit1_wait().
+inline int pthread_permitcount_wait_many(pthread_permitcount_t *permit, unsigned k, unsigned *taken, pthread_mutex_t *mtx);
+//! Waits for a time for at least one permit, then takes up to k permits, returning how many in *taken. \returns as pthread_permit1_timedwait().
+inline int pthread_permitcount_timedwait_many(pthread_permitcount_t *permit, unsigned k, unsigned *taken, pthread_mutex_t *mtx, const struct timespec *ts);
+//! @}
+
+/*! \defgroup pthread_permit_counters Permit performance counters
+\brief Counts what permits spend their time doing
+
+If compiled with PTHREAD_PERMIT_ENABLE_COUNTERS=1, pthread_permit1_t, pthread_permitc_t and
+pthread_permitnc_t count the following events, both per permit and process wide:
+
+- PTHREAD_PERMIT_COUNTER_GRANTS: Grants.
+- PTHREAD_PERMIT_COUNTER_WAITS: Waits, timed waits and selects begun.
+- PTHREAD_PERMIT_COUNTER_SLEEPS: Times a waiter actually went to sleep.
+- PTHREAD_PERMIT_COUNTER_WAKES: Waiters and selects woken by a grant.
+- PTHREAD_PERMIT_COUNTER_EXTRAWAKES: Such wakes of a select which then found nothing to take.
+- PTHREAD_PERMIT_COUNTER_SELECTLINKS: Selects linked into the permit.
+- PTHREAD_PERMIT_COUNTER_SELECTUNLINKS: Selects delinked from the permit.
+- PTHREAD_PERMIT_COUNTER_LOCKWAKEATTEMPTS: Failed attempts by a grant to take the non-consuming grant
+lock. This counts attempts rather than the time spent spinning, which the counters cannot observe
+without adding a clock read to every contended grant.
+- PTHREAD_PERMIT_COUNTER_HOOKCALLS: Hook chains called.
+
+Counting is done with relaxed atomic increments directly in the code paths concerned, so unlike a
+hook it does not change the timings being observed beyond the increments themselves. Counters are
+unsigned and wrap, so difference successive snapshots. When counters are not compiled in, they
+cost nothing.
+@{
+*/
+//! The type of counter
+typedef enum pthread_permit_counter
+{
+  PTHREAD_PERMIT_COUNTER_GRANTS,
+  PTHREAD_PERMIT_COUNTER_WAITS,
+  PTHREAD_PERMIT_COUNTER_SLEEPS,
+  PTHREAD_PERMIT_COUNTER_WAKES,
+  PTHREAD_PERMIT_COUNTER_EXTRAWAKES,
+  PTHREAD_PERMIT_COUNTER_SELECTLINKS,
+  PTHREAD_PERMIT_COUNTER_SELECTUNLINKS,
+  PTHREAD_PERMIT_COUNTER_LOCKWAKEATTEMPTS,
+  PTHREAD_PERMIT_COUNTER_HOOKCALLS,
+
+  PTHREAD_PERMIT_COUNTER_LAST
+} pthread_permit_counter_t;
+/*! \brief Snapshots the counters of a permit, or of the whole process if permit is null, into
+counters[PTHREAD_PERMIT_COUNTER_LAST].
+\returns 0: success; EINVAL: bad permit, or counters were not compiled in in which case counters is zeroed.
+*/
+PTHREAD_PERMIT_API(int , permit_counters, (pthread_permitX_t permit, unsigned *counters));
+//! @}
+
+/*! \defgroup pthread_permit_trace Permit event tracing
+\brief Records what permits did and when, for offline analysis
+
+If compiled with PTHREAD_PERMIT_ENABLE_TRACE=1, pthread_permit1_t, pthread_permitc_t and pthread_permitnc_t
+record an event for each init, grant (and again once its waking has finished), wait entry and exit,
+revoke, select link and unlink, and destroy. Each thread records into its own ring of the most recent
+events, so recording takes no locks and costs a timestamp (the CPU's time stamp counter where
+available) and a few stores. Rings outlive their threads until pthread_permit_trace_release() frees
+them all, after which threads tracing again start new rings.
+
+pthread_permit_trace_save() writes every ring to a file in the following host-endian format: a
+pthread_permit_trace_header_t, then for each ring a pthread_permit_trace_ring_t followed by its events
+oldest first. pthread_permit_tracedump converts such a file into Chrome trace event JSON, viewable in
+chrome://tracing or Perfetto, with grants and waits as spans and flow arrows from each grant to the
+waiters it released.
+@{
+*/
+//! The type of trace event
+typedef enum pthread_permit_trace_type
+{
+  PTHREAD_PERMIT_TRACE_INIT,
+  PTHREAD_PERMIT_TRACE_GRANT,         //!< A grant began
+  PTHREAD_PERMIT_TRACE_GRANTED,       //!< A grant finished waking, arg is how many waiting threads it woke
+  PTHREAD_PERMIT_TRACE_WAIT,          //!< A wait began
+  PTHREAD_PERMIT_TRACE_WAITED,        //!< A wait finished, arg is its return code
+  PTHREAD_PERMIT_TRACE_REVOKE,
+  PTHREAD_PERMIT_TRACE_SELECT_LINK,
+  PTHREAD_PERMIT_TRACE_SELECT_UNLINK,
+  PTHREAD_PERMIT_TRACE_DESTROY,
+
+  PTHREAD_PERMIT_TRACE_LAST
+} pthread_permit_trace_type_t;
+//! A trace event
+typedef struct pthread_permit_trace_event_s
+{
+  unsigned long long timestamp;       //!< In ticks, see pthread_permit_trace_header_t
+  unsigned long long permit;          //!< The address of the permit
+  unsigned type;                      //!< A pthread_permit_trace_type_t
+  unsigned arg;                       //!< Depends on type
+} pthread_permit_trace_event_t;
+//! A trace file header
+typedef struct pthread_permit_trace_header_s
+{
+  char magic[4];                      //!< "PTRC"
+  unsigned version;                   //!< 1
+  unsigned rings;                     //!< The number of rings following
+  unsigned reserved;
+  unsigned long long tickbase;        //!< The timestamp of the first event recorded by the process
+  double nspertick;                   //!< Nanoseconds per timestamp tick
+} pthread_permit_trace_header_t;
+//! A trace file ring header
+typedef struct pthread_permit_trace_ring_s
+{
+  unsigned thread;                    //!< Sequential number of the thread in order of first event
+  unsigned events;                    //!< The number of events following
+} pthread_permit_trace_ring_t;
+//! Records a trace event from the calling thread. Called for you by permits.
+PTHREAD_PERMIT_API(void , permit_trace, (unsigned type, const void *permit, unsigned arg));
+//! Writes every thread's trace ring to out. \returns 0: success; EINVAL: I/O error, or tracing was not compiled in.
+PTHREAD_PERMIT_API(int , permit_trace_save, (FILE *out));
+//! Frees every thread's trace ring, typically after saving them at shutdown. No other thread may be tracing during the call.
+PTHREAD_PERMIT_API(void , permit_trace_release, (void));
 //! @}
 
 /*! \defgroup pthread_permitnc_associate Permit kernel object association
-\brief Associates a non-consuming permit with a kernel object's state
+\brief Associates a permit with a kernel object's state
 
 Sets a file descriptor whose signalled state should match the permit's state i.e. the descriptor
 has a single byte written to it to make it signalled when the permit is granted. When the permit
@@ -428,14 +970,35 @@ if desired.
 On Windows only, pthread_permit_associate_winhandle_np() is the Windows equivalent of pthread_permit_associate_fd().
 For convenience there is also a pthread_permit_associate_winevent_np() which is probably much more useful
 on Windows.
+
+On Linux only, pthread_permitnc_associate_eventfd() and pthread_permitc_associate_eventfd() create a new
+eventfd whose state mirrors the permit, returning it in *fd for you to poll(). The descriptor is owned by
+the association and closed by deassociation, and you must never read from nor write to it yourself. Every
+grant, revoke and consuming take compares the eventfd with the permit's state under a lock held by the
+association, and costs one system call only if they differ: writing the counter to one if the permit is
+granted, or reading it back to zero if not. However these race one another, once they have all returned
+the descriptor is readable exactly when the permit could be taken. Unlike the other associations,
+consuming permits can therefore be mirrored too. The eventfd is nonblocking, so mirroring never sleeps
+the granting or waiting thread, though they may briefly spin on one another for the association's lock.
 @{
 */
 //! The type of a permit association handle
 typedef struct pthread_permitnc_association_s *pthread_permitnc_association_t;
+//! The type of a consuming permit association handle
+typedef struct pthread_permitc_association_s *pthread_permitc_association_t;
 //! Associates the state of a kernel file descriptor with the state of a pthread_permitnc_t
 PTHREAD_PERMIT_API(pthread_permitnc_association_t , permitnc_associate_fd, (pthread_permitnc_t *permit, int fds[2]));
 //! Deassociates the state of a kernel file descriptor with the state of a pthread_permitnc_t
 PTHREAD_PERMIT_API(void , permitnc_deassociate, (pthread_permitnc_t *permit, pthread_permitnc_association_t assoc));
+//! Deassociates the state of a kernel file descriptor with the state of a pthread_permitc_t
+PTHREAD_PERMIT_API(void , permitc_deassociate, (pthread_permitc_t *permit, pthread_permitc_association_t assoc));
+
+#if defined(__linux__) || defined(DOXYGEN_PREPROCESSOR)
+//! Associates the state of a new Linux eventfd, returned in *fd, with the state of a pthread_permitc_t
+PTHREAD_PERMIT_API(pthread_permitc_association_t , permitc_associate_eventfd, (pthread_permitc_t *permit, int *fd));
+//! Associates the state of a new Linux eventfd, returned in *fd, with the state of a pthread_permitnc_t
+PTHREAD_PERMIT_API(pthread_permitnc_association_t , permitnc_associate_eventfd, (pthread_permitnc_t *permit, int *fd));
+#endif
 
 #if defined(_WIN32) || defined(DOXYGEN_PREPROCESSOR)
 //! Associates the state of a Windows kernel file handle with the state of a pthread_permitnc_t
@@ -449,12 +1012,145 @@ PTHREAD_PERMIT_APINP(pthread_permitnc_association_t , permitnc_associate_wineven
 
 #ifndef DOXYGEN_PREPROCESSOR
 
+#if PTHREAD_PERMIT_USE_FUTEX
+/* Sleeps the calling thread if *addr still equals expected. reltime is relative and may be null. */
+inline int pthread_permit_futex_wait(atomic_uint *addr, unsigned expected, const struct timespec *reltime)
+{
+  if(-1==syscall(SYS_futex, (unsigned *) addr, FUTEX_WAIT_PRIVATE, expected, reltime, NULL, 0))
+  {
+    if(ETIMEDOUT==errno) return thrd_timeout;
+    /* EAGAIN means *addr had already changed, EINTR a signal. Either way the caller rechecks. */
+    if(EAGAIN!=errno && EINTR!=errno) return thrd_error;
+  }
+  return thrd_success;
+}
+/* Wakes up to count threads sleeping upon addr */
+inline int pthread_permit_futex_wake(atomic_uint *addr, int count)
+{
+  return -1==syscall(SYS_futex, (unsigned *) addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0) ? thrd_error : thrd_success;
+}
+#else
+/* Without futexes the simple permits sleep upon their own condition variable under their own lock
+rather than under the caller's mutex, which a granter doesn't hold. A waiter only sleeps having seen
+*addr zero under the lock, so a granter which changes *addr before waking under the lock can never
+be missed and need wake each sleeper just once. ts is absolute and may be null. */
+inline int pthread_permit_cnd_wait(atomic_uint *addr, mtx_t *lock, cnd_t *cond, pthread_mutex_t *mtx, const struct timespec *ts)
+{
+  int ret=thrd_success;
+  mtx_unlock(mtx);
+  mtx_lock(lock);
+  while(thrd_success==ret && !atomic_load_explicit(addr, memory_order_seq_cst))
+    ret=ts ? cnd_timedwait(cond, lock, ts) : cnd_wait(cond, lock);
+  mtx_unlock(lock);
+  mtx_lock(mtx);
+  return ret;
+}
+/* Wakes one or all threads sleeping in pthread_permit_cnd_wait() */
+inline int pthread_permit_cnd_wake(mtx_t *lock, cnd_t *cond, int all)
+{
+  int ret;
+  mtx_lock(lock);
+  ret=all ? cnd_broadcast(cond) : cnd_signal(cond);
+  mtx_unlock(lock);
+  return ret;
+}
+#endif
+
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+PTHREAD_PERMIT_APIEXPORT atomic_uint PTHREAD_PERMIT_MANGLEAPI(permit_counters_global)[PTHREAD_PERMIT_COUNTER_LAST];
+#define PTHREAD_PERMIT_COUNT(permit, counter) (atomic_fetch_add_explicit(&(permit)->counters[counter], 1U, memory_order_relaxed), \
+  atomic_fetch_add_explicit(&PTHREAD_PERMIT_MANGLEAPI(permit_counters_global)[counter], 1U, memory_order_relaxed))
+#else
+#define PTHREAD_PERMIT_COUNT(permit, counter) ((void) 0)
+#endif
+#if PTHREAD_PERMIT_ENABLE_TRACE
+#define PTHREAD_PERMIT_TRACE(type, permit, arg) PTHREAD_PERMIT_MANGLEAPI(permit_trace)((type), (permit), (unsigned)(arg))
+#else
+#define PTHREAD_PERMIT_TRACE(type, permit, arg) ((void) 0)
+#endif
+
+/* Turns a time period relative to now into an absolute deadline, or null if reltime is null */
+inline const struct timespec *pthread_permit_deadline(struct timespec *deadline, const struct timespec *reltime)
+{
+  if(!reltime) return 0;
+  timespec_get(deadline, TIME_UTC);
+  deadline->tv_sec+=reltime->tv_sec;
+  deadline->tv_nsec+=reltime->tv_nsec;
+  if(deadline->tv_nsec>=1000000000)
+  {
+    deadline->tv_sec++;
+    deadline->tv_nsec-=1000000000;
+  }
+  return deadline;
+}
+
+/* Continuations are queued in a circular list, so only its tail need be kept. The state word holds
+PTHREAD_PERMIT_CONTINUATIONS_LOCKED while the list is being changed, and PTHREAD_PERMIT_CONTINUATIONS_PENDING
+while it is not empty so granters can cheaply see that there is nothing to do. */
+#define PTHREAD_PERMIT_CONTINUATIONS_LOCKED 1U
+#define PTHREAD_PERMIT_CONTINUATIONS_PENDING 2U
+inline void pthread_permit_continuations_lock(atomic_uint *state)
+{
+  unsigned expected;
+  do
+  {
+    expected=atomic_load_explicit(state, memory_order_relaxed)&~PTHREAD_PERMIT_CONTINUATIONS_LOCKED;
+  } while(!atomic_compare_exchange_weak_explicit(state, &expected, expected|PTHREAD_PERMIT_CONTINUATIONS_LOCKED, memory_order_acquire, memory_order_relaxed));
+}
+inline void pthread_permit_continuations_unlock(atomic_uint *state, pthread_permit_continuation_t *tail)
+{
+  atomic_store_explicit(state, tail ? PTHREAD_PERMIT_CONTINUATIONS_PENDING : 0U, memory_order_seq_cst);
+}
+/* Takes the permit on behalf of the oldest queued continuation, replacing the permit with replace, and
+returns it. Returns null if nothing is queued or the permit isn't granted. */
+inline pthread_permit_continuation_t *pthread_permit_continuations_take(atomic_uint *permit, unsigned replace, atomic_uint *state, pthread_permit_continuation_t **tail)
+{
+  pthread_permit_continuation_t *c=0;
+  unsigned expected=1;
+  if(!(atomic_load_explicit(state, memory_order_seq_cst)&PTHREAD_PERMIT_CONTINUATIONS_PENDING)) return 0;
+  pthread_permit_continuations_lock(state);
+  if(*tail && atomic_compare_exchange_strong_explicit(permit, &expected, replace, memory_order_relaxed, memory_order_relaxed))
+  {
+    c=(*tail)->next;
+    if(c==*tail) *tail=0; else (*tail)->next=c->next;
+  }
+  pthread_permit_continuations_unlock(state, *tail);
+  return c;
+}
+/* Takes the permit for c if it is granted, else queues c. The caller must then call
+pthread_permit_continuations_take() in case the permit was granted whilst c was being queued. */
+inline int pthread_permit_continuations_await(atomic_uint *permit, unsigned replace, atomic_uint *state, pthread_permit_continuation_t **tail, pthread_permit_continuation_t *c)
+{
+  unsigned expected=1;
+  // Fetch me a permit
+  if(atomic_compare_exchange_strong_explicit(permit, &expected, replace, memory_order_relaxed, memory_order_relaxed))
+    return thrd_success;
+  pthread_permit_continuations_lock(state);
+  if(*tail)
+  {
+    c->next=(*tail)->next;
+    (*tail)->next=c;
+  }
+  else c->next=c;
+  *tail=c;
+  pthread_permit_continuations_unlock(state, *tail);
+  return thrd_busy;
+}
+
 typedef struct pthread_permit1_s
 {
   atomic_uint magic;                  /* Used to ensure this structure is valid */
-  atomic_uint permit;                 /* =0 no permit, =1 yes permit */
+  atomic_uint permit;                 /* =0 no permit, =1 yes permit. Also the futex word if PTHREAD_PERMIT_USE_FUTEX */
   atomic_uint waiters, waited;        /* Keeps track of when a thread waits and wakes */
+  atomic_uint continuationState;      /* PTHREAD_PERMIT_CONTINUATIONS_* */
+  pthread_permit_continuation_t *continuations; /* The newest queued continuation */
+#if !PTHREAD_PERMIT_USE_FUTEX
+  mtx_t lock;                         /* Serialises sleeping upon cond with waking it */
   cnd_t cond;                         /* Wakes anything waiting for a permit */
+#endif
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+  atomic_uint counters[PTHREAD_PERMIT_COUNTER_LAST]; /* Indexed by PTHREAD_PERMIT_COUNTER_* */
+#endif
 } pthread_permit1_t;
 
 
@@ -462,39 +1158,91 @@ int pthread_permit1_init(pthread_permit1_t *permit, _Bool initial)
 {
   permit->permit=initial;
   permit->waiters=permit->waited=0;
-  if(thrd_success!=cnd_init(&permit->cond)) return thrd_error;
+  permit->continuationState=0;
+  permit->continuations=0;
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+  {
+    int n;
+    for(n=0; n<PTHREAD_PERMIT_COUNTER_LAST; n++)
+      permit->counters[n]=0;
+  }
+#endif
+#if !PTHREAD_PERMIT_USE_FUTEX
+  if(thrd_success!=mtx_init(&permit->lock, mtx_plain)) return thrd_error;
+  if(thrd_success!=cnd_init(&permit->cond))
+  {
+    mtx_destroy(&permit->lock);
+    return thrd_error;
+  }
+#endif
   atomic_store_explicit(&permit->magic, *(const unsigned *)"1PER", memory_order_seq_cst);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_INIT, permit, 0);
   return thrd_success;
 }
 
 void pthread_permit1_destroy(pthread_permit1_t *permit)
 {
+  pthread_permit_continuation_t *c;
   if(*(const unsigned *)"1PER"!=permit->magic) return;
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_DESTROY, permit, 0);
   /* Mark this object as invalid for further use */
   atomic_store_explicit(&permit->magic, 0U, memory_order_seq_cst);
   permit->permit=1;
+  /* Release every queued continuation */
+  while((c=pthread_permit_continuations_take(&permit->permit, 1U, &permit->continuationState, &permit->continuations)))
+    c->func(c);
+#if PTHREAD_PERMIT_USE_FUTEX
+  pthread_permit_futex_wake(&permit->permit, INT_MAX);
+#else
   cnd_destroy(&permit->cond);
+  mtx_destroy(&permit->lock);
+#endif
 }
 
 int pthread_permit1_grant(pthread_permitX_t _permit)
 {
   pthread_permit1_t *permit=(pthread_permit1_t *) _permit;
+  pthread_permit_continuation_t *c;
   int ret=thrd_success;
   if(*(const unsigned *)"1PER"!=permit->magic) return thrd_error;
+  PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_GRANTS);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_GRANT, permit, 0);
   // Grant permit
   atomic_store_explicit(&permit->permit, 1U, memory_order_seq_cst);
+  // Are there continuations on the permit? If so, the oldest receives it
+  if((c=pthread_permit_continuations_take(&permit->permit, 0U, &permit->continuationState, &permit->continuations)))
+  {
+    c->func(c);
+    PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_GRANTED, permit, 0);
+    return ret;
+  }
   // Are there waiters on the permit?
-  if(atomic_load_explicit(&permit->waiters, memory_order_relaxed)!=atomic_load_explicit(&permit->waited, memory_order_relaxed))
-  { // There are indeed waiters. Loop waking until at least one thread takes the permit
-    while(atomic_load_explicit(&permit->permit, memory_order_relaxed))
-    {
-      if(thrd_success!=cnd_signal(&permit->cond))
-      {
-        ret=thrd_error;
-        break;
-      }
-      //if(1==cpus) thrd_yield();
-    }
+  if(atomic_load_explicit(&permit->waiters, memory_order_seq_cst)!=atomic_load_explicit(&permit->waited, memory_order_seq_cst))
+  {
+    // There are indeed waiters. Sleepers recheck the permit word before sleeping, so waking
+    // exactly one sleeper is sufficient for the permit to be taken
+    PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_WAKES);
+#if PTHREAD_PERMIT_USE_FUTEX
+    ret=pthread_permit_futex_wake(&permit->permit, 1);
+#else
+    ret=pthread_permit_cnd_wake(&permit->lock, &permit->cond, 0);
+#endif
+    PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_GRANTED, permit, 1);
+    return ret;
+  }
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_GRANTED, permit, 0);
+  return ret;
+}
+
+int pthread_permit1_await(pthread_permit1_t *permit, pthread_permit_continuation_t *c)
+{
+  int ret;
+  if(*(const unsigned *)"1PER"!=permit->magic) return thrd_error;
+  if(thrd_busy==(ret=pthread_permit_continuations_await(&permit->permit, 0U, &permit->continuationState, &permit->continuations, c)))
+  { // The permit may have been granted since we looked, in which case no granter saw us
+    pthread_permit_continuation_t *granted;
+    if((granted=pthread_permit_continuations_take(&permit->permit, 0U, &permit->continuationState, &permit->continuations)))
+      granted->func(granted);
   }
   return ret;
 }
@@ -502,6 +1250,7 @@ int pthread_permit1_grant(pthread_permitX_t _permit)
 void pthread_permit1_revoke(pthread_permit1_t *permit)
 {
   if(*(const unsigned *)"1PER"!=permit->magic) return;
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_REVOKE, permit, 0);
   atomic_store_explicit(&permit->permit, 0U, memory_order_relaxed);
 }
 
@@ -510,19 +1259,30 @@ int pthread_permit1_wait(pthread_permit1_t *permit, pthread_mutex_t *mtx)
   int ret=thrd_success;
   unsigned expected;
   if(*(const unsigned *)"1PER"!=permit->magic) return thrd_error;
+  PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_WAITS);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_WAIT, permit, 0);
   // Increment the monotonic count to indicate we have entered a wait
-  atomic_fetch_add_explicit(&permit->waiters, 1U, memory_order_acquire);
+  atomic_fetch_add_explicit(&permit->waiters, 1U, memory_order_seq_cst);
   // Fetch me a permit
   while((expected=1, !atomic_compare_exchange_weak_explicit(&permit->permit, &expected, 0U, memory_order_relaxed, memory_order_relaxed)))
   { // Permit is not granted, so wait if we have a mutex
     if(mtx)
     {
-      if(thrd_success!=cnd_wait(&permit->cond, mtx)) { ret=thrd_error; break; }
+      PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_SLEEPS);
+#if PTHREAD_PERMIT_USE_FUTEX
+      mtx_unlock(mtx);
+      ret=pthread_permit_futex_wait(&permit->permit, 0U, NULL);
+      mtx_lock(mtx);
+      if(thrd_success!=ret) break;
+#else
+      if(thrd_success!=pthread_permit_cnd_wait(&permit->permit, &permit->lock, &permit->cond, mtx, NULL)) { ret=thrd_error; break; }
+#endif
     }
     else thrd_yield();
   }
   // Increment the monotonic count to indicate we have exited a wait
   atomic_fetch_add_explicit(&permit->waited, 1U, memory_order_relaxed);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_WAITED, permit, ret);
   return ret;
 }
 
@@ -532,57 +1292,328 @@ int pthread_permit1_timedwait(pthread_permit1_t *permit, pthread_mutex_t *mtx, c
   unsigned expected;
   struct timespec now;
   if(*(const unsigned *)"1PER"!=permit->magic) return thrd_error;
+  PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_WAITS);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_WAIT, permit, 0);
   // Increment the monotonic count to indicate we have entered a wait
-  atomic_fetch_add_explicit(&permit->waiters, 1U, memory_order_acquire);
+  atomic_fetch_add_explicit(&permit->waiters, 1U, memory_order_seq_cst);
   // Fetch me a permit
   while((expected=1, !atomic_compare_exchange_weak_explicit(&permit->permit, &expected, 0U, memory_order_relaxed, memory_order_relaxed)))
   { // Permit is not granted, so wait if we have a mutex and a timeout
+    long long diff;
     if(!ts) { ret=thrd_timeout; break; }
-    else
+    timespec_get(&now, TIME_UTC);
+    diff=timespec_diff(ts, &now);
+    if(diff<=0) { ret=thrd_timeout; break; }
+    if(mtx)
     {
-      long long diff;
-      timespec_get(&now, TIME_UTC);
-      diff=timespec_diff(ts, &now);
-      if(diff<=0) { ret=thrd_timeout; break; }
+#if PTHREAD_PERMIT_USE_FUTEX
+      int cndret;
+      struct timespec rel;
+      rel.tv_sec=(time_t)(diff/1000000000);
+      rel.tv_nsec=(long)(diff%1000000000);
+      PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_SLEEPS);
+      mtx_unlock(mtx);
+      cndret=pthread_permit_futex_wait(&permit->permit, 0U, &rel);
+      mtx_lock(mtx);
+#else
+      int cndret;
+      PTHREAD_PERMIT_COUNT(permit, PTHREAD_PERMIT_COUNTER_SLEEPS);
+      cndret=pthread_permit_cnd_wait(&permit->permit, &permit->lock, &permit->cond, mtx, ts);
+#endif
+      if(thrd_success!=cndret && thrd_timeout!=cndret) { ret=cndret; break; }
     }
+    else thrd_yield();
+  }
+  // Increment the monotonic count to indicate we have exited a wait
+  atomic_fetch_add_explicit(&permit->waited, 1U, memory_order_relaxed);
+  PTHREAD_PERMIT_TRACE(PTHREAD_PERMIT_TRACE_WAITED, permit, ret);
+  return ret;
+}
+
+int pthread_permit1_waitfor(pthread_permit1_t *permit, pthread_mutex_t *mtx, const struct timespec *reltime)
+{
+  struct timespec deadline;
+  return pthread_permit1_timedwait(permit, mtx, pthread_permit_deadline(&deadline, reltime));
+}
+
+typedef struct pthread_permitcount_s
+{
+  atomic_uint magic;                  /* Used to ensure this structure is valid */
+  atomic_uint permits;                /* The number of permits granted but not yet taken. Also the futex word if PTHREAD_PERMIT_USE_FUTEX */
+  atomic_uint waiters, waited;        /* Keeps track of when a thread waits and wakes */
+#if !PTHREAD_PERMIT_USE_FUTEX
+  mtx_t lock;                         /* Serialises sleeping upon cond with waking it */
+  cnd_t cond;                         /* Wakes anything waiting for a permit */
+#endif
+} pthread_permitcount_t;
+
+
+int pthread_permitcount_init(pthread_permitcount_t *permit, unsigned initial)
+{
+  permit->permits=initial;
+  permit->waiters=permit->waited=0;
+#if !PTHREAD_PERMIT_USE_FUTEX
+  if(thrd_success!=mtx_init(&permit->lock, mtx_plain)) return thrd_error;
+  if(thrd_success!=cnd_init(&permit->cond))
+  {
+    mtx_destroy(&permit->lock);
+    return thrd_error;
+  }
+#endif
+  atomic_store_explicit(&permit->magic, *(const unsigned *)"#PER", memory_order_seq_cst);
+  return thrd_success;
+}
+
+void pthread_permitcount_destroy(pthread_permitcount_t *permit)
+{
+  if(*(const unsigned *)"#PER"!=permit->magic) return;
+  /* Mark this object as invalid for further use */
+  atomic_store_explicit(&permit->magic, 0U, memory_order_seq_cst);
+  /* Enough permits to release anything still waiting */
+  atomic_store_explicit(&permit->permits, UINT_MAX/2, memory_order_seq_cst);
+#if PTHREAD_PERMIT_USE_FUTEX
+  pthread_permit_futex_wake(&permit->permits, INT_MAX);
+#else
+  cnd_destroy(&permit->cond);
+  mtx_destroy(&permit->lock);
+#endif
+}
+
+int pthread_permitcount_grant(pthread_permitcount_t *permit, unsigned k)
+{
+  int ret=thrd_success;
+  unsigned expected;
+  if(*(const unsigned *)"#PER"!=permit->magic) return thrd_error;
+  if(!k) return thrd_success;
+  // Grant permits
+  expected=atomic_load_explicit(&permit->permits, memory_order_relaxed);
+  do
+  {
+    if(expected>UINT_MAX-k) return thrd_error;
+  } while(!atomic_compare_exchange_weak_explicit(&permit->permits, &expected, expected+k, memory_order_seq_cst, memory_order_relaxed));
+  // Are there waiters on the permit?
+  if(atomic_load_explicit(&permit->waiters, memory_order_seq_cst)!=atomic_load_explicit(&permit->waited, memory_order_seq_cst))
+  {
+    // There are indeed waiters. Sleepers recheck the count before sleeping, so waking as many
+    // sleepers as permits were granted is sufficient for all to be taken
+#if PTHREAD_PERMIT_USE_FUTEX
+    ret=pthread_permit_futex_wake(&permit->permits, k>INT_MAX ? INT_MAX : (int) k);
+#else
+    ret=pthread_permit_cnd_wake(&permit->lock, &permit->cond, 1!=k);
+#endif
+  }
+  return ret;
+}
+
+void pthread_permitcount_revoke(pthread_permitcount_t *permit)
+{
+  if(*(const unsigned *)"#PER"!=permit->magic) return;
+  atomic_store_explicit(&permit->permits, 0U, memory_order_relaxed);
+}
+
+/* Takes up to k permits if any are available, returning how many were taken */
+inline unsigned pthread_permitcount_take(pthread_permitcount_t *permit, unsigned k)
+{
+  unsigned expected=atomic_load_explicit(&permit->permits, memory_order_relaxed), taken;
+  do
+  {
+    if(!expected) return 0;
+    taken=expected<k ? expected : k;
+  } while(!atomic_compare_exchange_weak_explicit(&permit->permits, &expected, expected-taken, memory_order_acquire, memory_order_relaxed));
+  return taken;
+}
+
+int pthread_permitcount_wait_many(pthread_permitcount_t *permit, unsigned k, unsigned *taken, pthread_mutex_t *mtx)
+{
+  int ret=thrd_success;
+  unsigned got;
+  if(*(const unsigned *)"#PER"!=permit->magic || !k) return thrd_error;
+  // Increment the monotonic count to indicate we have entered a wait
+  atomic_fetch_add_explicit(&permit->waiters, 1U, memory_order_seq_cst);
+  // Fetch me some permits
+  while(!(got=pthread_permitcount_take(permit, k)))
+  { // No permits are granted, so wait if we have a mutex
     if(mtx)
     {
-      int cndret=cnd_timedwait(&permit->cond, mtx, ts);
+#if PTHREAD_PERMIT_USE_FUTEX
+      mtx_unlock(mtx);
+      ret=pthread_permit_futex_wait(&permit->permits, 0U, NULL);
+      mtx_lock(mtx);
+      if(thrd_success!=ret) break;
+#else
+      if(thrd_success!=pthread_permit_cnd_wait(&permit->permits, &permit->lock, &permit->cond, mtx, NULL)) { ret=thrd_error; break; }
+#endif
+    }
+    else thrd_yield();
+  }
+  // Increment the monotonic count to indicate we have exited a wait
+  atomic_fetch_add_explicit(&permit->waited, 1U, memory_order_relaxed);
+  if(taken) *taken=got;
+  return ret;
+}
+
+int pthread_permitcount_timedwait_many(pthread_permitcount_t *permit, unsigned k, unsigned *taken, pthread_mutex_t *mtx, const struct timespec *ts)
+{
+  int ret=thrd_success;
+  unsigned got;
+  struct timespec now;
+  if(*(const unsigned *)"#PER"!=permit->magic || !k) return thrd_error;
+  // Increment the monotonic count to indicate we have entered a wait
+  atomic_fetch_add_explicit(&permit->waiters, 1U, memory_order_seq_cst);
+  // Fetch me some permits
+  while(!(got=pthread_permitcount_take(permit, k)))
+  { // No permits are granted, so wait if we have a mutex and a timeout
+    long long diff;
+    if(!ts) { ret=thrd_timeout; break; }
+    timespec_get(&now, TIME_UTC);
+    diff=timespec_diff(ts, &now);
+    if(diff<=0) { ret=thrd_timeout; break; }
+    if(mtx)
+    {
+#if PTHREAD_PERMIT_USE_FUTEX
+      int cndret;
+      struct timespec rel;
+      rel.tv_sec=(time_t)(diff/1000000000);
+      rel.tv_nsec=(long)(diff%1000000000);
+      mtx_unlock(mtx);
+      cndret=pthread_permit_futex_wait(&permit->permits, 0U, &rel);
+      mtx_lock(mtx);
+#else
+      int cndret=pthread_permit_cnd_wait(&permit->permits, &permit->lock, &permit->cond, mtx, ts);
+#endif
       if(thrd_success!=cndret && thrd_timeout!=cndret) { ret=cndret; break; }
     }
     else thrd_yield();
   }
   // Increment the monotonic count to indicate we have exited a wait
   atomic_fetch_add_explicit(&permit->waited, 1U, memory_order_relaxed);
+  if(taken) *taken=got;
   return ret;
 }
 
-typedef struct pthread_permit_select_s pthread_permit_select_t;
+int pthread_permitcount_wait(pthread_permitcount_t *permit, pthread_mutex_t *mtx)
+{
+  return pthread_permitcount_wait_many(permit, 1U, NULL, mtx);
+}
+
+int pthread_permitcount_timedwait(pthread_permitcount_t *permit, pthread_mutex_t *mtx, const struct timespec *ts)
+{
+  return pthread_permitcount_timedwait_many(permit, 1U, NULL, mtx, ts);
+}
+
+int pthread_permitcount_waitfor(pthread_permitcount_t *permit, pthread_mutex_t *mtx, const struct timespec *reltime)
+{
+  struct timespec deadline;
+  return pthread_permitcount_timedwait(permit, mtx, pthread_permit_deadline(&deadline, reltime));
+}
+
+typedef struct pthread_permit_select_link_s pthread_permit_select_link_t;
+typedef struct pthread_permit_waiter_s pthread_permit_waiter_t;
 struct pthread_permitc_s
-{ /* NOTE: KEEP THIS HEADER THE SAME AS pthread_permit1_t to allow its grant() to optionally work here */
+{ /* NOTE: KEEP THE SAME AS pthread_permit_t in pthread_permit.c */
+  /* Read mostly or written by granters */
   atomic_uint magic;                  /* Used to ensure this structure is valid */
   atomic_uint permit;                 /* =0 no permit, =1 yes permit */
-  atomic_uint waiters, waited;        /* Keeps track of when a thread waits and wakes */
-  cnd_t cond;                         /* Wakes anything waiting for a permit */
-
-  /* Extensions from pthread_permit1_t type */
-  unsigned replacePermit;             /* What to replace the permit with when consumed */
   atomic_uint lockWake;               /* Used to exclude new wakers if and only if waiters don't consume */
-  pthread_permitc_hook_t *RESTRICT hooks[PTHREAD_PERMIT_HOOK_TYPE_LAST];
-  pthread_permit_select_t *volatile RESTRICT selects[64]; /* select permit parent */
+  unsigned replacePermit;             /* What to replace the permit with when consumed */
+  unsigned flags;                     /* The PTHREAD_PERMIT_FLAG_* this permit was initialised with */
+  atomic_uint lockSelects;            /* Serialises the list of selects */
+  pthread_permit_select_link_t *selects; /* Selects currently waiting on this permit */
+  pthread_permitc_hook_t *RESTRICT *hooks; /* PTHREAD_PERMIT_HOOK_TYPE_LAST hook chains, allocated on first hook push */
+  atomic_uint lockHooks;              /* Serialises changes to the hook chains */
+  atomic_uint hookEpoch;              /* Advanced by each hook removal */
+  atomic_uint hookReaders[2];         /* Count of threads calling hooks, by parity of the epoch they entered in */
+  atomic_uint generation;             /* Advanced by each grant if waiters don't consume */
+  char padding[PTHREAD_PERMIT_CACHE_LINE_SIZE-11*sizeof(unsigned)-2*sizeof(void *)];
+
+  /* Written by waiters */
+  atomic_uint waiters, waited;        /* Keeps track of when a thread waits and wakes */
+  atomic_uint spinAverage;            /* Running average of backoff spent spinning before a grant arrived */
+  atomic_uint continuationState;      /* PTHREAD_PERMIT_CONTINUATIONS_* */
+  pthread_permit_continuation_t *continuations; /* The newest queued continuation */
+  atomic_uint lockQueue;              /* Serialises the queue of waiters */
+  atomic_uint queued;                 /* The number of waiters queued, or sleeping if process shared */
+  pthread_permit_waiter_t *queue, *queueTail; /* Waiters queued for a grant to wake them, oldest first */
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+  atomic_uint counters[PTHREAD_PERMIT_COUNTER_LAST]; /* Indexed by PTHREAD_PERMIT_COUNTER_* */
+#endif
 };
 struct pthread_permitnc_s
-{ /* NOTE: KEEP THIS HEADER THE SAME AS pthread_permit1_t to allow its grant() to optionally work here */
+{ /* NOTE: KEEP THE SAME AS pthread_permit_t in pthread_permit.c */
+  /* Read mostly or written by granters */
   atomic_uint magic;                  /* Used to ensure this structure is valid */
   atomic_uint permit;                 /* =0 no permit, =1 yes permit */
+  atomic_uint lockWake;               /* Used to exclude new wakers if and only if waiters don't consume */
+  unsigned replacePermit;             /* What to replace the permit with when consumed */
+  unsigned flags;                     /* The PTHREAD_PERMIT_FLAG_* this permit was initialised with */
+  atomic_uint lockSelects;            /* Serialises the list of selects */
+  pthread_permit_select_link_t *selects; /* Selects currently waiting on this permit */
+  pthread_permitnc_hook_t *RESTRICT *hooks; /* PTHREAD_PERMIT_HOOK_TYPE_LAST hook chains, allocated on first hook push */
+  atomic_uint lockHooks;              /* Serialises changes to the hook chains */
+  atomic_uint hookEpoch;              /* Advanced by each hook removal */
+  atomic_uint hookReaders[2];         /* Count of threads calling hooks, by parity of the epoch they entered in */
+  atomic_uint generation;             /* Advanced by each grant if waiters don't consume */
+  char padding[PTHREAD_PERMIT_CACHE_LINE_SIZE-11*sizeof(unsigned)-2*sizeof(void *)];
+
+  /* Written by waiters */
   atomic_uint waiters, waited;        /* Keeps track of when a thread waits and wakes */
-  cnd_t cond;                         /* Wakes anything waiting for a permit */
+  atomic_uint spinAverage;            /* Running average of backoff spent spinning before a grant arrived */
+  atomic_uint continuationState;      /* PTHREAD_PERMIT_CONTINUATIONS_* */
+  pthread_permit_continuation_t *continuations; /* The newest queued continuation */
+  atomic_uint lockQueue;              /* Serialises the queue of waiters */
+  atomic_uint queued;                 /* The number of waiters queued, or sleeping if process shared */
+  pthread_permit_waiter_t *queue, *queueTail; /* Waiters queued for a grant to wake them, oldest first */
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+  atomic_uint counters[PTHREAD_PERMIT_COUNTER_LAST]; /* Indexed by PTHREAD_PERMIT_COUNTER_* */
+#endif
+};
 
-  /* Extensions from pthread_permit1_t type */
-  unsigned replacePermit;             /* What to replace the permit with when consumed */
-  atomic_uint lockWake;               /* Used to exclude new wakers if and only if waiters don't consume */
-  pthread_permitnc_hook_t *RESTRICT hooks[PTHREAD_PERMIT_HOOK_TYPE_LAST];
-  pthread_permit_select_t *volatile RESTRICT selects[64]; /* select permit parent */
+
+typedef struct pthread_permit_selectset_member_s pthread_permit_selectset_member_t;
+struct pthread_permit_selectset_s
+{
+  atomic_uint magic;                  /* Used to ensure this structure is valid */
+  atomic_uint lock;                   /* Serialises access to the member and ready lists */
+  atomic_uint ready;                  /* Count of members on the ready list */
+  atomic_uint sleepers;               /* Count of threads sleeping on cond */
+  pthread_permit_selectset_member_t *members; /* All registered permits */
+  pthread_permit_selectset_member_t *readyhead, *readytail; /* Registered permits granted since last examined */
+  mtx_t sleeplock;                    /* Protects sleeping on cond */
+  cnd_t cond;                         /* Wakes anything waiting for a ready permit */
+};
+
+#ifdef __linux__
+typedef struct pthread_permit_reactor_member_s pthread_permit_reactor_member_t;
+struct pthread_permit_reactor_s
+{
+  atomic_uint magic;                  /* Used to ensure this structure is valid */
+  atomic_uint ready;                  /* Index plus one of the most recently granted member, else zero. Members link via their next. */
+  int fd;                             /* The eventfd written when ready becomes non-empty */
+  unsigned pending;                   /* Index plus one of the oldest member taken from ready but not yet examined */
+  size_t capacity;                    /* The number of members */
+  size_t freeslots;                   /* The number of unused members */
+  unsigned *freeslot;                 /* Indices of unused members */
+  pthread_permit_reactor_member_t *members; /* All members, used or not */
+};
+#endif
+
+struct pthread_permitset_s
+{
+  atomic_uint magic;                  /* Used to ensure this structure is valid */
+  unsigned replacePermit;             /* =1 if waiters don't consume */
+  size_t no, words;                   /* The number of permits, and of words holding their bits */
+  atomic_uint *bits;                  /* One bit per permit, cache line aligned and padded to whole cache lines */
+  void *allocation;                   /* The block bits lies within */
+  atomic_uint hint;                   /* The word holding the most recently granted permit */
+  atomic_uint lockWake;               /* Serialises grants if waiters don't consume */
+  atomic_uint generation;             /* Advanced by every grant. Also the futex word if PTHREAD_PERMIT_USE_FUTEX */
+  atomic_uint lastGranted;            /* The most recently granted permit if waiters don't consume */
+  atomic_uint sleepers;               /* The number of waiters sleeping upon generation */
+  atomic_uint waiting;                /* The number of threads within a wait, which destruction waits to leave */
+#if !PTHREAD_PERMIT_USE_FUTEX
+  mtx_t lock;                         /* Serialises sleeping upon cond */
+  cnd_t cond;                         /* Wakes sleepers */
+#endif
 };
 
 #endif // DOXYGEN_PREPROCESSOR
@@ -0,0 +1,117 @@
+/* pthread_permit_coroutine.hpp
+Lets C++ 20 coroutines co_await permits
+(C) 2011-2012 Niall Douglas http://www.nedproductions.biz/
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef PTHREAD_PERMIT_COROUTINE_HPP
+#define PTHREAD_PERMIT_COROUTINE_HPP
+
+/*! \file
+\brief Lets C++ 20 coroutines \c co_await a permit without blocking their thread
+
+\code
+task consumer(pthread_permitc_t &permit, my_thread_pool &pool)
+{
+  co_await permit;                                  // Resumed by whoever grants the permit
+  co_await pthread_permit_coroutine::on(permit, pool); // Resumed by pool(handle)
+}
+\endcode
+
+A suspended coroutine is queued upon the permit as a pthread_permit_continuation_t living inside
+its coroutine frame, so no memory is allocated. Without an executor the coroutine is resumed from
+within the grant by the granting thread, so it must not wait upon nor grant the same permit before
+its next suspension point. An executor is anything callable with a std::coroutine_handle<>,
+and is typically used to post the resumption onto some other thread.
+*/
+
+#include "pthread_permit.h"
+
+#if defined(__cpp_impl_coroutine) || defined(DOXYGEN_PREPROCESSOR)
+#include <coroutine>
+#include <system_error>
+#include <utility>
+
+namespace pthread_permit_coroutine
+{
+  //! Resumes the coroutine from within the grant
+  struct inline_executor
+  {
+    void operator()(std::coroutine_handle<> h) const { h.resume(); }
+  };
+
+  namespace detail
+  {
+    inline int await(pthread_permit1_t *permit, pthread_permit_continuation_t *c) { return pthread_permit1_await(permit, c); }
+    inline int await(pthread_permitc_t *permit, pthread_permit_continuation_t *c) { return PTHREAD_PERMIT_MANGLEAPI(permitc_await)(permit, c); }
+    inline int await(pthread_permitnc_t *permit, pthread_permit_continuation_t *c) { return PTHREAD_PERMIT_MANGLEAPI(permitnc_await)(permit, c); }
+  }
+
+  //! The awaitable returned by co_await upon a permit
+  template<class Permit, class Executor=inline_executor> class awaiter
+  {
+    Permit *_permit;
+    Executor _executor;
+    std::coroutine_handle<> _handle;
+    pthread_permit_continuation_t _continuation;
+    static void _resume(pthread_permit_continuation_t *c)
+    {
+      awaiter *self=static_cast<awaiter *>(c->data);
+      self->_executor(self->_handle);
+    }
+  public:
+    awaiter(Permit &permit, Executor executor=Executor()) : _permit(&permit), _executor(std::move(executor)) { }
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+      int ret;
+      _handle=h;
+      _continuation.func=&_resume;
+      _continuation.data=this;
+      _continuation.next=0;
+      // Once queued we may have been resumed and destroyed already, so this must not be touched
+      ret=detail::await(_permit, &_continuation);
+      if(thrd_busy==ret) return true;
+      if(thrd_success!=ret) throw std::system_error(ret, std::generic_category());
+      return false;
+    }
+    void await_resume() const noexcept { }
+  };
+
+  //! Awaits a permit, resuming the coroutine via the executor
+  template<class Permit, class Executor> awaiter<Permit, Executor> on(Permit &permit, Executor executor)
+  {
+    return awaiter<Permit, Executor>(permit, std::move(executor));
+  }
+}
+
+inline pthread_permit_coroutine::awaiter<pthread_permit1_t> operator co_await(pthread_permit1_t &permit) { return pthread_permit_coroutine::awaiter<pthread_permit1_t>(permit); }
+inline pthread_permit_coroutine::awaiter<pthread_permitc_t> operator co_await(pthread_permitc_t &permit) { return pthread_permit_coroutine::awaiter<pthread_permitc_t>(permit); }
+inline pthread_permit_coroutine::awaiter<pthread_permitnc_t> operator co_await(pthread_permitnc_t &permit) { return pthread_permit_coroutine::awaiter<pthread_permitnc_t>(permit); }
+#endif
+
+#endif
@@ -1,59 +1,219 @@
-/* test_permit.c
-Tests the proposed C1X permit object
+/* pthread_permit_speedtest.cpp
+Benchmarks the proposed C1X permit object
 (C) 2011-2012 Niall Douglas http://www.nedproductions.biz/
 
+Usage: pthread_permit_speedtest [options]
+  -p <list>    Primitives to benchmark: permit1,permitc,permitc_fair,permitnc,select,sem,condvar,
+               eventfd,futex,binary_semaphore (default all available)
+  -m <list>    Modes: contended,uncontended,latency (default contended,uncontended)
+  -s <list>    How waiters wait: mutex,spin (default all)
+  -g <list>    Numbers of granting threads, e.g. 1,2,4 or 1-4 (default 1)
+  -w <list>    Numbers of waiting threads, e.g. 1,2,4 or 1-4 (default 1)
+  -d <ms>      Run each benchmark for this long (default 1000)
+  -i <count>   Instead run each benchmark until this many waits have completed
+  -r <count>   Run each benchmark this many times (default 1)
+  -l <rate>    Grants per second offered in latency mode (default 10000)
+  -f csv|json  Output format (default csv)
+  -o <file>    Write results to a file instead of stdout
 
-On a 2.67Ghz Intel Core 2 Quad:
+Every combination of the lists given is benchmarked. In contended mode the granting threads grant
+continuously while the waiting threads wait. In uncontended mode a single thread grants and then
+waits, so never blocks, and the thread counts are ignored. Waiters waiting with a mutex pass a
+locked mutex and so sleep, whereas spinning waiters pass none and so loop yielding. Waiters on a
+pthread_permitnc_t revoke it after each wait so the next grant releases them again, and the select
+benchmark has each granter grant its own pthread_permitc_t while the waiters select over all of them.
+permitc_fair is a pthread_permitc_t initialised with PTHREAD_PERMIT_FLAG_FAIR.
 
-Simple permit1:
+So the cost of a permit's safety can be weighed, the same handoff is also built upon the primitives
+people use instead of a permit. Each is used the way it typically would be to emulate a binary
+consuming permit: a POSIX sem_t posted only when not already posted, a condition variable and flag
+under a mutex, a Linux eventfd whose reads take all outstanding writes, a raw Linux futex word, and
+a C++ 20 std::binary_semaphore released only when not already granted. Spinning waiters of these
+poll the primitive's nonblocking take, yielding between polls. std::latch is not benchmarked as it
+cannot be reused for a second handoff.
 
-Uncontended grant time: 48 cycles
-Uncontended revoke time: 0 cycles
-Uncontended wait time: 142 cycles
+In latency mode one thread grants at a fixed offered rate to one waiting thread, never granting
+again before the previous grant was taken, and each handoff's latency is recorded into a log-linear
+histogram with 1/64 precision. Latency is measured from when the grant was scheduled to be made
+rather than when it actually was, so a slow handoff which delays later grants also counts against
+them instead of hiding the stall (coordinated omission). The 50th, 99th and 99.9th percentiles,
+mean and maximum are reported. Run with -p select to measure select, and -s to choose mutex or spin.
 
-1 contended grant time: 725 cycles (359 without revoke)
-1 contended revoke time: 4 cycles
-1 contended wait time: 1044 cycles (372 without revoke)
+An op is one completed wait, so ns/op is the elapsed time divided by the waits completed across all
+waiting threads, and ops/s is its reciprocal. Each result also records the host, its CPU count and
+how the permit was built, including its PTHREAD_PERMIT_CACHE_LINE_SIZE, so results from different
+builds and hosts can be compared. Fairness is
+Jain's index over the waits each waiting thread completed, (sum x)^2/(n*sum x^2), so 1 means every
+waiter was served equally often and 1/n means one waiter was served to the exclusion of the rest.
+*/
+
+#include "pthread_permit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <semaphore.h>
+#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#if defined(__has_include) && __cplusplus>=202002L
+#if __has_include(<semaphore>)
+#include <semaphore>
+#endif
+#endif
 
+#define MAX_THREADS 256
+#define MAX_COUNTS 64
 
-DoConsume:
+#define permitc_init PTHREAD_PERMIT_MANGLEAPI(permitc_init)
+#define permitc_init_flags PTHREAD_PERMIT_MANGLEAPI(permitc_init_flags)
+#define permitnc_init PTHREAD_PERMIT_MANGLEAPI(permitnc_init)
+#define permitc_destroy PTHREAD_PERMIT_MANGLEAPI(permitc_destroy)
+#define permitnc_destroy PTHREAD_PERMIT_MANGLEAPI(permitnc_destroy)
+#define permitc_grant PTHREAD_PERMIT_MANGLEAPI(permitc_grant)
+#define permitnc_grant PTHREAD_PERMIT_MANGLEAPI(permitnc_grant)
+#define permitnc_revoke PTHREAD_PERMIT_MANGLEAPI(permitnc_revoke)
+#define permitc_wait PTHREAD_PERMIT_MANGLEAPI(permitc_wait)
+#define permitnc_wait PTHREAD_PERMIT_MANGLEAPI(permitnc_wait)
+#define permit_select PTHREAD_PERMIT_MANGLEAPI(permit_select)
 
-Uncontended grant time: 61 cycles
-Uncontended revoke time: 45 cycles
-Uncontended wait time: 135 cycles
+typedef enum benchmark_mode_e
+{
+  MODE_CONTENDED,
+  MODE_UNCONTENDED,
+  MODE_LATENCY,
+  MODE_LAST
+} benchmark_mode_t;
+static const char *modenames[MODE_LAST]={ "contended", "uncontended", "latency" };
 
-1 contended grant time: 731 cycles
-1 contended revoke time: 160 cycles
-1 contended wait time: 1195 cycles
+typedef enum benchmark_wait_e
+{
+  WAIT_MUTEX,
+  WAIT_SPIN,
+  WAIT_LAST
+} benchmark_wait_t;
+static const char *waitnames[WAIT_LAST]={ "mutex", "spin" };
 
+/* A log-linear histogram of nanosecond latencies in the style of HdrHistogram. Values below
+HISTOGRAM_SUB_BUCKETS are exact, above which each power of two is split into
+HISTOGRAM_SUB_BUCKETS/2 buckets. */
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+#define HISTOGRAM_SUB_BUCKETS (1U<<HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS+(64-HISTOGRAM_SUB_BUCKET_BITS)*HISTOGRAM_SUB_BUCKETS/2)
+typedef struct histogram_s
+{
+  unsigned long long counts[HISTOGRAM_BUCKETS];
+  unsigned long long total, sum, max;
+} histogram_t;
 
-DontConsume:
+static unsigned histogram_index(unsigned long long value)
+{
+  unsigned shift=0;
+  if(value<HISTOGRAM_SUB_BUCKETS) return (unsigned) value;
+  while((value>>shift)>=HISTOGRAM_SUB_BUCKETS) shift++;
+  return HISTOGRAM_SUB_BUCKETS+(shift-1)*HISTOGRAM_SUB_BUCKETS/2+(unsigned)(value>>shift)-HISTOGRAM_SUB_BUCKETS/2;
+}
 
-Uncontended grant time: 102 cycles
-Uncontended revoke time: 46 cycles
-Uncontended wait time: 137 cycles
+/* Returns the highest value which would be recorded into a bucket */
+static unsigned long long histogram_value(unsigned index)
+{
+  unsigned shift;
+  if(index<HISTOGRAM_SUB_BUCKETS) return index;
+  index-=HISTOGRAM_SUB_BUCKETS;
+  shift=index/(HISTOGRAM_SUB_BUCKETS/2)+1;
+  return (((unsigned long long)(index%(HISTOGRAM_SUB_BUCKETS/2)+HISTOGRAM_SUB_BUCKETS/2+1))<<shift)-1;
+}
 
-1 contended grant time: 856 cycles
-1 contended revoke time: 207 cycles
-1 contended wait time: 887 cycles
-*/
+static void histogram_record(histogram_t *h, unsigned long long value)
+{
+  h->counts[histogram_index(value)]++;
+  h->total++;
+  h->sum+=value;
+  if(value>h->max) h->max=value;
+}
 
-#include "pthread_permit.h"
-#include "../timing.h"
-#include <stdio.h>
+static unsigned long long histogram_percentile(const histogram_t *h, double percentile)
+{
+  unsigned long long count=0, want=(unsigned long long)(percentile/100*h->total+0.5);
+  unsigned n;
+  if(!want) want=1;
+  for(n=0; n<HISTOGRAM_BUCKETS; n++)
+    if((count+=h->counts[n])>=want)
+      return histogram_value(n)<h->max ? histogram_value(n) : h->max;
+  return h->max;
+}
 
-#define THREADS 2
-#define CYCLESPERMICROSECOND (2.67*1000000000/1000000000000)
-#define DONTCONSUME 0
-// Define to test uncontended, set to what to exclude (0=test permit_wait, 1=test permit_revoke/permit_grant)
-#define UNCONTENDED 0
+typedef struct benchmark_s benchmark_t;
 
-static usCount timingoverhead;
-static thrd_t threads[THREADS];
-static volatile int done;
-static void *permitaddr;
+/* A primitive being benchmarked */
+typedef struct primitive_s
+{
+  const char *name;
+  int (*init)(benchmark_t *b);
+  void (*destroy)(benchmark_t *b);
+  void (*grant)(benchmark_t *b, unsigned granter);
+  int (*wait)(benchmark_t *b, mtx_t *mtx);
+  void (*waited)(benchmark_t *b);     /* Called after each successful wait if not null */
+} primitive_t;
 
-void mssleep(long ms)
+typedef struct thread_s
+{
+  thrd_t thread;                      /* Joined once the benchmark has finished */
+  benchmark_t *b;
+  unsigned index;
+  unsigned long long count;
+  char padding[64];                   /* Keep each thread's count on its own cache line */
+} thread_t;
+
+struct benchmark_s
+{
+  const primitive_t *primitive;
+  benchmark_mode_t mode;
+  benchmark_wait_t wait;
+  unsigned granters, waiters;
+  unsigned long long duration;        /* In nanoseconds, zero if running for iterations */
+  unsigned long long iterations;
+  atomic_uint go, done, running, waiting;
+  unsigned long long start, end;
+  unsigned long long rate;            /* Grants per second offered in latency mode */
+  unsigned long long intended;        /* When the current grant was scheduled in latency mode */
+  atomic_uint received;               /* Handoffs completed in latency mode */
+  histogram_t histogram;
+  pthread_permit1_t permit1;
+  pthread_permitc_t permitc[MAX_THREADS];
+  pthread_permitnc_t permitnc;
+#ifndef _WIN32
+  sem_t sem;
+  atomic_uint semgranted;
+#endif
+  pthread_mutex_t condmtx;
+  pthread_cond_t cond;
+  unsigned flag;
+  int eventfd;
+  atomic_uint futex;
+#ifdef __cpp_lib_semaphore
+  std::binary_semaphore *binarysemaphore;
+  atomic_uint binarysemaphoregranted;
+#endif
+  thread_t threads[2*MAX_THREADS];
+};
+
+static unsigned long long now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (unsigned long long) ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+static void mssleep(long ms)
 {
   struct timespec ts;
   ts.tv_sec=ms/1000;
@@ -61,98 +221,610 @@ void mssleep(long ms)
   thrd_sleep(&ts, NULL);
 }
 
-template<typename permit_t, int (*permit_grant)(pthread_permitX_t), void (*permit_revoke)(permit_t *), int(*permit_wait)(permit_t *, mtx_t *mtx)> int threadfunc(void *mynum)
+
+/****************************************** Primitives **********************************************/
+static int permit1_init(benchmark_t *b) { return pthread_permit1_init(&b->permit1, 0); }
+static void permit1_destroy(benchmark_t *b) { pthread_permit1_destroy(&b->permit1); }
+static void permit1_grant(benchmark_t *b, unsigned granter) { (void) granter; pthread_permit1_grant((pthread_permitX_t) &b->permit1); }
+static int permit1_wait(benchmark_t *b, mtx_t *mtx) { return pthread_permit1_wait(&b->permit1, mtx); }
+
+static int permitc_init_(benchmark_t *b) { return permitc_init(&b->permitc[0], 0); }
+static void permitc_destroy_(benchmark_t *b) { permitc_destroy(&b->permitc[0]); }
+static int permitc_fair_init(benchmark_t *b) { return permitc_init_flags(&b->permitc[0], 0, PTHREAD_PERMIT_FLAG_FAIR); }
+static void permitc_grant_(benchmark_t *b, unsigned granter) { (void) granter; permitc_grant(&b->permitc[0]); }
+static int permitc_wait_(benchmark_t *b, mtx_t *mtx) { return permitc_wait(&b->permitc[0], mtx); }
+
+static int permitnc_init_(benchmark_t *b) { return permitnc_init(&b->permitnc, 0); }
+static void permitnc_destroy_(benchmark_t *b) { permitnc_destroy(&b->permitnc); }
+static void permitnc_grant_(benchmark_t *b, unsigned granter) { (void) granter; permitnc_grant(&b->permitnc); }
+static int permitnc_wait_(benchmark_t *b, mtx_t *mtx) { return permitnc_wait(&b->permitnc, mtx); }
+static void permitnc_waited(benchmark_t *b) { permitnc_revoke(&b->permitnc); }
+
+static int select_init(benchmark_t *b)
+{
+  unsigned n;
+  for(n=0; n<b->granters; n++)
+    if(thrd_success!=permitc_init(&b->permitc[n], 0)) return thrd_error;
+  return thrd_success;
+}
+static void select_destroy(benchmark_t *b)
+{
+  unsigned n;
+  for(n=0; n<b->granters; n++)
+    permitc_destroy(&b->permitc[n]);
+}
+static void select_grant(benchmark_t *b, unsigned granter) { permitc_grant(&b->permitc[granter % b->granters]); }
+static int select_wait(benchmark_t *b, mtx_t *mtx)
+{
+  pthread_permitX_t permits[MAX_THREADS];
+  unsigned n;
+  for(n=0; n<b->granters; n++)
+    permits[n]=&b->permitc[n];
+  return permit_select(b->granters, permits, mtx, NULL);
+}
+
+#ifndef _WIN32
+static int sem_init_(benchmark_t *b)
+{
+  atomic_store_explicit(&b->semgranted, 0U, memory_order_relaxed);
+  return sem_init(&b->sem, 0, 0) ? thrd_error : thrd_success;
+}
+static void sem_destroy_(benchmark_t *b) { sem_destroy(&b->sem); }
+static void sem_grant(benchmark_t *b, unsigned granter)
 {
-  size_t mythread=(size_t) mynum;
-  permit_t *permit=(permit_t *)permitaddr;
-  usCount start, end;
-  size_t count=0;
-#ifdef UNCONTENDED
-  if(UNCONTENDED==mythread) return 0;
+  (void) granter;
+  // sem_getvalue() then sem_post() would let concurrent granters both post, so cap it with a flag
+  if(!atomic_exchange_explicit(&b->semgranted, 1U, memory_order_acq_rel))
+    sem_post(&b->sem);
+}
+static int sem_wait_(benchmark_t *b, mtx_t *mtx)
+{
+  if(mtx)
+  {
+    if(sem_wait(&b->sem)) return thrd_error;
+  }
+  else
+    while(sem_trywait(&b->sem)) thrd_yield();
+  atomic_store_explicit(&b->semgranted, 0U, memory_order_release);
+  return thrd_success;
+}
 #endif
-  if(!mynum)
+
+static int condvar_init(benchmark_t *b)
+{
+  b->flag=0;
+  if(pthread_mutex_init(&b->condmtx, NULL)) return thrd_error;
+  return pthread_cond_init(&b->cond, NULL) ? thrd_error : thrd_success;
+}
+static void condvar_destroy(benchmark_t *b)
+{
+  pthread_cond_destroy(&b->cond);
+  pthread_mutex_destroy(&b->condmtx);
+}
+static void condvar_grant(benchmark_t *b, unsigned granter)
+{
+  (void) granter;
+  pthread_mutex_lock(&b->condmtx);
+  b->flag=1;
+  pthread_cond_signal(&b->cond);
+  pthread_mutex_unlock(&b->condmtx);
+}
+static int condvar_wait(benchmark_t *b, mtx_t *mtx)
+{
+  pthread_mutex_lock(&b->condmtx);
+  while(!b->flag)
+  {
+    if(mtx)
+      pthread_cond_wait(&b->cond, &b->condmtx);
+    else
+    {
+      pthread_mutex_unlock(&b->condmtx);
+      thrd_yield();
+      pthread_mutex_lock(&b->condmtx);
+    }
+  }
+  b->flag=0;
+  pthread_mutex_unlock(&b->condmtx);
+  return thrd_success;
+}
+
+#ifdef __linux__
+static int eventfd_init(benchmark_t *b) { return (b->eventfd=eventfd(0, EFD_NONBLOCK))<0 ? thrd_error : thrd_success; }
+static void eventfd_destroy(benchmark_t *b) { close(b->eventfd); }
+static void eventfd_grant(benchmark_t *b, unsigned granter)
+{
+  uint64_t one=1;
+  (void) granter;
+  if(sizeof(one)!=write(b->eventfd, &one, sizeof(one))) abort();
+}
+static int eventfd_wait(benchmark_t *b, mtx_t *mtx)
+{
+  uint64_t value;
+  // Reads take every grant written since the last read, so grants do not accumulate
+  while(sizeof(value)!=read(b->eventfd, &value, sizeof(value)))
   {
-    usCount revoketotal=0, granttotal=0;
-    while(!done)
+    if(mtx)
     {
-#if DONTCONSUME
-      // Revoke permit
-      start=GetUsCount();
-      permit_revoke(permit);
-      end=GetUsCount();
-      revoketotal+=end-start-timingoverhead;
-      //printf("Thread %u revoked permit\n", mythread);
+      struct pollfd pfd={ b->eventfd, POLLIN, 0 };
+      poll(&pfd, 1, -1);
+    }
+    else thrd_yield();
+  }
+  return thrd_success;
+}
+
+static int futex_init(benchmark_t *b) { atomic_store_explicit(&b->futex, 0U, memory_order_relaxed); return thrd_success; }
+static void futex_destroy(benchmark_t *b) { (void) b; }
+static void futex_grant(benchmark_t *b, unsigned granter)
+{
+  (void) granter;
+  if(!atomic_exchange_explicit(&b->futex, 1U, memory_order_release))
+    syscall(SYS_futex, &b->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+static int futex_wait(benchmark_t *b, mtx_t *mtx)
+{
+  unsigned expected=1;
+  while(!atomic_compare_exchange_weak_explicit(&b->futex, &expected, 0U, memory_order_acquire, memory_order_relaxed))
+  {
+    if(mtx)
+      syscall(SYS_futex, &b->futex, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+    else thrd_yield();
+    expected=1;
+  }
+  return thrd_success;
+}
+#endif
+
+#ifdef __cpp_lib_semaphore
+static int binarysemaphore_init(benchmark_t *b)
+{
+  atomic_store_explicit(&b->binarysemaphoregranted, 0U, memory_order_relaxed);
+  return (b->binarysemaphore=new std::binary_semaphore(0)) ? thrd_success : thrd_nomem;
+}
+static void binarysemaphore_destroy(benchmark_t *b) { delete b->binarysemaphore; }
+static void binarysemaphore_grant(benchmark_t *b, unsigned granter)
+{
+  (void) granter;
+  // Releasing a binary semaphore already released is undefined behaviour
+  if(!atomic_exchange_explicit(&b->binarysemaphoregranted, 1U, memory_order_acq_rel))
+    b->binarysemaphore->release();
+}
+static int binarysemaphore_wait(benchmark_t *b, mtx_t *mtx)
+{
+  if(mtx)
+    b->binarysemaphore->acquire();
+  else
+    while(!b->binarysemaphore->try_acquire()) thrd_yield();
+  atomic_store_explicit(&b->binarysemaphoregranted, 0U, memory_order_release);
+  return thrd_success;
+}
+#endif
+
+static const primitive_t primitives[]={
+  { "permit1", permit1_init, permit1_destroy, permit1_grant, permit1_wait, NULL },
+  { "permitc", permitc_init_, permitc_destroy_, permitc_grant_, permitc_wait_, NULL },
+  { "permitc_fair", permitc_fair_init, permitc_destroy_, permitc_grant_, permitc_wait_, NULL },
+  { "permitnc", permitnc_init_, permitnc_destroy_, permitnc_grant_, permitnc_wait_, permitnc_waited },
+  { "select", select_init, select_destroy, select_grant, select_wait, NULL },
+#ifndef _WIN32
+  { "sem", sem_init_, sem_destroy_, sem_grant, sem_wait_, NULL },
+#endif
+  { "condvar", condvar_init, condvar_destroy, condvar_grant, condvar_wait, NULL },
+#ifdef __linux__
+  { "eventfd", eventfd_init, eventfd_destroy, eventfd_grant, eventfd_wait, NULL },
+  { "futex", futex_init, futex_destroy, futex_grant, futex_wait, NULL },
+#endif
+#ifdef __cpp_lib_semaphore
+  { "binary_semaphore", binarysemaphore_init, binarysemaphore_destroy, binarysemaphore_grant, binarysemaphore_wait, NULL },
 #endif
-      //mssleep(1000);
-      //printf("\nThread %u granting permit\n", mythread);
-      start=GetUsCount();
-      permit_grant(permit);
-      end=GetUsCount();
-      granttotal+=end-start-timingoverhead;
-      //mssleep(1);
-      count++;
+};
+#define PRIMITIVES (sizeof(primitives)/sizeof(primitives[0]))
+
+
+/****************************************** Threads *************************************************/
+static int granter(void *arg)
+{
+  thread_t *t=(thread_t *) arg;
+  benchmark_t *b=t->b;
+  while(!atomic_load_explicit(&b->go, memory_order_acquire)) thrd_yield();
+  while(!atomic_load_explicit(&b->done, memory_order_relaxed))
+  {
+    b->primitive->grant(b, t->index);
+    t->count++;
+  }
+  atomic_fetch_add_explicit(&b->running, (unsigned)-1, memory_order_release);
+  return 0;
+}
+
+static int waiter(void *arg)
+{
+  thread_t *t=(thread_t *) arg;
+  benchmark_t *b=t->b;
+  unsigned long long limit=b->iterations ? (b->iterations+b->waiters-1)/b->waiters : 0;
+  mtx_t mtx;
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  while(!atomic_load_explicit(&b->go, memory_order_acquire)) thrd_yield();
+  while(!atomic_load_explicit(&b->done, memory_order_relaxed))
+  {
+    if(thrd_success!=b->primitive->wait(b, WAIT_MUTEX==b->wait ? &mtx : NULL)) continue;
+    if(b->primitive->waited) b->primitive->waited(b);
+    if(++t->count==limit) break;
+  }
+  // The last waiter to finish its iterations ends the benchmark
+  if(1==atomic_fetch_add_explicit(&b->waiting, (unsigned)-1, memory_order_acq_rel) && b->iterations)
+  {
+    b->end=now();
+    atomic_store_explicit(&b->done, 1U, memory_order_release);
+  }
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  atomic_fetch_add_explicit(&b->running, (unsigned)-1, memory_order_release);
+  return 0;
+}
+
+static int uncontended(void *arg)
+{
+  thread_t *t=(thread_t *) arg;
+  benchmark_t *b=t->b;
+  mtx_t mtx;
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  while(!atomic_load_explicit(&b->go, memory_order_acquire)) thrd_yield();
+  while(!atomic_load_explicit(&b->done, memory_order_relaxed))
+  {
+    b->primitive->grant(b, (unsigned) t->count);
+    if(thrd_success!=b->primitive->wait(b, WAIT_MUTEX==b->wait ? &mtx : NULL)) continue;
+    if(b->primitive->waited) b->primitive->waited(b);
+    if(++t->count==b->iterations)
+    {
+      b->end=now();
+      atomic_store_explicit(&b->done, 1U, memory_order_release);
     }
-    printf("Thread %u, average revoke/grant time was %u/%u cycles\n", mythread, (size_t)((double)revoketotal/count*CYCLESPERMICROSECOND), (size_t)((double)granttotal/count*CYCLESPERMICROSECOND));
-    permit_grant(permit);
+  }
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  atomic_fetch_add_explicit(&b->running, (unsigned)-1, memory_order_release);
+  return 0;
+}
+
+static int latency_granter(void *arg)
+{
+  thread_t *t=(thread_t *) arg;
+  benchmark_t *b=t->b;
+  unsigned long long interval=1000000000ULL/b->rate;
+  while(!atomic_load_explicit(&b->go, memory_order_acquire)) thrd_yield();
+  while(!atomic_load_explicit(&b->done, memory_order_relaxed))
+  {
+    unsigned long long intended=b->start+t->count*interval, time;
+    while((time=now())<intended && !atomic_load_explicit(&b->done, memory_order_relaxed))
+    {
+      if(intended-time>2000000) mssleep(1);
+      else thrd_yield();
+    }
+    // Only grant once the previous grant has been taken, else grants would merge
+    while(atomic_load_explicit(&b->received, memory_order_acquire)!=(unsigned) t->count && !atomic_load_explicit(&b->done, memory_order_relaxed))
+      thrd_yield();
+    b->intended=intended;
+    b->primitive->grant(b, 0);
+    t->count++;
+  }
+  atomic_fetch_add_explicit(&b->running, (unsigned)-1, memory_order_release);
+  return 0;
+}
+
+static int latency_waiter(void *arg)
+{
+  thread_t *t=(thread_t *) arg;
+  benchmark_t *b=t->b;
+  mtx_t mtx;
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  while(!atomic_load_explicit(&b->go, memory_order_acquire)) thrd_yield();
+  while(!atomic_load_explicit(&b->done, memory_order_relaxed))
+  {
+    unsigned long long time;
+    if(thrd_success!=b->primitive->wait(b, WAIT_MUTEX==b->wait ? &mtx : NULL)) continue;
+    time=now();
+    if(b->primitive->waited) b->primitive->waited(b);
+    // Ignore the grants releasing us at the end
+    if(atomic_load_explicit(&b->done, memory_order_relaxed)) break;
+    // Time from when the grant should have happened, so delayed grants count their delay
+    histogram_record(&b->histogram, time>b->intended ? time-b->intended : 0);
+    atomic_fetch_add_explicit(&b->received, 1U, memory_order_release);
+    if(++t->count==b->iterations)
+    {
+      b->end=time;
+      atomic_store_explicit(&b->done, 1U, memory_order_release);
+    }
+  }
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  atomic_fetch_add_explicit(&b->running, (unsigned)-1, memory_order_release);
+  return 0;
+}
+
+
+/****************************************** Driver **************************************************/
+typedef struct result_s
+{
+  unsigned long long ops, grants, elapsed;
+  double fairness;                    /* Jain's index over the waits each waiter completed */
+} result_t;
+
+static int run(benchmark_t *b, result_t *result)
+{
+  unsigned n, created, threads=MODE_UNCONTENDED==b->mode ? 1 : b->granters+b->waiters;
+  thrd_start_t granterfunc=MODE_LATENCY==b->mode ? latency_granter : granter, waiterfunc=MODE_LATENCY==b->mode ? latency_waiter : waiter;
+  memset(b->threads, 0, sizeof(b->threads));
+  memset(&b->histogram, 0, sizeof(b->histogram));
+  atomic_store_explicit(&b->received, 0U, memory_order_relaxed);
+  atomic_store_explicit(&b->go, 0U, memory_order_relaxed);
+  atomic_store_explicit(&b->done, 0U, memory_order_relaxed);
+  atomic_store_explicit(&b->running, threads, memory_order_relaxed);
+  atomic_store_explicit(&b->waiting, MODE_UNCONTENDED==b->mode ? 1 : b->waiters, memory_order_relaxed);
+  if(thrd_success!=b->primitive->init(b)) return thrd_error;
+  for(created=0; created<threads; created++)
+  {
+    b->threads[created].b=b;
+    b->threads[created].index=created<b->granters ? created : created-b->granters;
+    if(thrd_success!=thrd_create(&b->threads[created].thread, MODE_UNCONTENDED==b->mode ? uncontended : created<b->granters ? granterfunc : waiterfunc, &b->threads[created]))
+      break;
+  }
+  if(created<threads)
+  { // Have the threads already started exit as soon as they are let go
+    atomic_fetch_add_explicit(&b->running, created-threads, memory_order_relaxed);
+    atomic_store_explicit(&b->done, 1U, memory_order_relaxed);
+  }
+  b->start=now();
+  atomic_store_explicit(&b->go, 1U, memory_order_release);
+  if(b->iterations)
+  {
+    while(!atomic_load_explicit(&b->done, memory_order_acquire))
+      mssleep(1);
+  }
+  else if(created==threads)
+  {
+    mssleep((long)(b->duration/1000000));
+    b->end=now();
+    atomic_store_explicit(&b->done, 1U, memory_order_release);
+  }
+  // Release any waiters still blocked so every thread exits, even if not all could be started
+  while(atomic_load_explicit(&b->running, memory_order_acquire))
+  {
+    for(n=0; n<b->granters; n++)
+      b->primitive->grant(b, n);
+    mssleep(1);
+  }
+  for(n=0; n<created; n++)
+    thrd_join(b->threads[n].thread, NULL);
+  b->primitive->destroy(b);
+  if(created<threads) return thrd_error;
+  memset(result, 0, sizeof(*result));
+  result->elapsed=b->end-b->start;
+  if(MODE_UNCONTENDED==b->mode)
+  {
+    result->ops=result->grants=b->threads[0].count;
+    result->fairness=1;
   }
   else
   {
-    usCount waittotal=0;
-    mtx_t mtx;
-    mtx_init(&mtx, mtx_plain);
-    mtx_lock(&mtx);
-    while(!done)
+    double sumsq=0;
+    for(n=0; n<threads; n++)
     {
-      // Wait on permit
-      start=GetUsCount();
-      permit_wait(permit, &mtx);
-      end=GetUsCount();
-      waittotal+=end-start-timingoverhead;
-      count++;
-      //printf("%u", mythread);
-#if defined(UNCONTENDED) && 0==DONTCONSUME
-      if(UNCONTENDED==0 && 1==mythread)
+      if(n<b->granters)
+        result->grants+=b->threads[n].count;
+      else
       {
-        permit_grant(permit);
+        result->ops+=b->threads[n].count;
+        sumsq+=(double) b->threads[n].count*b->threads[n].count;
       }
-#endif
     }
-    printf("Thread %u, average wait time was %u cycles\n", mythread, (size_t)((double)waittotal/count*CYCLESPERMICROSECOND));
+    result->fairness=sumsq ? (double) result->ops*result->ops/(b->waiters*sumsq) : 0;
   }
-  return 0;
+  return thrd_success;
+}
+
+static unsigned parse_names(const char *arg, const char **names, unsigned no)
+{
+  unsigned mask=0, n;
+  while(*arg)
+  {
+    size_t len=strcspn(arg, ",");
+    for(n=0; n<no; n++)
+      if(strlen(names[n])==len && !strncmp(arg, names[n], len)) break;
+    if(n==no) return 0;
+    mask|=1U<<n;
+    arg+=len;
+    if(','==*arg) arg++;
+  }
+  return mask;
+}
+
+static unsigned parse_counts(const char *arg, unsigned *counts)
+{
+  unsigned no=0;
+  while(*arg)
+  {
+    char *end;
+    unsigned long from=strtoul(arg, &end, 10), to=from;
+    if(end==arg) return 0;
+    if('-'==*end)
+    {
+      arg=end+1;
+      to=strtoul(arg, &end, 10);
+      if(end==arg) return 0;
+    }
+    if(!from || to<from || to>MAX_THREADS) return 0;
+    for(; from<=to; from++)
+    {
+      if(no==MAX_COUNTS) return 0;
+      counts[no++]=(unsigned) from;
+    }
+    arg=end;
+    if(','==*arg) arg++;
+    else if(*arg) return 0;
+  }
+  return no;
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [-p permit1,permitc,permitc_fair,permitnc,select,sem,condvar,eventfd,futex,binary_semaphore]\n"
+    "         [-m contended,uncontended,latency] [-s mutex,spin] [-g granters] [-w waiters]\n"
+    "         [-d ms | -i iterations] [-r repeats] [-l rate] [-f csv|json] [-o file]\n", program);
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
+  static const char *formats[]={ "csv", "json" };
+  const char *primitivenames[PRIMITIVES];
+  unsigned primitivemask=(1U<<PRIMITIVES)-1, modemask=(1U<<MODE_CONTENDED)|(1U<<MODE_UNCONTENDED), waitmask=(1U<<WAIT_LAST)-1, json=0;
+  unsigned granters[MAX_COUNTS]={ 1 }, waiters[MAX_COUNTS]={ 1 }, nogranters=1, nowaiters=1, repeats=1;
+  unsigned long long duration=1000, iterations=0, rate=10000;
+  unsigned p, m, w, g, x, r, cpus, first=1;
+  char host[256]="unknown", build[256];
+  FILE *out=stdout;
+  benchmark_t *b;
   int n;
-  usCount start;
-  pthread_permit1_t permit1;
 
-  printf("Press key to continue ...\n");
-  getchar();
-  printf("Wait ...\n");
-  start=GetUsCount();
-  while(GetUsCount()-start<3000000000000ULL);
-  printf("Calculating timing overhead ...\n");
-  for(n=0; n<5000000; n++)
+  for(p=0; p<PRIMITIVES; p++)
+    primitivenames[p]=primitives[p].name;
+  for(n=1; n<argc; n++)
+  {
+    const char *arg=n+1<argc ? argv[n+1] : NULL;
+    if('-'!=argv[n][0] || !argv[n][1] || argv[n][2] || !arg)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+    switch(argv[n][1])
+    {
+    case 'p': if(!(primitivemask=parse_names(arg, primitivenames, PRIMITIVES))) { usage(argv[0]); return 1; } break;
+    case 'm': if(!(modemask=parse_names(arg, modenames, MODE_LAST))) { usage(argv[0]); return 1; } break;
+    case 's': if(!(waitmask=parse_names(arg, waitnames, WAIT_LAST))) { usage(argv[0]); return 1; } break;
+    case 'g': if(!(nogranters=parse_counts(arg, granters))) { usage(argv[0]); return 1; } break;
+    case 'w': if(!(nowaiters=parse_counts(arg, waiters))) { usage(argv[0]); return 1; } break;
+    case 'd': duration=strtoull(arg, NULL, 10); iterations=0; break;
+    case 'i': iterations=strtoull(arg, NULL, 10); break;
+    case 'r': repeats=(unsigned) strtoul(arg, NULL, 10); break;
+    case 'l': rate=strtoull(arg, NULL, 10); break;
+    case 'f': if(!(x=parse_names(arg, formats, 2)) || 3==x) { usage(argv[0]); return 1; } json=(2==x); break;
+    case 'o':
+      if(!(out=fopen(arg, "wt")))
+      {
+        fprintf(stderr, "Failed to open %s\n", arg);
+        return 1;
+      }
+      break;
+    default: usage(argv[0]); return 1;
+    }
+    n++;
+  }
+  if((!duration && !iterations) || !repeats || !rate || rate>1000000000)
   {
-    start=GetUsCount();
-    timingoverhead+=GetUsCount()-start;
+    usage(argv[0]);
+    return 1;
   }
-  timingoverhead/=5000000;
-  printf("Timing overhead on this machine is %u us. Go!\n", (size_t) timingoverhead);
 
-  pthread_permit1_init(&permit1, 1);
-  permitaddr=&permit1;
-  for(n=0; n<THREADS; n++)
+#ifdef _WIN32
   {
-    thrd_create(&threads[n], (thrd_start_t) threadfunc<pthread_permit1_t, pthread_permit1_grant, pthread_permit1_revoke, pthread_permit1_wait>, (void *)(size_t)n);
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    cpus=si.dwNumberOfProcessors;
+    if(getenv("COMPUTERNAME")) { strncpy(host, getenv("COMPUTERNAME"), sizeof(host)-1); host[sizeof(host)-1]=0; }
+  }
+#else
+  cpus=(unsigned) sysconf(_SC_NPROCESSORS_ONLN);
+  if(gethostname(host, sizeof(host)-1)) strcpy(host, "unknown");
+  host[sizeof(host)-1]=0;
+#endif
+  sprintf(build, "%s%s line%u%s%s",
+#if defined(__clang__)
+    "clang " __clang_version__,
+#elif defined(__GNUC__)
+    "gcc " __VERSION__,
+#elif defined(_MSC_VER)
+    "msvc",
+#else
+    "unknown",
+#endif
+    PTHREAD_PERMIT_USE_FUTEX ? " futex" : " condvar",
+    (unsigned) PTHREAD_PERMIT_CACHE_LINE_SIZE,
+    PTHREAD_PERMIT_ENABLE_COUNTERS ? " counters" : "",
+    PTHREAD_PERMIT_ENABLE_TRACE ? " trace" : "");
+
+  if(!(b=(benchmark_t *) calloc(1, sizeof(benchmark_t))))
+  {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  b->duration=duration*1000000;
+  b->iterations=iterations;
+  b->rate=rate;
+  if(json)
+    fprintf(out, "{\"host\":\"%s\",\"cpus\":%u,\"build\":\"%s\",\"results\":[\n", host, cpus, build);
+  else
+    fprintf(out, "host,cpus,build,primitive,mode,wait,granters,waiters,run,ops,grants,elapsed_ns,ns_per_op,ops_per_sec,rate,p50_ns,p99_ns,p999_ns,mean_ns,max_ns,fairness\n");
+  for(p=0; p<PRIMITIVES; p++)
+  {
+    if(!(primitivemask & (1U<<p))) continue;
+    for(m=0; m<MODE_LAST; m++)
+    {
+      if(!(modemask & (1U<<m))) continue;
+      for(w=0; w<WAIT_LAST; w++)
+      {
+        if(!(waitmask & (1U<<w))) continue;
+        for(g=0; g<nogranters; g++)
+          for(x=0; x<nowaiters; x++)
+          {
+            // Uncontended and latency runs use fixed threads, so only run them once
+            if(MODE_CONTENDED!=m && (g || x)) continue;
+            b->primitive=&primitives[p];
+            b->mode=(benchmark_mode_t) m;
+            b->wait=(benchmark_wait_t) w;
+            b->granters=MODE_CONTENDED!=m ? 1 : granters[g];
+            b->waiters=MODE_CONTENDED!=m ? 1 : waiters[x];
+            for(r=0; r<repeats; r++)
+            {
+              result_t result;
+              double nsperop, opspersec;
+              char latency[256];
+              if(thrd_success!=run(b, &result))
+              {
+                fprintf(stderr, "Failed to run %s\n", b->primitive->name);
+                return 1;
+              }
+              nsperop=result.ops ? (double) result.elapsed/result.ops : 0;
+              opspersec=result.elapsed ? (double) result.ops*1000000000.0/result.elapsed : 0;
+              latency[0]=0;
+              if(MODE_LATENCY==m)
+              {
+                const histogram_t *h=&b->histogram;
+                sprintf(latency, json ? ",\"rate\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"mean_ns\":%.0f,\"max_ns\":%llu"
+                  : "%llu,%llu,%llu,%llu,%.0f,%llu", rate, histogram_percentile(h, 50), histogram_percentile(h, 99),
+                  histogram_percentile(h, 99.9), h->total ? (double) h->sum/h->total : 0, h->max);
+              }
+              else if(!json)
+                strcpy(latency, ",,,,,");
+              if(json)
+                fprintf(out, "%s{\"primitive\":\"%s\",\"mode\":\"%s\",\"wait\":\"%s\",\"granters\":%u,\"waiters\":%u,\"run\":%u,"
+                  "\"ops\":%llu,\"grants\":%llu,\"elapsed_ns\":%llu,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f%s,\"fairness\":%.4f}",
+                  first ? "" : ",\n", b->primitive->name, modenames[m], waitnames[w], b->granters, b->waiters, r,
+                  result.ops, result.grants, result.elapsed, nsperop, opspersec, latency, result.fairness);
+              else
+                fprintf(out, "%s,%u,%s,%s,%s,%s,%u,%u,%u,%llu,%llu,%llu,%.2f,%.0f,%s,%.4f\n",
+                  host, cpus, build, b->primitive->name, modenames[m], waitnames[w], b->granters, b->waiters, r,
+                  result.ops, result.grants, result.elapsed, nsperop, opspersec, latency, result.fairness);
+              fflush(out);
+              first=0;
+            }
+          }
+      }
+    }
   }
-  printf("Press key to kill all\n");
-  getchar();
-  done=1;
-  mssleep(2000);
-  printf("Press key to exit\n");
-  getchar();
+  if(json) fprintf(out, "\n]}\n");
+  if(out!=stdout) fclose(out);
+  free(b);
   return 0;
 }
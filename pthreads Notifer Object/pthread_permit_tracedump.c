@@ -0,0 +1,188 @@
+/* pthread_permit_tracedump.c
+Converts a permit event trace into Chrome trace event JSON
+(C) 2011-2012 Niall Douglas http://www.nedproductions.biz/
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/* Usage: pthread_permit_tracedump <trace file written by pthread_permit_trace_save()> [<output.json>]
+
+The output can be loaded into chrome://tracing or https://ui.perfetto.dev. Each thread which traced
+is a track, grants and waits are spans, and an arrow is drawn from each grant to every wait it ended.
+*/
+
+#include "pthread_permit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct event_s
+{
+  pthread_permit_trace_event_t event;
+  unsigned thread;
+} event_t;
+
+/* The most recent grant of a permit */
+typedef struct grant_s
+{
+  unsigned long long permit;
+  unsigned long long timestamp;
+  unsigned thread;
+} grant_t;
+
+static const char *names[PTHREAD_PERMIT_TRACE_LAST]={ "init", "grant", "grant", "wait", "wait", "revoke", "select link", "select unlink", "destroy" };
+
+static int compare_events(const void *_a, const void *_b)
+{
+  const event_t *a=(const event_t *) _a, *b=(const event_t *) _b;
+  if(a->event.timestamp!=b->event.timestamp) return a->event.timestamp<b->event.timestamp ? -1 : 1;
+  return a->thread<b->thread ? -1 : a->thread>b->thread ? 1 : 0;
+}
+
+static grant_t *find_grant(grant_t *grants, size_t ngrants, unsigned long long permit)
+{
+  size_t n=(size_t)((permit>>4)*0x9E3779B97F4A7C15ULL)&(ngrants-1);
+  while(grants[n].permit && grants[n].permit!=permit)
+    n=(n+1)&(ngrants-1);
+  grants[n].permit=permit;
+  return &grants[n];
+}
+
+int main(int argc, char *argv[])
+{
+  FILE *in, *out=stdout;
+  pthread_permit_trace_header_t header;
+  event_t *events=0;
+  grant_t *grants;
+  unsigned long long *waitstarts, flows=0;
+  size_t nevents=0, ngrants=16, n;
+  unsigned r, m, nthreads=0;
+  int first=1;
+  if(argc<2)
+  {
+    fprintf(stderr, "Usage: %s <trace file> [<output.json>]\n", argv[0]);
+    return 1;
+  }
+  if(!(in=fopen(argv[1], "rb")))
+  {
+    fprintf(stderr, "Failed to open %s\n", argv[1]);
+    return 1;
+  }
+  if(1!=fread(&header, sizeof(header), 1, in) || memcmp(header.magic, "PTRC", 4) || 1!=header.version)
+  {
+    fprintf(stderr, "%s is not a permit trace\n", argv[1]);
+    return 1;
+  }
+  for(r=0; r<header.rings; r++)
+  {
+    pthread_permit_trace_ring_t ring;
+    event_t *newevents;
+    if(1!=fread(&ring, sizeof(ring), 1, in)
+      || !(newevents=(event_t *) realloc(events, sizeof(event_t)*(nevents+ring.events+1))))
+    {
+      fprintf(stderr, "%s is truncated\n", argv[1]);
+      return 1;
+    }
+    events=newevents;
+    for(m=0; m<ring.events; m++, nevents++)
+    {
+      if(1!=fread(&events[nevents].event, sizeof(pthread_permit_trace_event_t), 1, in))
+      {
+        fprintf(stderr, "%s is truncated\n", argv[1]);
+        return 1;
+      }
+      events[nevents].thread=ring.thread;
+    }
+    if(ring.thread>=nthreads) nthreads=ring.thread+1;
+  }
+  fclose(in);
+  qsort(events, nevents, sizeof(event_t), compare_events);
+  while(ngrants<2*nevents) ngrants<<=1;
+  grants=(grant_t *) calloc(ngrants, sizeof(grant_t));
+  waitstarts=(unsigned long long *) calloc(nthreads+1, sizeof(unsigned long long));
+  if(!grants || !waitstarts)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  if(argc>2 && !(out=fopen(argv[2], "wt")))
+  {
+    fprintf(stderr, "Failed to open %s\n", argv[2]);
+    return 1;
+  }
+#define TIMESTAMP(ts) ((double)(long long)((ts)-header.tickbase)*header.nspertick/1000)
+  fprintf(out, "{\"traceEvents\":[\n");
+  for(n=0; n<nevents; n++)
+  {
+    const pthread_permit_trace_event_t *e=&events[n].event;
+    unsigned thread=events[n].thread;
+    const char *ph="i";
+    if(e->type>=PTHREAD_PERMIT_TRACE_LAST) continue;
+    switch(e->type)
+    {
+    case PTHREAD_PERMIT_TRACE_GRANT:
+      {
+        grant_t *g=find_grant(grants, ngrants, e->permit);
+        g->timestamp=e->timestamp;
+        g->thread=thread;
+        ph="B";
+        break;
+      }
+    case PTHREAD_PERMIT_TRACE_WAIT:
+      waitstarts[thread]=e->timestamp;
+      ph="B";
+      break;
+    case PTHREAD_PERMIT_TRACE_GRANTED:
+      ph="E";
+      break;
+    case PTHREAD_PERMIT_TRACE_WAITED:
+      {
+        grant_t *g=find_grant(grants, ngrants, e->permit);
+        // If the permit was last granted during this wait, that grant ended it
+        if(0==e->arg && g->timestamp && g->timestamp>=waitstarts[thread])
+        {
+          fprintf(out, "%s{\"name\":\"release\",\"cat\":\"permit\",\"ph\":\"s\",\"id\":%llu,\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+            first ? "" : ",\n", flows, TIMESTAMP(g->timestamp), g->thread);
+          fprintf(out, ",\n{\"name\":\"release\",\"cat\":\"permit\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%llu,\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+            flows, TIMESTAMP(e->timestamp), thread);
+          flows++;
+          first=0;
+        }
+        ph="E";
+        break;
+      }
+    }
+    fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"permit\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,%s\"args\":{\"permit\":\"0x%llx\",\"arg\":%u}}",
+      first ? "" : ",\n", names[e->type], ph, TIMESTAMP(e->timestamp), thread, 'i'==*ph ? "\"s\":\"t\"," : "", e->permit, e->arg);
+    first=0;
+  }
+  fprintf(out, "\n]}\n");
+  if(out!=stdout) fclose(out);
+  free(waitstarts);
+  free(grants);
+  free(events);
+  return 0;
+}
@@ -36,6 +36,7 @@ DEALINGS IN THE SOFTWARE.
 #define CATCH_CONFIG_RUNNER
 #include "../catch.hpp"
 #include <bitset>
+#include <string.h>
 #ifdef USE_PARALLEL
 #ifdef _MSC_VER
 // Use Microsoft's Parallel Patterns Library
@@ -88,21 +89,65 @@ DEALINGS IN THE SOFTWARE.
 #include <unistd.h>
 #include <poll.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#endif
 
 #include "pthread_permit.h"
+#include "pthread_permit_coroutine.hpp"
 #define permitc_init PTHREAD_PERMIT_MANGLEAPI(permitc_init)
 #define permitnc_init PTHREAD_PERMIT_MANGLEAPI(permitnc_init)
+#define permitc_init_flags PTHREAD_PERMIT_MANGLEAPI(permitc_init_flags)
+#define permitnc_init_flags PTHREAD_PERMIT_MANGLEAPI(permitnc_init_flags)
 #define permitc_destroy PTHREAD_PERMIT_MANGLEAPI(permitc_destroy)
 #define permitnc_destroy PTHREAD_PERMIT_MANGLEAPI(permitnc_destroy)
 #define permitc_grant PTHREAD_PERMIT_MANGLEAPI(permitc_grant)
 #define permitnc_grant PTHREAD_PERMIT_MANGLEAPI(permitnc_grant)
 #define permitc_revoke PTHREAD_PERMIT_MANGLEAPI(permitc_revoke)
 #define permitnc_revoke PTHREAD_PERMIT_MANGLEAPI(permitnc_revoke)
+#define permitc_wait PTHREAD_PERMIT_MANGLEAPI(permitc_wait)
+#define permitnc_wait PTHREAD_PERMIT_MANGLEAPI(permitnc_wait)
 #define permitc_timedwait PTHREAD_PERMIT_MANGLEAPI(permitc_timedwait)
 #define permitnc_timedwait PTHREAD_PERMIT_MANGLEAPI(permitnc_timedwait)
+#define permitc_waitfor PTHREAD_PERMIT_MANGLEAPI(permitc_waitfor)
+#define permitnc_waitfor PTHREAD_PERMIT_MANGLEAPI(permitnc_waitfor)
+#define permitnc_pushhook PTHREAD_PERMIT_MANGLEAPI(permitnc_pushhook)
+#define permitnc_pophook PTHREAD_PERMIT_MANGLEAPI(permitnc_pophook)
 #define permit_select PTHREAD_PERMIT_MANGLEAPI(permit_select)
+#define permit_select_many PTHREAD_PERMIT_MANGLEAPI(permit_select_many)
+#define permit_grant_many PTHREAD_PERMIT_MANGLEAPI(permit_grant_many)
+#define permit_selectset_init PTHREAD_PERMIT_MANGLEAPI(permit_selectset_init)
+#define permit_selectset_destroy PTHREAD_PERMIT_MANGLEAPI(permit_selectset_destroy)
+#define permit_selectset_add PTHREAD_PERMIT_MANGLEAPI(permit_selectset_add)
+#define permit_selectset_remove PTHREAD_PERMIT_MANGLEAPI(permit_selectset_remove)
+#define permit_selectset_wait PTHREAD_PERMIT_MANGLEAPI(permit_selectset_wait)
+#define permit_reactor_init PTHREAD_PERMIT_MANGLEAPI(permit_reactor_init)
+#define permit_reactor_destroy PTHREAD_PERMIT_MANGLEAPI(permit_reactor_destroy)
+#define permit_reactor_fd PTHREAD_PERMIT_MANGLEAPI(permit_reactor_fd)
+#define permit_reactor_add PTHREAD_PERMIT_MANGLEAPI(permit_reactor_add)
+#define permit_reactor_remove PTHREAD_PERMIT_MANGLEAPI(permit_reactor_remove)
+#define permit_reactor_poll PTHREAD_PERMIT_MANGLEAPI(permit_reactor_poll)
+#define permitset_init PTHREAD_PERMIT_MANGLEAPI(permitset_init)
+#define permitset_destroy PTHREAD_PERMIT_MANGLEAPI(permitset_destroy)
+#define permitset_grant PTHREAD_PERMIT_MANGLEAPI(permitset_grant)
+#define permitset_revoke PTHREAD_PERMIT_MANGLEAPI(permitset_revoke)
+#define permitset_wait PTHREAD_PERMIT_MANGLEAPI(permitset_wait)
+#define permitset_timedwait PTHREAD_PERMIT_MANGLEAPI(permitset_timedwait)
+#define permitset_waitfor PTHREAD_PERMIT_MANGLEAPI(permitset_waitfor)
 #define permitnc_associate_fd PTHREAD_PERMIT_MANGLEAPI(permitnc_associate_fd)
 #define permitnc_deassociate PTHREAD_PERMIT_MANGLEAPI(permitnc_deassociate)
+#define permitc_deassociate PTHREAD_PERMIT_MANGLEAPI(permitc_deassociate)
+#define permitc_associate_eventfd PTHREAD_PERMIT_MANGLEAPI(permitc_associate_eventfd)
+#define permitnc_associate_eventfd PTHREAD_PERMIT_MANGLEAPI(permitnc_associate_eventfd)
+#define permitc_await PTHREAD_PERMIT_MANGLEAPI(permitc_await)
+#define permitnc_await PTHREAD_PERMIT_MANGLEAPI(permitnc_await)
+#define permit_then PTHREAD_PERMIT_MANGLEAPI(permit_then)
+#define permit_counters PTHREAD_PERMIT_MANGLEAPI(permit_counters)
+#define permit_trace_save PTHREAD_PERMIT_MANGLEAPI(permit_trace_save)
+#define permit_trace_release PTHREAD_PERMIT_MANGLEAPI(permit_trace_release)
 
 TEST_CASE("timespec/diff", "Tests that timespec_diff works as intended")
 {
@@ -183,6 +228,116 @@ TEST_CASE("pthread_permit1/grantrevokewait", "Tests that grants cause exactly on
 }
 
 
+static atomic_uint permit1_sleepers_woken;
+static int permit1_sleeper(void *permit)
+{
+  mtx_t mtx;
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  if(0==pthread_permit1_wait((pthread_permit1_t *) permit, &mtx))
+    atomic_fetch_add_explicit(&permit1_sleepers_woken, 1U, memory_order_relaxed);
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  return 0;
+}
+
+TEST_CASE("pthread_permit1/sleepgrant", "Tests that each grant wakes exactly one sleeping waiter")
+{
+  pthread_permit1_t permit;
+  thrd_t threads[2];
+  struct timespec ms={0, 1000000};
+  int n;
+  permit1_sleepers_woken=0;
+  REQUIRE(0==pthread_permit1_init(&permit, 0));
+  for(n=0; n<2; n++)
+    REQUIRE(0==thrd_create(&threads[n], permit1_sleeper, &permit));
+  // Wait for both threads to enter their wait
+  while(atomic_load_explicit(&permit.waiters, memory_order_relaxed)<2)
+    thrd_sleep(&ms, NULL);
+  REQUIRE(0==pthread_permit1_grant(&permit));
+  while(atomic_load_explicit(&permit1_sleepers_woken, memory_order_relaxed)<1)
+    thrd_sleep(&ms, NULL);
+  for(n=0; n<50; n++)
+    thrd_sleep(&ms, NULL);
+  REQUIRE(1==atomic_load_explicit(&permit1_sleepers_woken, memory_order_relaxed));
+  REQUIRE(0==pthread_permit1_grant(&permit));
+  while(atomic_load_explicit(&permit1_sleepers_woken, memory_order_relaxed)<2)
+    thrd_sleep(&ms, NULL);
+  REQUIRE(ETIMEDOUT==pthread_permit1_timedwait(&permit, NULL, NULL));
+  for(n=0; n<2; n++)
+    REQUIRE(0==thrd_join(threads[n], NULL));
+  pthread_permit1_destroy(&permit);
+}
+
+
+/**************************************** pthread_permitcount ****************************************/
+
+TEST_CASE("pthread_permitcount/grantwait", "Tests that grants of k permits cause exactly k waits")
+{
+  pthread_permitcount_t permit;
+  unsigned taken;
+  REQUIRE(0==pthread_permitcount_init(&permit, 0));
+  REQUIRE(ETIMEDOUT==pthread_permitcount_timedwait(&permit, NULL, NULL));
+  REQUIRE(0==pthread_permitcount_grant(&permit, 5));
+  REQUIRE(0==pthread_permitcount_wait(&permit, NULL));
+  REQUIRE(0==pthread_permitcount_wait_many(&permit, 3, &taken, NULL));
+  REQUIRE(3==taken);
+  REQUIRE(0==pthread_permitcount_timedwait_many(&permit, 3, &taken, NULL, NULL));
+  REQUIRE(1==taken);
+  REQUIRE(ETIMEDOUT==pthread_permitcount_timedwait_many(&permit, 3, &taken, NULL, NULL));
+  REQUIRE(0==taken);
+  REQUIRE(0==pthread_permitcount_grant(&permit, 3));
+  pthread_permitcount_revoke(&permit);
+  REQUIRE(ETIMEDOUT==pthread_permitcount_timedwait(&permit, NULL, NULL));
+  pthread_permitcount_destroy(&permit);
+  REQUIRE(EINVAL==pthread_permitcount_grant(&permit, 1));
+  REQUIRE(0==pthread_permitcount_init(&permit, UINT_MAX-1));
+  REQUIRE(EINVAL==pthread_permitcount_grant(&permit, 2));
+  REQUIRE(0==pthread_permitcount_grant(&permit, 1));
+  pthread_permitcount_destroy(&permit);
+}
+
+static atomic_uint permitcount_sleepers_woken;
+static int permitcount_sleeper(void *permit)
+{
+  mtx_t mtx;
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  if(0==pthread_permitcount_wait((pthread_permitcount_t *) permit, &mtx))
+    atomic_fetch_add_explicit(&permitcount_sleepers_woken, 1U, memory_order_relaxed);
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  return 0;
+}
+
+TEST_CASE("pthread_permitcount/sleepgrant", "Tests that a grant of k permits wakes exactly k sleeping waiters")
+{
+  pthread_permitcount_t permit;
+  thrd_t threads[4];
+  struct timespec ms={0, 1000000};
+  int n;
+  permitcount_sleepers_woken=0;
+  REQUIRE(0==pthread_permitcount_init(&permit, 0));
+  for(n=0; n<4; n++)
+    REQUIRE(0==thrd_create(&threads[n], permitcount_sleeper, &permit));
+  // Wait for all threads to enter their wait
+  while(atomic_load_explicit(&permit.waiters, memory_order_relaxed)<4)
+    thrd_sleep(&ms, NULL);
+  REQUIRE(0==pthread_permitcount_grant(&permit, 3));
+  while(atomic_load_explicit(&permitcount_sleepers_woken, memory_order_relaxed)<3)
+    thrd_sleep(&ms, NULL);
+  for(n=0; n<50; n++)
+    thrd_sleep(&ms, NULL);
+  REQUIRE(3==atomic_load_explicit(&permitcount_sleepers_woken, memory_order_relaxed));
+  REQUIRE(0==pthread_permitcount_grant(&permit, 1));
+  while(atomic_load_explicit(&permitcount_sleepers_woken, memory_order_relaxed)<4)
+    thrd_sleep(&ms, NULL);
+  REQUIRE(ETIMEDOUT==pthread_permitcount_timedwait(&permit, NULL, NULL));
+  for(n=0; n<4; n++)
+    REQUIRE(0==thrd_join(threads[n], NULL));
+  pthread_permitcount_destroy(&permit);
+}
+
 
 /**************************************** pthread_permit ****************************************/
 
@@ -221,6 +376,80 @@ TEST_CASE("pthread_permitX/interchangeable", "Tests that permit1, permitc and pe
   REQUIRE(EINVAL==pthread_permit1_grant(&permit1));
 }
 
+TEST_CASE("pthread_permitX/grantmany", "Tests that batch grants grant a mix of permit1, permitc and permitnc objects exactly once")
+{
+  pthread_permit1_t permit1;
+  pthread_permitc_t permitc;
+  pthread_permitnc_t permitnc;
+  unsigned bad=0;
+  pthread_permitX_t permits[5]={ &permitnc, &permit1, NULL, &permitc, &permitc };
+  REQUIRE(0==pthread_permit1_init(&permit1, 0));
+  REQUIRE(0==permitc_init(&permitc, 0));
+  REQUIRE(0==permitnc_init(&permitnc, 0));
+
+  REQUIRE(0==permit_grant_many(5, permits));
+  REQUIRE(0==pthread_permit1_timedwait(&permit1, NULL, NULL));
+  REQUIRE(ETIMEDOUT==pthread_permit1_timedwait(&permit1, NULL, NULL));
+  REQUIRE(0==permitc_timedwait(&permitc, NULL, NULL));
+  REQUIRE(ETIMEDOUT==permitc_timedwait(&permitc, NULL, NULL));
+  REQUIRE(0==permitnc_timedwait(&permitnc, NULL, NULL));
+  REQUIRE(0==permitnc_timedwait(&permitnc, NULL, NULL));
+  permitnc_revoke(&permitnc);
+
+  // Bad permits are reported, but everything else is still granted
+  permits[2]=&bad;
+  REQUIRE(EINVAL==permit_grant_many(5, permits));
+  REQUIRE(0==pthread_permit1_timedwait(&permit1, NULL, NULL));
+  REQUIRE(0==permitc_timedwait(&permitc, NULL, NULL));
+  REQUIRE(0==permitnc_timedwait(&permitnc, NULL, NULL));
+
+  permitnc_destroy(&permitnc);
+  permitc_destroy(&permitc);
+  pthread_permit1_destroy(&permit1);
+}
+
+static pthread_permitc_t grantmany_permits[3];
+static atomic_uint grantmany_selected;
+static int grantmany_selecter(void *)
+{
+  pthread_permitX_t parray[3]={ &grantmany_permits[0], &grantmany_permits[1], &grantmany_permits[2] };
+  mtx_t mtx;
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  if(0==permit_select(3, parray, &mtx, NULL))
+    atomic_fetch_add_explicit(&grantmany_selected, 1U, memory_order_relaxed);
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  return 0;
+}
+
+TEST_CASE("pthread_permitX/grantmanyselect", "Tests that a batch grant of several permits a select sleeps upon wakes it and is consumed exactly once")
+{
+  pthread_permitX_t permits[3]={ &grantmany_permits[0], &grantmany_permits[1], &grantmany_permits[2] };
+  thrd_t thread;
+  struct timespec ms={0, 1000000};
+  int n, granted=0;
+  grantmany_selected=0;
+  for(n=0; n<3; n++)
+    REQUIRE(0==permitc_init(&grantmany_permits[n], 0));
+  REQUIRE(0==thrd_create(&thread, grantmany_selecter, NULL));
+  while(atomic_load_explicit(&grantmany_permits[2].waiters, memory_order_relaxed)<1)
+    thrd_sleep(&ms, NULL);
+  REQUIRE(0==permit_grant_many(3, permits));
+  while(atomic_load_explicit(&grantmany_selected, memory_order_relaxed)<1)
+    thrd_sleep(&ms, NULL);
+  // The select consumed exactly one of the three grants
+  for(n=0; n<3; n++)
+  {
+    if(0==permitc_timedwait(&grantmany_permits[n], NULL, NULL))
+      granted++;
+  }
+  REQUIRE(2==granted);
+  REQUIRE(0==thrd_join(thread, NULL));
+  for(n=0; n<3; n++)
+    permitc_destroy(&grantmany_permits[n]);
+}
+
 TEST_CASE("pthread_permitc/initdestroy", "Tests repeated init and destroy on same object")
 {
   pthread_permitc_t permit;
@@ -282,6 +511,133 @@ TEST_CASE("pthread_permitc/grantrevokewait", "Tests that grants cause exactly on
   REQUIRE(EINVAL==permitc_grant(&permit));
 }
 
+static atomic_uint permitc_adaptive_granted;
+static int permitc_adaptive_granter(void *permit)
+{
+  unsigned n;
+  for(n=0; n<1000; n++)
+  {
+    // Wait for the previous grant to be consumed before granting again
+    while(atomic_load_explicit(&((pthread_permitc_t *) permit)->permit, memory_order_relaxed))
+      thrd_yield();
+    permitc_grant(permit);
+  }
+  atomic_store_explicit(&permitc_adaptive_granted, 1U, memory_order_seq_cst);
+  return 0;
+}
+
+TEST_CASE("pthread_permitc/adaptive", "Tests that adaptive permits spin then sleep and never lose grants")
+{
+  pthread_permitc_t permit;
+  thrd_t thread;
+  mtx_t mtx;
+  unsigned n;
+  REQUIRE(EINVAL==permitc_init_flags(&permit, 0, ~0U));
+  REQUIRE(0==permitc_init_flags(&permit, 0, PTHREAD_PERMIT_FLAG_ADAPTIVE));
+  permitc_adaptive_granted=0;
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  REQUIRE(0==thrd_create(&thread, permitc_adaptive_granter, &permit));
+  for(n=0; n<1000; n++)
+    REQUIRE(0==permitc_wait(&permit, (n&1) ? &mtx : NULL));
+  REQUIRE(0==thrd_join(thread, NULL));
+  REQUIRE(1==(unsigned) permitc_adaptive_granted);
+  REQUIRE(ETIMEDOUT==permitc_timedwait(&permit, NULL, NULL));
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  permitc_destroy(&permit);
+}
+
+static atomic_uint permitc_handoff_woken;
+static int permitc_handoff_waiter(void *arg)
+{
+  mtx_t mtx;
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  if(0==permitc_wait((pthread_permitc_t *) arg, &mtx))
+    atomic_store_explicit(&permitc_handoff_woken, 1U, memory_order_seq_cst);
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  return 0;
+}
+
+TEST_CASE("pthread_permitc/handoff", "Tests that a grant hands the permit to a sleeping waiter and returns without waiting for it to wake")
+{
+  pthread_permitc_t permit;
+  thrd_t thread;
+  REQUIRE(0==permitc_init(&permit, 0));
+  permitc_handoff_woken=0;
+  REQUIRE(0==thrd_create(&thread, permitc_handoff_waiter, &permit));
+  while(!atomic_load_explicit(&permit.queued, memory_order_seq_cst))
+    thrd_yield();
+  REQUIRE(0==permitc_grant(&permit));
+  // The sleeping waiter already owns the grant, so nothing else can take it
+  REQUIRE(0==(unsigned) permit.queued);
+  REQUIRE(0==(unsigned) permit.permit);
+  REQUIRE(ETIMEDOUT==permitc_timedwait(&permit, NULL, NULL));
+  REQUIRE(0==thrd_join(thread, NULL));
+  REQUIRE(1==(unsigned) permitc_handoff_woken);
+  permitc_destroy(&permit);
+}
+
+#define PERMITC_FAIR_WAITERS 8
+static pthread_permitc_t permitc_fair_permit;
+static atomic_uint permitc_fair_served, permitc_fair_order[PERMITC_FAIR_WAITERS];
+static int permitc_fair_waiter(void *arg)
+{
+  unsigned idx=(unsigned)(size_t) arg;
+  mtx_t mtx;
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  if(0==permitc_wait(&permitc_fair_permit, &mtx))
+    atomic_store_explicit(&permitc_fair_order[atomic_fetch_add_explicit(&permitc_fair_served, 1U, memory_order_seq_cst)], idx, memory_order_seq_cst);
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  return 0;
+}
+
+TEST_CASE("pthread_permitc/fair", "Tests that fair permits hand grants to their waiters in the order they began waiting")
+{
+  pthread_permitc_t *permit=&permitc_fair_permit;
+  thrd_t threads[PERMITC_FAIR_WAITERS];
+  struct timespec reltime={0, 10000000};
+  mtx_t mtx;
+  unsigned n;
+  REQUIRE(0==permitc_init_flags(permit, 0, PTHREAD_PERMIT_FLAG_FAIR));
+  permitc_fair_served=0;
+  for(n=0; n<PERMITC_FAIR_WAITERS; n++)
+  { // Start each waiter only once the one before it has queued
+    REQUIRE(0==thrd_create(&threads[n], permitc_fair_waiter, (void *)(size_t) n));
+    while(atomic_load_explicit(&permit->queued, memory_order_seq_cst)!=n+1)
+      thrd_yield();
+  }
+  // A grant goes to the oldest waiter, not to whoever asks for it next
+  REQUIRE(0==permitc_grant(permit));
+  REQUIRE(ETIMEDOUT==permitc_timedwait(permit, NULL, NULL));
+  for(n=1; n<PERMITC_FAIR_WAITERS; n++)
+  {
+    while(atomic_load_explicit(&permitc_fair_served, memory_order_seq_cst)!=n)
+      thrd_yield();
+    REQUIRE(0==permitc_grant(permit));
+  }
+  for(n=0; n<PERMITC_FAIR_WAITERS; n++)
+    REQUIRE(0==thrd_join(threads[n], NULL));
+  REQUIRE(PERMITC_FAIR_WAITERS==(unsigned) permitc_fair_served);
+  for(n=0; n<PERMITC_FAIR_WAITERS; n++)
+    CHECK(n==(unsigned) atomic_load_explicit(&permitc_fair_order[n], memory_order_seq_cst));
+  REQUIRE(0==(unsigned) permit->queued);
+  // A timed out waiter leaves the queue
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  REQUIRE(ETIMEDOUT==permitc_waitfor(permit, &mtx, &reltime));
+  REQUIRE(0==(unsigned) permit->queued);
+  REQUIRE(0==permitc_grant(permit));
+  REQUIRE(0==permitc_waitfor(permit, &mtx, &reltime));
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  permitc_destroy(permit);
+}
+
 TEST_CASE("pthread_permitnc/grantrevokewait", "Tests that non-consuming grants disable all waits")
 {
   pthread_permitnc_t permit;
@@ -300,6 +656,546 @@ TEST_CASE("pthread_permitnc/grantrevokewait", "Tests that non-consuming grants d
   REQUIRE(EINVAL==permitnc_grant(&permit));
 }
 
+static atomic_uint permitnc_released_waiting, permitnc_released_done;
+static int permitnc_released_sleeper(void *permit)
+{
+  mtx_t mtx;
+  pthread_permitX_t permits[1]={permit};
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  // Half wait, half select
+  if(atomic_fetch_add_explicit(&permitnc_released_waiting, 1U, memory_order_seq_cst)&1)
+  {
+    if(0==permitnc_wait((pthread_permitnc_t *) permit, &mtx))
+      atomic_fetch_add_explicit(&permitnc_released_done, 1U, memory_order_seq_cst);
+  }
+  else
+  {
+    if(0==permit_select(1, permits, &mtx, NULL) && permits[0]==permit)
+      atomic_fetch_add_explicit(&permitnc_released_done, 1U, memory_order_seq_cst);
+  }
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  return 0;
+}
+
+TEST_CASE("pthread_permitnc/grantrevokerelease", "Tests that a non-consuming grant releases every waiter present even if immediately revoked")
+{
+  pthread_permitnc_t permit;
+  thrd_t threads[8];
+  unsigned n, done;
+  REQUIRE(0==permitnc_init(&permit, 0));
+  permitnc_released_waiting=permitnc_released_done=0;
+  for(n=0; n<8; n++)
+    REQUIRE(0==thrd_create(&threads[n], permitnc_released_sleeper, &permit));
+  while(8!=atomic_load_explicit(&permitnc_released_waiting, memory_order_seq_cst))
+    thrd_yield();
+  // Give them a chance to actually sleep
+  while(4!=atomic_load_explicit(&permit.queued, memory_order_seq_cst))
+    thrd_yield();
+  for(n=0; n<1000; n++)
+    thrd_yield();
+  REQUIRE(0==permitnc_grant(&permit));
+  // The grant woke every sleeping waiter itself rather than leaving them to notice
+  REQUIRE(0==(unsigned) permit.queued);
+  permitnc_revoke(&permit);
+  for(n=0; n<8; n++)
+    REQUIRE(0==thrd_join(threads[n], NULL));
+  REQUIRE(ETIMEDOUT==permitnc_timedwait(&permit, NULL, NULL));
+  done=permitnc_released_done;
+  REQUIRE(8==done);
+  permitnc_destroy(&permit);
+}
+
+static atomic_uint permitnc_hooks_done, permitnc_hooks_errors;
+static int permitnc_hooks_counter(pthread_permit_hook_type_t type, pthread_permitnc_t *permit, pthread_permitnc_hook_t *hookdata)
+{ // data is cleared once the hook has been popped, so must never be seen clear here
+  if(!hookdata->data) atomic_fetch_add_explicit(&permitnc_hooks_errors, 1U, memory_order_relaxed);
+  return hookdata->next ? hookdata->next->func(type, permit, hookdata->next) : 0;
+}
+static int permitnc_hooks_granter(void *permit)
+{
+  while(!atomic_load_explicit(&permitnc_hooks_done, memory_order_relaxed))
+  {
+    permitnc_grant(permit);
+    permitnc_revoke((pthread_permitnc_t *) permit);
+  }
+  atomic_store_explicit(&permitnc_hooks_done, 2U, memory_order_seq_cst);
+  return 0;
+}
+
+TEST_CASE("pthread_permitnc/hooks", "Tests that hooks can be pushed and popped while a permit is being granted and revoked")
+{
+  pthread_permitnc_t permit;
+  pthread_permitnc_hook_t hooks[2]={{permitnc_hooks_counter, 0, 0}, {permitnc_hooks_counter, 0, 0}};
+  thrd_t thread;
+  unsigned n, errors;
+  REQUIRE(0==permitnc_init(&permit, 0));
+  REQUIRE(EINVAL==permitnc_pushhook(&permit, PTHREAD_PERMIT_HOOK_TYPE_LAST, &hooks[0]));
+  REQUIRE(0==permitnc_pophook(&permit, PTHREAD_PERMIT_HOOK_TYPE_GRANT));
+  permitnc_hooks_done=permitnc_hooks_errors=0;
+  REQUIRE(0==thrd_create(&thread, permitnc_hooks_granter, &permit));
+  for(n=0; n<1000; n++)
+  {
+    pthread_permitnc_hook_t *hook=&hooks[n&1];
+    pthread_permit_hook_type_t type=(n&2) ? PTHREAD_PERMIT_HOOK_TYPE_REVOKE : PTHREAD_PERMIT_HOOK_TYPE_GRANT;
+    hook->data=hook;
+    REQUIRE(0==permitnc_pushhook(&permit, type, hook));
+    if(!(n%100)) thrd_yield();
+    REQUIRE(hook==permitnc_pophook(&permit, type));
+    hook->data=0;
+  }
+  atomic_store_explicit(&permitnc_hooks_done, 1U, memory_order_seq_cst);
+  REQUIRE(0==thrd_join(thread, NULL));
+  errors=permitnc_hooks_errors;
+  REQUIRE(0==errors);
+  permitnc_destroy(&permit);
+}
+
+#define HOOK_GRANTERS 4
+static pthread_permitnc_t permitnc_hooks_stressed;
+static int permitnc_hooks_pusher(void *type)
+{ // Each pusher owns the only hook of its type, so what it pops is always what it pushed
+  pthread_permitnc_hook_t hook={permitnc_hooks_counter, 0, 0};
+  unsigned n;
+  for(n=0; n<10000; n++)
+  {
+    hook.data=&hook;
+    if(permitnc_pushhook(&permitnc_hooks_stressed, *(pthread_permit_hook_type_t *) type, &hook)) return 1;
+    if(!(n%100)) thrd_yield();
+    if(&hook!=permitnc_pophook(&permitnc_hooks_stressed, *(pthread_permit_hook_type_t *) type)) return 1;
+    hook.data=0;
+  }
+  return 0;
+}
+TEST_CASE("pthread_permitnc/hooksstress", "Tests that hooks pushed and popped by many threads are never called once popped while many threads grant")
+{
+  static pthread_permit_hook_type_t types[2]={PTHREAD_PERMIT_HOOK_TYPE_GRANT, PTHREAD_PERMIT_HOOK_TYPE_REVOKE};
+  thrd_t granters[HOOK_GRANTERS], pushers[2];
+  unsigned n, errors;
+  int ret;
+  REQUIRE(0==permitnc_init(&permitnc_hooks_stressed, 0));
+  permitnc_hooks_done=permitnc_hooks_errors=0;
+  for(n=0; n<HOOK_GRANTERS; n++)
+    REQUIRE(0==thrd_create(&granters[n], permitnc_hooks_granter, &permitnc_hooks_stressed));
+  for(n=0; n<2; n++)
+    REQUIRE(0==thrd_create(&pushers[n], permitnc_hooks_pusher, &types[n]));
+  for(n=0; n<2; n++)
+  {
+    REQUIRE(0==thrd_join(pushers[n], &ret));
+    REQUIRE(0==ret);
+  }
+  atomic_store_explicit(&permitnc_hooks_done, 1U, memory_order_seq_cst);
+  for(n=0; n<HOOK_GRANTERS; n++)
+    REQUIRE(0==thrd_join(granters[n], NULL));
+  errors=permitnc_hooks_errors;
+  REQUIRE(0==errors);
+  permitnc_destroy(&permitnc_hooks_stressed);
+}
+
+#if PTHREAD_PERMIT_USE_FUTEX
+// Forks a process which waits upon a process shared permit, exiting with what its wait returned
+static pid_t pshared_waiter(pthread_permitX_t permit, int consuming)
+{
+  pid_t pid=fork();
+  if(!pid)
+  {
+    mtx_t mtx;
+    struct timespec reltime={10, 0};
+    int ret;
+    mtx_init(&mtx, mtx_plain);
+    mtx_lock(&mtx);
+    ret=consuming ? permitc_waitfor((pthread_permitc_t *) permit, &mtx, &reltime) : permitnc_waitfor((pthread_permitnc_t *) permit, &mtx, &reltime);
+    _exit(ret);
+  }
+  return pid;
+}
+static int pshared_waited(pid_t pid)
+{
+  int status;
+  if(pid!=waitpid(pid, &status, 0)) return -1;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+TEST_CASE("pthread_permitX/pshared", "Tests that process shared permits are granted between processes and survive a waiting process dying")
+{
+  struct shared_s { pthread_permitc_t c; pthread_permitnc_t nc; } *shared;
+  pthread_permitnc_hook_t hook={0};
+  pthread_permitX_t permits[1];
+  pid_t pids[2];
+  shared=(struct shared_s *) mmap(NULL, sizeof(struct shared_s), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  REQUIRE(MAP_FAILED!=(void *) shared);
+  REQUIRE(EINVAL==permitc_init_flags(&shared->c, 0, PTHREAD_PERMIT_FLAG_FAIR|PTHREAD_PERMIT_FLAG_PSHARED));
+  REQUIRE(0==permitc_init_flags(&shared->c, 0, PTHREAD_PERMIT_FLAG_PSHARED));
+  REQUIRE(0==permitnc_init_flags(&shared->nc, 0, PTHREAD_PERMIT_FLAG_PSHARED));
+  // Nothing pointing into this process can be attached
+  REQUIRE(EINVAL==permitnc_pushhook(&shared->nc, PTHREAD_PERMIT_HOOK_TYPE_GRANT, &hook));
+  permits[0]=&shared->nc;
+  REQUIRE(EINVAL==permit_select(1, permits, NULL, NULL));
+
+  // A process killed whilst sleeping doesn't stop a grant reaching the next
+  pids[0]=pshared_waiter(&shared->c, 1);
+  while(1!=(unsigned) shared->c.queued)
+    thrd_yield();
+  REQUIRE(0==kill(pids[0], SIGKILL));
+  REQUIRE(-1==pshared_waited(pids[0]));
+  pids[1]=pshared_waiter(&shared->c, 1);
+  while(2!=(unsigned) shared->c.queued)
+    thrd_yield();
+  REQUIRE(0==permitc_grant(&shared->c));
+  REQUIRE(0==pshared_waited(pids[1]));
+  REQUIRE(ETIMEDOUT==permitc_timedwait(&shared->c, NULL, NULL));
+
+  // A non-consuming grant releases every sleeping process even if immediately revoked
+  pids[0]=pshared_waiter(&shared->nc, 0);
+  pids[1]=pshared_waiter(&shared->nc, 0);
+  while(2!=(unsigned) shared->nc.queued)
+    thrd_yield();
+  REQUIRE(0==permitnc_grant(&shared->nc));
+  permitnc_revoke(&shared->nc);
+  REQUIRE(0==pshared_waited(pids[0]));
+  REQUIRE(0==pshared_waited(pids[1]));
+  REQUIRE(0==(unsigned) shared->nc.queued);
+  permitc_destroy(&shared->c);
+  permitnc_destroy(&shared->nc);
+  munmap(shared, sizeof(struct shared_s));
+}
+#endif
+
+// The CPU time consumed by the calling thread alone, so other threads in the process don't count
+static long long thread_cpu_ns(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (long long) ts.tv_sec*1000000000LL+ts.tv_nsec;
+#else
+  return (long long) clock()*(1000000000LL/CLOCKS_PER_SEC);
+#endif
+}
+TEST_CASE("pthread_permitX/waitfor", "Tests that timed waits sleep rather than spin until their deadline")
+{
+  pthread_permit1_t permit1;
+  pthread_permitc_t permitc;
+  pthread_permitnc_t permitnc;
+  pthread_permitcount_t permitcount;
+  mtx_t mtx;
+  struct timespec reltime={0, 50000000}, begin, end;
+  long long cpu, elapsed;
+  REQUIRE(0==pthread_permit1_init(&permit1, 0));
+  REQUIRE(0==permitc_init(&permitc, 0));
+  REQUIRE(0==permitnc_init(&permitnc, 0));
+  REQUIRE(0==pthread_permitcount_init(&permitcount, 0));
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  cpu=thread_cpu_ns();
+  timespec_get(&begin, TIME_UTC);
+  REQUIRE(ETIMEDOUT==pthread_permit1_waitfor(&permit1, &mtx, &reltime));
+  REQUIRE(ETIMEDOUT==permitc_waitfor(&permitc, &mtx, &reltime));
+  REQUIRE(ETIMEDOUT==permitnc_waitfor(&permitnc, &mtx, &reltime));
+  REQUIRE(ETIMEDOUT==pthread_permitcount_waitfor(&permitcount, &mtx, &reltime));
+  timespec_get(&end, TIME_UTC);
+  cpu=thread_cpu_ns()-cpu;
+  elapsed=timespec_diff(&end, &begin);
+  REQUIRE(elapsed>=4*50000000LL);
+  // Four timed waits of 50ms should have spent almost all of their 200ms asleep
+  REQUIRE(cpu<50000000LL);
+  // Null periods poll, and granted permits are taken at once
+  REQUIRE(ETIMEDOUT==permitc_waitfor(&permitc, &mtx, NULL));
+  REQUIRE(0==permitc_grant(&permitc));
+  REQUIRE(0==permitc_waitfor(&permitc, &mtx, &reltime));
+  REQUIRE(0==pthread_permit1_grant((pthread_permitX_t) &permit1));
+  REQUIRE(0==pthread_permit1_waitfor(&permit1, &mtx, &reltime));
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  pthread_permitcount_destroy(&permitcount);
+  permitnc_destroy(&permitnc);
+  permitc_destroy(&permitc);
+  pthread_permit1_destroy(&permit1);
+}
+
+TEST_CASE("pthread_permitX/counters", "Tests that performance counters count per permit and process wide")
+{
+  pthread_permit1_t permit1;
+  pthread_permitc_t permitc;
+  pthread_permitX_t permits[1];
+  unsigned before[PTHREAD_PERMIT_COUNTER_LAST], after[PTHREAD_PERMIT_COUNTER_LAST], counters[PTHREAD_PERMIT_COUNTER_LAST];
+  REQUIRE(0==pthread_permit1_init(&permit1, 0));
+  REQUIRE(0==permitc_init(&permitc, 0));
+#if PTHREAD_PERMIT_ENABLE_COUNTERS
+  REQUIRE(0==permit_counters(NULL, before));
+  REQUIRE(0==pthread_permit1_grant((pthread_permitX_t) &permit1));
+  REQUIRE(0==pthread_permit1_timedwait(&permit1, NULL, NULL));
+  REQUIRE(0==permit_counters(&permit1, counters));
+  REQUIRE(1==counters[PTHREAD_PERMIT_COUNTER_GRANTS]);
+  REQUIRE(1==counters[PTHREAD_PERMIT_COUNTER_WAITS]);
+  REQUIRE(0==counters[PTHREAD_PERMIT_COUNTER_SLEEPS]);
+
+  REQUIRE(0==permitc_grant(&permitc));
+  REQUIRE(0==permitc_grant(&permitc));
+  permits[0]=&permitc;
+  REQUIRE(0==permit_select(1, permits, NULL, NULL));
+  REQUIRE(ETIMEDOUT==permitc_timedwait(&permitc, NULL, NULL));
+  REQUIRE(0==permit_counters(&permitc, counters));
+  REQUIRE(2==counters[PTHREAD_PERMIT_COUNTER_GRANTS]);
+  REQUIRE(2==counters[PTHREAD_PERMIT_COUNTER_WAITS]);
+  REQUIRE(1==counters[PTHREAD_PERMIT_COUNTER_SELECTLINKS]);
+  REQUIRE(1==counters[PTHREAD_PERMIT_COUNTER_SELECTUNLINKS]);
+  REQUIRE(0==counters[PTHREAD_PERMIT_COUNTER_HOOKCALLS]);
+
+  REQUIRE(0==permit_counters(NULL, after));
+  REQUIRE(3==after[PTHREAD_PERMIT_COUNTER_GRANTS]-before[PTHREAD_PERMIT_COUNTER_GRANTS]);
+  REQUIRE(3==after[PTHREAD_PERMIT_COUNTER_WAITS]-before[PTHREAD_PERMIT_COUNTER_WAITS]);
+#else
+  (void) before; (void) after; (void) permits;
+  REQUIRE(EINVAL==permit_counters(&permitc, counters));
+  REQUIRE(0==counters[PTHREAD_PERMIT_COUNTER_GRANTS]);
+#endif
+  REQUIRE(EINVAL==permit_counters(&counters, counters));
+  permitc_destroy(&permitc);
+  pthread_permit1_destroy(&permit1);
+}
+
+TEST_CASE("pthread_permitX/trace", "Tests that permit operations are traced")
+{
+  pthread_permit1_t permit1;
+  pthread_permitc_t permitc;
+  FILE *f=tmpfile();
+  REQUIRE(f);
+  REQUIRE(0==pthread_permit1_init(&permit1, 0));
+  REQUIRE(0==permitc_init(&permitc, 0));
+  REQUIRE(0==pthread_permit1_grant((pthread_permitX_t) &permit1));
+  REQUIRE(0==pthread_permit1_timedwait(&permit1, NULL, NULL));
+  REQUIRE(0==permitc_grant(&permitc));
+  REQUIRE(0==permitc_timedwait(&permitc, NULL, NULL));
+  REQUIRE(ETIMEDOUT==permitc_timedwait(&permitc, NULL, NULL));
+  permitc_destroy(&permitc);
+#if PTHREAD_PERMIT_ENABLE_TRACE
+  {
+    pthread_permit_trace_header_t header;
+    pthread_permit_trace_ring_t ring;
+    pthread_permit_trace_event_t event;
+    unsigned r, n, types[8], ntypes=0;
+    unsigned long long last=0;
+    REQUIRE(0==permit_trace_save(f));
+    rewind(f);
+    REQUIRE(1==fread(&header, sizeof(header), 1, f));
+    REQUIRE(0==memcmp(header.magic, "PTRC", 4));
+    REQUIRE(1==header.version);
+    REQUIRE(header.rings>0);
+    REQUIRE(header.nspertick>0);
+    for(r=0; r<header.rings; r++)
+    {
+      REQUIRE(1==fread(&ring, sizeof(ring), 1, f));
+      for(n=0; n<ring.events; n++)
+      {
+        REQUIRE(1==fread(&event, sizeof(event), 1, f));
+        REQUIRE(event.type<PTHREAD_PERMIT_TRACE_LAST);
+        if(event.permit==(unsigned long long)(size_t) &permitc)
+        { // Only this thread used permitc, so its events are in order
+          REQUIRE(ntypes<8);
+          REQUIRE(event.timestamp>=last);
+          last=event.timestamp;
+          types[ntypes++]=event.type;
+          if(PTHREAD_PERMIT_TRACE_WAITED==event.type)
+            REQUIRE((5==ntypes ? 0U : (unsigned) ETIMEDOUT)==event.arg);
+        }
+      }
+    }
+    REQUIRE(8==ntypes);
+    REQUIRE(PTHREAD_PERMIT_TRACE_INIT==types[0]);
+    REQUIRE(PTHREAD_PERMIT_TRACE_GRANT==types[1]);
+    REQUIRE(PTHREAD_PERMIT_TRACE_GRANTED==types[2]);
+    REQUIRE(PTHREAD_PERMIT_TRACE_WAIT==types[3]);
+    REQUIRE(PTHREAD_PERMIT_TRACE_WAITED==types[4]);
+    REQUIRE(PTHREAD_PERMIT_TRACE_WAIT==types[5]);
+    REQUIRE(PTHREAD_PERMIT_TRACE_WAITED==types[6]);
+    REQUIRE(PTHREAD_PERMIT_TRACE_DESTROY==types[7]);
+
+    // Releasing the rings empties the trace, and this thread traces into a new ring afterwards
+    permit_trace_release();
+    rewind(f);
+    REQUIRE(0==permit_trace_save(f));
+    rewind(f);
+    REQUIRE(1==fread(&header, sizeof(header), 1, f));
+    REQUIRE(0==header.rings);
+    REQUIRE(0==pthread_permit1_grant((pthread_permitX_t) &permit1));
+    rewind(f);
+    REQUIRE(0==permit_trace_save(f));
+    rewind(f);
+    REQUIRE(1==fread(&header, sizeof(header), 1, f));
+    REQUIRE(1==header.rings);
+    REQUIRE(1==fread(&ring, sizeof(ring), 1, f));
+    REQUIRE(2==ring.events);
+  }
+#else
+  REQUIRE(EINVAL==permit_trace_save(f));
+#endif
+  fclose(f);
+  pthread_permit1_destroy(&permit1);
+}
+
+static void permitX_await_called(pthread_permit_continuation_t *c)
+{
+  (*(int *) c->data)++;
+}
+
+TEST_CASE("pthread_permitX/await", "Tests that continuations receive grants in order exactly as waiters would")
+{
+  pthread_permit1_t permit1;
+  pthread_permitc_t permitc;
+  pthread_permitnc_t permitnc;
+  int called[3]={0, 0, 0};
+  pthread_permit_continuation_t c[3]={{permitX_await_called, &called[0]}, {permitX_await_called, &called[1]}, {permitX_await_called, &called[2]}};
+
+  // Granted permits are taken immediately without calling
+  REQUIRE(0==pthread_permit1_init(&permit1, 1));
+  REQUIRE(0==pthread_permit1_await(&permit1, &c[0]));
+  REQUIRE(EBUSY==pthread_permit1_await(&permit1, &c[1]));
+  REQUIRE(EBUSY==pthread_permit1_await(&permit1, &c[2]));
+  REQUIRE(0==called[0]);
+  REQUIRE(0==called[1]);
+  // Consuming grants release one continuation at a time, oldest first
+  REQUIRE(0==pthread_permit1_grant((pthread_permitX_t) &permit1));
+  REQUIRE(1==called[1]);
+  REQUIRE(0==called[2]);
+  REQUIRE(ETIMEDOUT==pthread_permit1_timedwait(&permit1, NULL, NULL));
+  // Destruction releases everything left
+  pthread_permit1_destroy(&permit1);
+  REQUIRE(1==called[2]);
+  REQUIRE(EINVAL==pthread_permit1_await(&permit1, &c[0]));
+
+  called[0]=called[1]=called[2]=0;
+  REQUIRE(0==permitc_init(&permitc, 0));
+  REQUIRE(EBUSY==permitc_await(&permitc, &c[0]));
+  REQUIRE(EBUSY==permitc_await(&permitc, &c[1]));
+  REQUIRE(EBUSY==permitc_await(&permitc, &c[2]));
+  REQUIRE(0==permitc_grant(&permitc));
+  REQUIRE(1==called[0]);
+  REQUIRE(0==called[1]);
+  REQUIRE(ETIMEDOUT==permitc_timedwait(&permitc, NULL, NULL));
+  REQUIRE(0==permitc_grant(&permitc));
+  REQUIRE(1==called[1]);
+  REQUIRE(0==called[2]);
+  permitc_destroy(&permitc);
+  REQUIRE(1==called[2]);
+  REQUIRE(EINVAL==permitc_await(&permitc, &c[0]));
+
+  // Non-consuming grants release every continuation
+  called[0]=called[1]=called[2]=0;
+  REQUIRE(0==permitnc_init(&permitnc, 0));
+  REQUIRE(EBUSY==permitnc_await(&permitnc, &c[0]));
+  REQUIRE(EBUSY==permitnc_await(&permitnc, &c[1]));
+  REQUIRE(0==permitnc_grant(&permitnc));
+  REQUIRE(1==called[0]);
+  REQUIRE(1==called[1]);
+  REQUIRE(0==permitnc_await(&permitnc, &c[2]));
+  REQUIRE(0==called[2]);
+  REQUIRE(0==permitnc_timedwait(&permitnc, NULL, NULL));
+  permitnc_destroy(&permitnc);
+}
+
+static void permitX_then_called(void *arg)
+{
+  (*(int *) arg)++;
+}
+static void permitX_then_post(pthread_permit_executor_t *executor, void (*fn)(void *), void *arg)
+{ // Defers the callback until the test runs it
+  void **posted=(void **) executor->data;
+  posted[0]=(void *) fn;
+  posted[1]=arg;
+}
+
+TEST_CASE("pthread_permitX/then", "Tests that callbacks run once per consuming grant, inline or via an executor")
+{
+  pthread_permitc_t permitc;
+  pthread_permitnc_t permitnc;
+  int called[2]={0, 0}, n;
+  void *posted[2]={0, 0};
+  pthread_permit_executor_t executor={permitX_then_post, posted};
+  REQUIRE(EINVAL==permit_then(&called, permitX_then_called, &called[0], NULL));
+
+  REQUIRE(0==permitc_init(&permitc, 1));
+  REQUIRE(0==permit_then(&permitc, permitX_then_called, &called[0], NULL));
+  REQUIRE(1==called[0]);
+  for(n=0; n<10; n++)
+    REQUIRE(0==permit_then(&permitc, permitX_then_called, &called[1], NULL));
+  for(n=0; n<10; n++)
+  {
+    REQUIRE(n==called[1]);
+    REQUIRE(0==permitc_grant(&permitc));
+  }
+  REQUIRE(10==called[1]);
+  REQUIRE(ETIMEDOUT==permitc_timedwait(&permitc, NULL, NULL));
+  permitc_destroy(&permitc);
+
+  called[0]=0;
+  REQUIRE(0==permitnc_init(&permitnc, 0));
+  REQUIRE(0==permit_then(&permitnc, permitX_then_called, &called[0], &executor));
+  REQUIRE(0==permitnc_grant(&permitnc));
+  REQUIRE(0==called[0]);
+  REQUIRE(posted[0]==(void *) permitX_then_called);
+  ((void (*)(void *)) posted[0])(posted[1]);
+  REQUIRE(1==called[0]);
+  permitnc_destroy(&permitnc);
+}
+
+#ifdef __cpp_impl_coroutine
+struct permitX_coroutine_task
+{
+  struct promise_type
+  {
+    permitX_coroutine_task get_return_object() { return permitX_coroutine_task(); }
+    std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+    std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+    void return_void() { }
+    void unhandled_exception() { }
+  };
+};
+static permitX_coroutine_task permitX_coroutine_waiter(pthread_permitc_t &permit, int &progress)
+{
+  co_await permit;
+  progress++;
+  co_await permit;
+  progress++;
+}
+struct permitX_coroutine_executor
+{
+  std::coroutine_handle<> *posted;
+  void operator()(std::coroutine_handle<> h) const { *posted=h; }
+};
+static permitX_coroutine_task permitX_coroutine_posted(pthread_permitnc_t &permit, std::coroutine_handle<> &posted, int &progress)
+{
+  co_await pthread_permit_coroutine::on(permit, permitX_coroutine_executor{&posted});
+  progress++;
+}
+
+TEST_CASE("pthread_permitX/coroutine", "Tests that coroutines suspend upon ungranted permits and are resumed by their grant")
+{
+  pthread_permitc_t permitc;
+  pthread_permitnc_t permitnc;
+  std::coroutine_handle<> posted;
+  int progress=0;
+  REQUIRE(0==permitc_init(&permitc, 1));
+  permitX_coroutine_waiter(permitc, progress);
+  REQUIRE(1==progress);
+  REQUIRE(0==permitc_grant(&permitc));
+  REQUIRE(2==progress);
+  REQUIRE(ETIMEDOUT==permitc_timedwait(&permitc, NULL, NULL));
+  permitc_destroy(&permitc);
+
+  progress=0;
+  REQUIRE(0==permitnc_init(&permitnc, 0));
+  permitX_coroutine_posted(permitnc, posted, progress);
+  REQUIRE(!posted);
+  REQUIRE(0==permitnc_grant(&permitnc));
+  REQUIRE(!!posted);
+  REQUIRE(0==progress);
+  posted.resume();
+  REQUIRE(1==progress);
+  permitnc_destroy(&permitnc);
+}
+#endif
+
 
 /***************************** pthread_permit non-parallel/parallel ******************************/
 
@@ -532,9 +1428,495 @@ TEST_CASE("pthread_permit/parallel/ncselect", "Tests that select does not consum
 }
 #endif
 
+#define MANY_SELECTS 72
+#define MANY_SELECT_PERMITS 33
+static pthread_permitc_t manyselect_permits[MANY_SELECT_PERMITS];
+static atomic_uint manyselects_entered, manyselects_done;
+static int manyselect_selecter(void *)
+{
+  pthread_permitX_t parray[MANY_SELECT_PERMITS];
+  mtx_t mtx;
+  size_t m;
+  for(m=0; m<MANY_SELECT_PERMITS; m++)
+    parray[m]=&manyselect_permits[m];
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  atomic_fetch_add_explicit(&manyselects_entered, 1U, memory_order_relaxed);
+  if(0==permit_select(MANY_SELECT_PERMITS, parray, &mtx, NULL))
+    atomic_fetch_add_explicit(&manyselects_done, 1U, memory_order_relaxed);
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  return 0;
+}
+
+TEST_CASE("pthread_permit/non-parallel/selectmany", "Tests that select many takes every granted permit up to its limit, consuming only consuming permits")
+{
+  pthread_permitc_t permitcs[SELECT_PERMITS-1];
+  pthread_permitnc_t permitnc, destroyed;
+  pthread_permitX_t parray[SELECT_PERMITS+1];
+  size_t n, taken, granted=1;
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  for(n=0; n<SELECT_PERMITS-1; n++)
+  {
+    REQUIRE(0==permitc_init(&permitcs[n], n%3==0));
+    if(n%3==0) granted++;
+  }
+  REQUIRE(0==permitnc_init(&permitnc, 1));
+  for(n=0; n<SELECT_PERMITS-1; n++)
+    parray[n]=&permitcs[n];
+  parray[n]=&permitnc;
+  REQUIRE(EINVAL==permit_select_many(SELECT_PERMITS, parray, 0, &taken, NULL, &ts));
+  // Every granted permit is taken at once, and the rest zeroed
+  REQUIRE(0==permit_select_many(SELECT_PERMITS, parray, SELECT_PERMITS, &taken, NULL, &ts));
+  REQUIRE(granted==taken);
+  for(n=0; n<SELECT_PERMITS-1; n++)
+  {
+    REQUIRE(parray[n]==(n%3==0 ? &permitcs[n] : 0));
+    REQUIRE(ETIMEDOUT==permitc_timedwait(&permitcs[n], NULL, NULL));
+  }
+  REQUIRE(parray[n]==&permitnc);
+  REQUIRE(0==permitnc_timedwait(&permitnc, NULL, NULL));
+
+  // No more than max are taken, in array order, leaving the rest granted
+  for(n=0; n<SELECT_PERMITS-1; n++)
+  {
+    REQUIRE(0==permitc_grant(&permitcs[n]));
+    parray[n]=&permitcs[n];
+  }
+  parray[n]=&permitnc;
+  REQUIRE(0==permit_select_many(SELECT_PERMITS, parray, 4, &taken, NULL, &ts));
+  REQUIRE(4==taken);
+  for(n=0; n<SELECT_PERMITS; n++)
+    REQUIRE(parray[n]==(n<4 ? &permitcs[n] : 0));
+  for(n=4; n<SELECT_PERMITS-1; n++)
+    REQUIRE(0==permitc_timedwait(&permitcs[n], NULL, NULL));
+
+  // Only errored permits are zeroed on error
+  REQUIRE(0==permitnc_init(&destroyed, 1));
+  permitnc_destroy(&destroyed);
+  parray[0]=&permitcs[0];
+  parray[1]=&destroyed;
+  parray[2]=&permitnc;
+  REQUIRE(EINVAL==permit_select_many(3, parray, 3, &taken, NULL, &ts));
+  REQUIRE(0==taken);
+  REQUIRE(parray[0]==&permitcs[0]);
+  REQUIRE(parray[1]==0);
+  REQUIRE(parray[2]==&permitnc);
+  parray[1]=&destroyed;
+  REQUIRE(EINVAL==permit_select(3, parray, NULL, &ts));
+  REQUIRE(parray[1]==0);
+  for(n=0; n<SELECT_PERMITS-1; n++)
+    permitc_destroy(&permitcs[n]);
+  permitnc_destroy(&permitnc);
+}
+
+TEST_CASE("pthread_permit/non-parallel/manyselects", "Tests that more than 64 selects can wait concurrently upon more permits than fit on the stack")
+{
+  thrd_t threads[MANY_SELECTS];
+  size_t n;
+  struct timespec ms={0, 1000000};
+  manyselects_entered=manyselects_done=0;
+  for(n=0; n<MANY_SELECT_PERMITS; n++)
+    REQUIRE(0==permitc_init(&manyselect_permits[n], 0));
+  for(n=0; n<MANY_SELECTS; n++)
+    REQUIRE(0==thrd_create(&threads[n], manyselect_selecter, NULL));
+  while(atomic_load_explicit(&manyselects_entered, memory_order_relaxed)<MANY_SELECTS)
+    thrd_sleep(&ms, NULL);
+  // Each grant is consumed by exactly one select
+  for(n=0; atomic_load_explicit(&manyselects_done, memory_order_relaxed)<MANY_SELECTS; n++)
+  {
+    REQUIRE(0==permitc_grant(&manyselect_permits[n%MANY_SELECT_PERMITS]));
+    thrd_yield();
+  }
+  // Wait for the selects to delink themselves
+  for(n=0; n<MANY_SELECTS; n++)
+    REQUIRE(0==thrd_join(threads[n], NULL));
+  for(n=0; n<MANY_SELECT_PERMITS; n++)
+  {
+    REQUIRE(atomic_load_explicit(&manyselect_permits[n].waiters, memory_order_relaxed)==atomic_load_explicit(&manyselect_permits[n].waited, memory_order_relaxed));
+    REQUIRE(!manyselect_permits[n].selects);
+    permitc_destroy(&manyselect_permits[n]);
+  }
+}
+
+TEST_CASE("pthread_permit/non-parallel/selectset", "Tests that select sets return granted permits in order of grant exactly once")
+{
+  pthread_permitc_t permitcs[SELECT_PERMITS-1];
+  pthread_permitnc_t permitnc;
+  pthread_permit_selectset_t set;
+  pthread_permitX_t permit;
+  size_t n;
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  REQUIRE(0==permit_selectset_init(&set));
+  for(n=0; n<SELECT_PERMITS-1; n++)
+  {
+    REQUIRE(0==permitc_init(&permitcs[n], 0));
+    REQUIRE(0==permit_selectset_add(&set, &permitcs[n]));
+  }
+  REQUIRE(0==permitnc_init(&permitnc, 0));
+  REQUIRE(0==permit_selectset_add(&set, &permitnc));
+  REQUIRE(ETIMEDOUT==permit_selectset_wait(&set, &permit, NULL, &ts));
+  // Grant in reverse order, and expect them back in that order exactly once
+  for(n=SELECT_PERMITS-1; n>0; n--)
+    REQUIRE(0==permitc_grant(&permitcs[n-1]));
+  for(n=SELECT_PERMITS-1; n>0; n--)
+  {
+    REQUIRE(0==permit_selectset_wait(&set, &permit, NULL, &ts));
+    REQUIRE(permit==&permitcs[n-1]);
+    REQUIRE(ETIMEDOUT==permitc_timedwait(&permitcs[n-1], NULL, NULL));
+  }
+  REQUIRE(ETIMEDOUT==permit_selectset_wait(&set, &permit, NULL, &ts));
+  // A permit consumed elsewhere must not be returned
+  REQUIRE(0==permitc_grant(&permitcs[0]));
+  REQUIRE(0==permitc_timedwait(&permitcs[0], NULL, NULL));
+  REQUIRE(ETIMEDOUT==permit_selectset_wait(&set, &permit, NULL, &ts));
+  // Non-consuming permits remain ready until revoked
+  REQUIRE(0==permitnc_grant(&permitnc));
+  REQUIRE(0==permit_selectset_wait(&set, &permit, NULL, &ts));
+  REQUIRE(permit==&permitnc);
+  REQUIRE(0==permit_selectset_wait(&set, &permit, NULL, &ts));
+  REQUIRE(permit==&permitnc);
+  permitnc_revoke(&permitnc);
+  REQUIRE(ETIMEDOUT==permit_selectset_wait(&set, &permit, NULL, &ts));
+  // Removed permits are no longer returned
+  REQUIRE(0==permit_selectset_remove(&set, &permitcs[1]));
+  REQUIRE(EINVAL==permit_selectset_remove(&set, &permitcs[1]));
+  REQUIRE(0==permitc_grant(&permitcs[1]));
+  REQUIRE(ETIMEDOUT==permit_selectset_wait(&set, &permit, NULL, &ts));
+  REQUIRE(0==permitc_timedwait(&permitcs[1], NULL, NULL));
+  // Permits granted before being added are immediately ready
+  REQUIRE(0==permitc_grant(&permitcs[1]));
+  REQUIRE(0==permit_selectset_add(&set, &permitcs[1]));
+  REQUIRE(0==permit_selectset_wait(&set, &permit, NULL, &ts));
+  REQUIRE(permit==&permitcs[1]);
+  permit_selectset_destroy(&set);
+  REQUIRE(EINVAL==permit_selectset_wait(&set, &permit, NULL, &ts));
+  for(n=0; n<SELECT_PERMITS-1; n++)
+    permitc_destroy(&permitcs[n]);
+  permitnc_destroy(&permitnc);
+}
+
+static int selectset_granter(void *permit)
+{
+  struct timespec ms={0, 1000000};
+  thrd_sleep(&ms, NULL);
+  permitc_grant(permit);
+  return 0;
+}
+
+TEST_CASE("pthread_permit/non-parallel/selectsetsleep", "Tests that select sets sleep until a registered permit is granted")
+{
+  pthread_permitc_t permits[SELECT_PERMITS];
+  pthread_permit_selectset_t set;
+  pthread_permitX_t permit;
+  thrd_t thread;
+  mtx_t mtx;
+  size_t n;
+  REQUIRE(0==permit_selectset_init(&set));
+  for(n=0; n<SELECT_PERMITS; n++)
+  {
+    REQUIRE(0==permitc_init(&permits[n], 0));
+    REQUIRE(0==permit_selectset_add(&set, &permits[n]));
+  }
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  for(n=0; n<SELECT_PERMITS; n+=7)
+  {
+    REQUIRE(0==thrd_create(&thread, selectset_granter, &permits[n]));
+    REQUIRE(0==permit_selectset_wait(&set, &permit, &mtx, NULL));
+    REQUIRE(permit==&permits[n]);
+    REQUIRE(0==thrd_join(thread, NULL));
+  }
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  permit_selectset_destroy(&set);
+  for(n=0; n<SELECT_PERMITS; n++)
+    permitc_destroy(&permits[n]);
+}
+
 
 /***************************** pthread_permit fd mirroring ******************************/
 
+#ifdef __linux__
+TEST_CASE("pthread_permit/reactor", "Tests that reactors return granted permits in order of grant exactly once through one descriptor")
+{
+  pthread_permit_reactor_t reactor;
+  pthread_permitc_t permits[3], extra;
+  pthread_permitnc_t permitnc;
+  pthread_permitX_t granted[4];
+  struct pollfd pfd={0};
+  size_t no;
+  int n;
+  pfd.events=POLLIN;
+  REQUIRE(0==permit_reactor_init(&reactor, 4));
+  pfd.fd=permit_reactor_fd(&reactor);
+  for(n=0; n<3; n++)
+  {
+    REQUIRE(0==permitc_init(&permits[n], 0));
+    REQUIRE(0==permit_reactor_add(&reactor, &permits[n]));
+  }
+  REQUIRE(0==permitnc_init(&permitnc, 0));
+  REQUIRE(0==permit_reactor_add(&reactor, &permitnc));
+  REQUIRE(0==permitc_init(&extra, 1));
+  REQUIRE(ENOMEM==permit_reactor_add(&reactor, &extra));
+
+  no=4;
+  REQUIRE(0==permit_reactor_poll(&reactor, granted, &no));
+  REQUIRE(0==no);
+  REQUIRE(poll(&pfd, 1, 0)>=0);
+  REQUIRE(!(pfd.revents&POLLIN));
+
+  permitc_grant(&permits[2]);
+  permitnc_grant(&permitnc);
+  permitc_grant(&permits[0]);
+  permitc_grant(&permits[2]);
+  REQUIRE(poll(&pfd, 1, 0)>=0);
+  REQUIRE(!!(pfd.revents&POLLIN));
+  // Leftovers keep the descriptor readable
+  no=2;
+  REQUIRE(0==permit_reactor_poll(&reactor, granted, &no));
+  REQUIRE(2==no);
+  REQUIRE(granted[0]==&permits[2]);
+  REQUIRE(granted[1]==&permitnc);
+  REQUIRE(poll(&pfd, 1, 0)>=0);
+  REQUIRE(!!(pfd.revents&POLLIN));
+  // A grant arriving whilst leftovers remain isn't lost by the poll returning those leftovers
+  permitc_grant(&permits[1]);
+  no=4;
+  REQUIRE(0==permit_reactor_poll(&reactor, granted, &no));
+  REQUIRE(1==no);
+  REQUIRE(granted[0]==&permits[0]);
+  REQUIRE(poll(&pfd, 1, 0)>=0);
+  REQUIRE(!!(pfd.revents&POLLIN));
+  no=4;
+  REQUIRE(0==permit_reactor_poll(&reactor, granted, &no));
+  REQUIRE(1==no);
+  REQUIRE(granted[0]==&permits[1]);
+  REQUIRE(poll(&pfd, 1, 0)>=0);
+  REQUIRE(!(pfd.revents&POLLIN));
+  // Consuming permits were consumed, non-consuming ones weren't
+  REQUIRE(ETIMEDOUT==permitc_timedwait(&permits[0], NULL, NULL));
+  REQUIRE(ETIMEDOUT==permitc_timedwait(&permits[2], NULL, NULL));
+  REQUIRE(0==permitnc_timedwait(&permitnc, NULL, NULL));
+  permitnc_revoke(&permitnc);
+
+  // Granted then taken elsewhere isn't returned
+  permitc_grant(&permits[1]);
+  REQUIRE(0==permitc_timedwait(&permits[1], NULL, NULL));
+  no=4;
+  REQUIRE(0==permit_reactor_poll(&reactor, granted, &no));
+  REQUIRE(0==no);
+
+  // Removed permits are no longer returned, and their slot is reused
+  permitc_grant(&permits[1]);
+  REQUIRE(0==permit_reactor_remove(&reactor, &permits[1]));
+  REQUIRE(EINVAL==permit_reactor_remove(&reactor, &permits[1]));
+  REQUIRE(0==permit_reactor_add(&reactor, &extra));
+  no=4;
+  REQUIRE(0==permit_reactor_poll(&reactor, granted, &no));
+  REQUIRE(1==no);
+  REQUIRE(granted[0]==&extra);
+
+  permit_reactor_destroy(&reactor);
+  for(n=0; n<3; n++)
+    permitc_destroy(&permits[n]);
+  permitc_destroy(&extra);
+  permitnc_destroy(&permitnc);
+}
+
+TEST_CASE("pthread_permit/reactorepoll", "Tests that a reactor wakes an epoll_wait when a registered permit is granted")
+{
+  pthread_permit_reactor_t reactor;
+  pthread_permitc_t permit;
+  pthread_permitX_t granted;
+  struct epoll_event ev={0};
+  thrd_t thread;
+  size_t no=1;
+  int epollfd;
+  REQUIRE(0==permitc_init(&permit, 0));
+  REQUIRE(0==permit_reactor_init(&reactor, 1));
+  REQUIRE(0==permit_reactor_add(&reactor, &permit));
+  REQUIRE(-1!=(epollfd=epoll_create1(0)));
+  ev.events=EPOLLIN;
+  ev.data.ptr=&reactor;
+  REQUIRE(0==epoll_ctl(epollfd, EPOLL_CTL_ADD, permit_reactor_fd(&reactor), &ev));
+  REQUIRE(0==thrd_create(&thread, selectset_granter, &permit));
+  REQUIRE(1==epoll_wait(epollfd, &ev, 1, 10000));
+  REQUIRE(ev.data.ptr==&reactor);
+  REQUIRE(0==permit_reactor_poll(&reactor, &granted, &no));
+  REQUIRE(1==no);
+  REQUIRE(granted==&permit);
+  REQUIRE(0==epoll_wait(epollfd, &ev, 1, 0));
+  REQUIRE(0==thrd_join(thread, NULL));
+  close(epollfd);
+  permit_reactor_destroy(&reactor);
+  permitc_destroy(&permit);
+}
+#endif
+
+#define PERMITSET_PERMITS 70000
+#define PERMITSET_WAITERS 8
+static pthread_permitset_t permitset_set;
+static atomic_uint permitset_taken[PERMITSET_WAITERS], permitset_done, permitset_released;
+static int permitset_waiter(void *no)
+{
+  mtx_t mtx;
+  size_t i;
+  int ret;
+  mtx_init(&mtx, mtx_plain);
+  mtx_lock(&mtx);
+  if(0==(ret=permitset_wait(&permitset_set, &i, &mtx)))
+    atomic_store_explicit(&permitset_taken[(size_t) no], (unsigned) i, memory_order_seq_cst);
+  else if(EINVAL==ret)
+    atomic_fetch_add_explicit(&permitset_released, 1U, memory_order_seq_cst);
+  mtx_unlock(&mtx);
+  mtx_destroy(&mtx);
+  atomic_fetch_add_explicit(&permitset_done, 1U, memory_order_seq_cst);
+  return 0;
+}
+TEST_CASE("pthread_permitset/consuming", "Tests that each grant of a consuming permit set is taken exactly once, and wakes sleepers")
+{
+  static const size_t granted[]={0, 31, 32, 1000, 40000, 65535, PERMITSET_PERMITS-1};
+  std::bitset<PERMITSET_PERMITS> seen;
+  thrd_t threads[PERMITSET_WAITERS];
+  size_t n, i;
+  REQUIRE(EINVAL==permitset_init(&permitset_set, 0, 1));
+  REQUIRE(0==permitset_init(&permitset_set, PERMITSET_PERMITS, 1));
+  REQUIRE(EINVAL==permitset_grant(&permitset_set, PERMITSET_PERMITS));
+  REQUIRE(ETIMEDOUT==permitset_timedwait(&permitset_set, &i, NULL, NULL));
+  for(n=0; n<sizeof(granted)/sizeof(granted[0]); n++)
+  {
+    REQUIRE(0==permitset_grant(&permitset_set, granted[n]));
+    REQUIRE(0==permitset_grant(&permitset_set, granted[n]));
+  }
+  for(n=0; n<sizeof(granted)/sizeof(granted[0]); n++)
+  {
+    REQUIRE(0==permitset_timedwait(&permitset_set, &i, NULL, NULL));
+    REQUIRE(i<PERMITSET_PERMITS);
+    CHECK(!seen[i]);
+    seen[i]=true;
+  }
+  for(n=0; n<sizeof(granted)/sizeof(granted[0]); n++)
+    CHECK(seen[granted[n]]);
+  REQUIRE(ETIMEDOUT==permitset_timedwait(&permitset_set, &i, NULL, NULL));
+  REQUIRE(0==permitset_grant(&permitset_set, 12345));
+  permitset_revoke(&permitset_set, 12345);
+  REQUIRE(ETIMEDOUT==permitset_timedwait(&permitset_set, &i, NULL, NULL));
+
+  // Each grant wakes and is taken by exactly one sleeping waiter
+  permitset_done=0;
+  for(n=0; n<PERMITSET_WAITERS; n++)
+    REQUIRE(0==thrd_create(&threads[n], permitset_waiter, (void *) n));
+  while(PERMITSET_WAITERS!=(unsigned) permitset_set.sleepers)
+    thrd_yield();
+  seen.reset();
+  for(n=0; n<PERMITSET_WAITERS; n++)
+    REQUIRE(0==permitset_grant(&permitset_set, n*8191));
+  for(n=0; n<PERMITSET_WAITERS; n++)
+    REQUIRE(0==thrd_join(threads[n], NULL));
+  REQUIRE(PERMITSET_WAITERS==(unsigned) permitset_done);
+  for(n=0; n<PERMITSET_WAITERS; n++)
+  {
+    i=permitset_taken[n];
+    CHECK(0==i%8191);
+    CHECK(!seen[i]);
+    seen[i]=true;
+  }
+  REQUIRE(ETIMEDOUT==permitset_timedwait(&permitset_set, &i, NULL, NULL));
+  permitset_destroy(&permitset_set);
+  REQUIRE(EINVAL==permitset_grant(&permitset_set, 0));
+}
+
+TEST_CASE("pthread_permitset/nonconsuming", "Tests that non-consuming permit set grants release every waiter present even if immediately revoked")
+{
+  thrd_t threads[PERMITSET_WAITERS];
+  size_t n, i;
+  REQUIRE(0==permitset_init(&permitset_set, PERMITSET_PERMITS, 0));
+  REQUIRE(0==permitset_grant(&permitset_set, 54321));
+  for(n=0; n<3; n++)
+  {
+    REQUIRE(0==permitset_timedwait(&permitset_set, &i, NULL, NULL));
+    CHECK(54321==i);
+  }
+  permitset_revoke(&permitset_set, 54321);
+  REQUIRE(ETIMEDOUT==permitset_timedwait(&permitset_set, &i, NULL, NULL));
+
+  permitset_done=0;
+  for(n=0; n<PERMITSET_WAITERS; n++)
+    REQUIRE(0==thrd_create(&threads[n], permitset_waiter, (void *) n));
+  while(PERMITSET_WAITERS!=(unsigned) permitset_set.sleepers)
+    thrd_yield();
+  REQUIRE(0==permitset_grant(&permitset_set, 777));
+  permitset_revoke(&permitset_set, 777);
+  for(n=0; n<PERMITSET_WAITERS; n++)
+    REQUIRE(0==thrd_join(threads[n], NULL));
+  REQUIRE(PERMITSET_WAITERS==(unsigned) permitset_done);
+  for(n=0; n<PERMITSET_WAITERS; n++)
+    CHECK(777==(unsigned) permitset_taken[n]);
+  REQUIRE(ETIMEDOUT==permitset_timedwait(&permitset_set, &i, NULL, NULL));
+  permitset_destroy(&permitset_set);
+}
+
+TEST_CASE("pthread_permitset/destroy", "Tests that destroying a permit set releases its sleeping waiters with an error")
+{
+  thrd_t threads[PERMITSET_WAITERS];
+  size_t n, i;
+  unsigned released;
+  REQUIRE(0==permitset_init(&permitset_set, PERMITSET_PERMITS, 1));
+  permitset_done=permitset_released=0;
+  for(n=0; n<PERMITSET_WAITERS; n++)
+    REQUIRE(0==thrd_create(&threads[n], permitset_waiter, (void *) n));
+  while(PERMITSET_WAITERS!=(unsigned) permitset_set.sleepers)
+    thrd_yield();
+  permitset_destroy(&permitset_set);
+  for(n=0; n<PERMITSET_WAITERS; n++)
+    REQUIRE(0==thrd_join(threads[n], NULL));
+  released=permitset_released;
+  REQUIRE(PERMITSET_WAITERS==released);
+  REQUIRE(EINVAL==permitset_timedwait(&permitset_set, &i, NULL, NULL));
+}
+
+#ifdef __linux__
+#define FDMIRRORING_CYCLES 20000
+static pthread_permitc_t fdmirroring_permitc;
+static pthread_permitnc_t fdmirroring_permitnc;
+static atomic_uint fdmirroring_done;
+static int fdmirroring_granter(void *consuming)
+{
+  size_t n;
+  for(n=0; n<FDMIRRORING_CYCLES; n++)
+  {
+    if(consuming)
+    {
+      permitc_grant(&fdmirroring_permitc);
+      permitc_revoke(&fdmirroring_permitc);
+    }
+    else
+    {
+      permitnc_grant(&fdmirroring_permitnc);
+      permitnc_revoke(&fdmirroring_permitnc);
+    }
+  }
+  atomic_store_explicit(&fdmirroring_done, 1U, memory_order_seq_cst);
+  return 0;
+}
+/* Races the granter by taking a consuming permit or revoking a non-consuming one */
+static int fdmirroring_racer(void *consuming)
+{
+  while(!atomic_load_explicit(&fdmirroring_done, memory_order_seq_cst))
+  {
+    if(consuming)
+      permitc_timedwait(&fdmirroring_permitc, NULL, NULL);
+    else
+      permitnc_revoke(&fdmirroring_permitnc);
+    thrd_yield();
+  }
+  return 0;
+}
+#endif
+
 TEST_CASE("pthread_permit/fdmirroring", "Tests that file descriptor mirroring works as intended")
 {
   pthread_permitnc_t permit;
@@ -559,6 +1941,114 @@ TEST_CASE("pthread_permit/fdmirroring", "Tests that file descriptor mirroring wo
   permitnc_deassociate(&permit, assoc);
   close(fds[1]); close(fds[0]);
   permitnc_destroy(&permit);
+
+#ifdef __linux__
+  {
+    pthread_permitc_t permitc;
+    pthread_permitc_association_t assocc;
+    uint64_t value;
+    int fd;
+    // Non-consuming permits stay signalled however many times they are granted or waited upon
+    REQUIRE(0==permitnc_init(&permit, 1));
+    REQUIRE(0!=(assoc=permitnc_associate_eventfd(&permit, &fd)));
+    pfd.fd=fd;
+    REQUIRE(poll(&pfd, 1, 0)>=0);
+    REQUIRE(!!(pfd.revents&POLLIN));
+    permitnc_revoke(&permit);
+    REQUIRE(poll(&pfd, 1, 0)>=0);
+    REQUIRE(!(pfd.revents&POLLIN));
+    permitnc_grant(&permit);
+    permitnc_grant(&permit);
+    REQUIRE(0==permitnc_timedwait(&permit, NULL, NULL));
+    REQUIRE(poll(&pfd, 1, 0)>=0);
+    REQUIRE(!!(pfd.revents&POLLIN));
+    permitnc_revoke(&permit);
+    REQUIRE(poll(&pfd, 1, 0)>=0);
+    REQUIRE(!(pfd.revents&POLLIN));
+    permitnc_revoke(&permit);
+    REQUIRE(poll(&pfd, 1, 0)>=0);
+    REQUIRE(!(pfd.revents&POLLIN));
+    permitnc_deassociate(&permit, assoc);
+    permitnc_destroy(&permit);
+
+    // Consuming permits are signalled exactly when a wait would succeed
+    REQUIRE(0==permitc_init(&permitc, 0));
+    REQUIRE(0!=(assocc=permitc_associate_eventfd(&permitc, &fd)));
+    pfd.fd=fd;
+    REQUIRE(poll(&pfd, 1, 0)>=0);
+    REQUIRE(!(pfd.revents&POLLIN));
+    permitc_grant(&permitc);
+    permitc_grant(&permitc);
+    REQUIRE(poll(&pfd, 1, 0)>=0);
+    REQUIRE(!!(pfd.revents&POLLIN));
+    REQUIRE(0==permitc_timedwait(&permitc, NULL, NULL));
+    REQUIRE(poll(&pfd, 1, 0)>=0);
+    REQUIRE(!(pfd.revents&POLLIN));
+    permitc_grant(&permitc);
+    REQUIRE(poll(&pfd, 1, 0)>=0);
+    REQUIRE(!!(pfd.revents&POLLIN));
+    permitc_revoke(&permitc);
+    permitc_revoke(&permitc);
+    REQUIRE(poll(&pfd, 1, 0)>=0);
+    REQUIRE(!(pfd.revents&POLLIN));
+    // Consuming never blocks in the mirror, even if something else drained the eventfd first
+    permitc_grant(&permitc);
+    REQUIRE((ssize_t) sizeof(value)==read(fd, &value, sizeof(value)));
+    REQUIRE(0==permitc_timedwait(&permitc, NULL, NULL));
+    REQUIRE(poll(&pfd, 1, 0)>=0);
+    REQUIRE(!(pfd.revents&POLLIN));
+    permitc_deassociate(&permitc, assocc);
+    permitc_destroy(&permitc);
+
+    // However grants race revokes and takes, the eventfd settles on the permit's final state
+    {
+      thrd_t threads[3];
+      size_t n, consuming;
+      for(consuming=0; consuming<2; consuming++)
+      {
+        if(consuming)
+        {
+          REQUIRE(0==permitc_init(&fdmirroring_permitc, 0));
+          REQUIRE(0!=(assocc=permitc_associate_eventfd(&fdmirroring_permitc, &fd)));
+        }
+        else
+        {
+          REQUIRE(0==permitnc_init(&fdmirroring_permitnc, 0));
+          REQUIRE(0!=(assoc=permitnc_associate_eventfd(&fdmirroring_permitnc, &fd)));
+        }
+        pfd.fd=fd;
+        atomic_store_explicit(&fdmirroring_done, 0U, memory_order_seq_cst);
+        REQUIRE(0==thrd_create(&threads[0], fdmirroring_granter, (void *) consuming));
+        for(n=1; n<3; n++)
+          REQUIRE(0==thrd_create(&threads[n], fdmirroring_racer, (void *) consuming));
+        for(n=0; n<3; n++)
+          REQUIRE(0==thrd_join(threads[n], NULL));
+        if(consuming)
+          permitc_revoke(&fdmirroring_permitc);
+        else
+          permitnc_revoke(&fdmirroring_permitnc);
+        REQUIRE(poll(&pfd, 1, 0)>=0);
+        REQUIRE(!(pfd.revents&POLLIN));
+        if(consuming)
+          permitc_grant(&fdmirroring_permitc);
+        else
+          permitnc_grant(&fdmirroring_permitnc);
+        REQUIRE(poll(&pfd, 1, 0)>=0);
+        REQUIRE(!!(pfd.revents&POLLIN));
+        if(consuming)
+        {
+          permitc_deassociate(&fdmirroring_permitc, assocc);
+          permitc_destroy(&fdmirroring_permitc);
+        }
+        else
+        {
+          permitnc_deassociate(&fdmirroring_permitnc, assoc);
+          permitnc_destroy(&fdmirroring_permitnc);
+        }
+      }
+    }
+  }
+#endif
 }
 
 
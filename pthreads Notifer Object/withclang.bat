@@ -1,4 +1,12 @@
 copy /y pthread_permit.c pthread_permit.cpp
 clang -std=c++11 -o unittests -DUSE_PARALLEL -I../intel_tbb/include pthread_permit.cpp unittests.cpp -lpthread -L ../intel_tbb/lib -ltbb_debug
 if ERRORLEVEL 1 clang -std=c++11 -o unittests pthread_permit.cpp unittests.cpp -lpthread
+rem The performance counters change the permit layout, so test them built in too
+clang -std=c++11 -DPTHREAD_PERMIT_ENABLE_COUNTERS=1 -o unittests_counters pthread_permit.cpp unittests.cpp -lpthread && unittests_counters
+rem Tracing is compiled out by default, so test the trace rings built in too
+clang -std=c++11 -DPTHREAD_PERMIT_ENABLE_TRACE=1 -o unittests_trace pthread_permit.cpp unittests.cpp -lpthread && unittests_trace
+rem The coroutine adapter and its tests need C++ 20
+clang -std=c++20 -o unittests_cxx20 pthread_permit.cpp unittests.cpp -lpthread && unittests_cxx20
 clang -std=c++11 -o pthread_permit_speedtest pthread_permit.cpp pthread_permit_speedtest.cpp -lpthread
+copy /y pthread_permit_tracedump.c pthread_permit_tracedump.cpp
+clang -std=c++11 -o pthread_permit_tracedump pthread_permit_tracedump.cpp
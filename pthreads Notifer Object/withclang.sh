@@ -3,4 +3,12 @@ clang -std=c++11 -o unittests -DUSE_PARALLEL pthread_permit.cpp unittests.cpp -l
 if [ "$?" != "0" ]; then
   clang -std=c++11 -o unittests pthread_permit.cpp unittests.cpp -lrt
 fi
+# The performance counters change the permit layout, so test them built in too
+clang -std=c++11 -DPTHREAD_PERMIT_ENABLE_COUNTERS=1 -o unittests_counters pthread_permit.cpp unittests.cpp -lrt && ./unittests_counters
+# Tracing is compiled out by default, so test the trace rings built in too
+clang -std=c++11 -DPTHREAD_PERMIT_ENABLE_TRACE=1 -o unittests_trace pthread_permit.cpp unittests.cpp -lrt && ./unittests_trace
+# The coroutine adapter and its tests need C++ 20
+clang -std=c++20 -o unittests_cxx20 pthread_permit.cpp unittests.cpp -lrt && ./unittests_cxx20
 clang -std=c++11 -o pthread_permit_speedtest pthread_permit.cpp pthread_permit_speedtest.cpp -lrt
+cp pthread_permit_tracedump.c pthread_permit_tracedump.cpp
+clang -std=c++11 -o pthread_permit_tracedump pthread_permit_tracedump.cpp
@@ -2,4 +2,11 @@ g++ -std=c++0x -g -o unittests -DUSE_PARALLEL pthread_permit.c unittests.cpp -lr
 if [ "$?" != "0" ]; then
   g++ -std=c++0x -g -o unittests pthread_permit.c unittests.cpp -lrt
 fi
+# The performance counters change the permit layout, so test them built in too
+g++ -std=c++0x -g -DPTHREAD_PERMIT_ENABLE_COUNTERS=1 -o unittests_counters pthread_permit.c unittests.cpp -lrt && ./unittests_counters
+# Tracing is compiled out by default, so test the trace rings built in too
+g++ -std=c++0x -g -DPTHREAD_PERMIT_ENABLE_TRACE=1 -o unittests_trace pthread_permit.c unittests.cpp -lrt && ./unittests_trace
+# The coroutine adapter and its tests need C++ 20
+g++ -std=c++20 -g -o unittests_cxx20 pthread_permit.c unittests.cpp -lrt && ./unittests_cxx20
 g++ -std=c++0x -g -o pthread_permit_speedtest pthread_permit.c pthread_permit_speedtest.cpp -lrt
+g++ -std=c++0x -g -o pthread_permit_tracedump pthread_permit_tracedump.c